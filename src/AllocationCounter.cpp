@@ -0,0 +1,76 @@
+/*
+ * AllocationCounter.cpp
+ *
+ *  Counts the heap allocations of the calling thread, to check that the
+ *  per-frame processing reuses its buffers. Only active when the library is
+ *  built with PNP_COUNT_ALLOCATIONS, which replaces the global operator new.
+ */
+
+#include "AllocationCounter.h"
+
+#ifdef PNP_COUNT_ALLOCATIONS
+
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+
+// Per thread, so the count of a frame is not mixed with the other threads
+thread_local long long allocations = 0;
+
+void* countedAlloc(std::size_t size)
+{
+  ++allocations;
+  void *p = std::malloc(size > 0 ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+}
+
+void* operator new(std::size_t size) { return countedAlloc(size); }
+void* operator new[](std::size_t size) { return countedAlloc(size); }
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+  ++allocations;
+  return std::malloc(size > 0 ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+  ++allocations;
+  return std::malloc(size > 0 ? size : 1);
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void *p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+
+bool allocationCountEnabled()
+{
+  return true;
+}
+
+long long allocationCount()
+{
+  return allocations;
+}
+
+#else
+
+bool allocationCountEnabled()
+{
+  return false;
+}
+
+long long allocationCount()
+{
+  return 0;
+}
+
+#endif
@@ -0,0 +1,18 @@
+/*
+ * AllocationCounter.h
+ *
+ *  Counts the heap allocations of the calling thread, to check that the
+ *  per-frame processing reuses its buffers. Only active when the library is
+ *  built with PNP_COUNT_ALLOCATIONS, which replaces the global operator new.
+ */
+
+#ifndef ALLOCATIONCOUNTER_H_
+#define ALLOCATIONCOUNTER_H_
+
+// True if the allocations are counted
+bool allocationCountEnabled();
+
+// The number of operator new calls of the calling thread so far, 0 if not counted
+long long allocationCount();
+
+#endif /* ALLOCATIONCOUNTER_H_ */
@@ -0,0 +1,88 @@
+/*
+ * GroundTruth.cpp
+ *
+ *  The camera and the true pose of every frame of a synthetic video.
+ */
+
+#include "GroundTruth.h"
+
+GroundTruth::GroundTruth() : fps(0)
+{
+  for (int i = 0; i < 4; ++i) camera_params[i] = 0;
+}
+
+std::string GroundTruth::pathOf(const std::string &video_path)
+{
+  size_t dot = video_path.find_last_of('.');
+  size_t slash = video_path.find_last_of('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return video_path + "_gt.yml";
+  return video_path.substr(0, dot) + "_gt.yml";
+}
+
+void GroundTruth::clear()
+{
+  rotations_.clear();
+  translations_.clear();
+}
+
+void GroundTruth::add(const cv::Mat &R, const cv::Mat &t)
+{
+  rotations_.push_back(R.clone());
+  translations_.push_back(t.clone());
+}
+
+// The poses are stored as two matrices, one row per frame: the 9 elements of R
+// row by row, and t
+bool GroundTruth::save(const std::string &path) const
+{
+  cv::FileStorage storage(path, cv::FileStorage::WRITE);
+  if (!storage.isOpened()) return false;
+
+  cv::Mat rotations((int)rotations_.size(), 9, CV_64F), translations((int)translations_.size(), 3, CV_64F);
+  for (int i = 0; i < size(); ++i)
+  {
+    rotations_[i].reshape(1, 1).convertTo(rotations.row(i), CV_64F);
+    translations_[i].reshape(1, 1).convertTo(translations.row(i), CV_64F);
+  }
+
+  storage << "intrinsics" << cv::Mat(1, 4, CV_64F, (void*)camera_params);
+  storage << "width" << frame_size.width;
+  storage << "height" << frame_size.height;
+  storage << "fps" << fps;
+  storage << "rotations" << rotations;
+  storage << "translations" << translations;
+
+  storage.release();
+  return true;
+}
+
+bool GroundTruth::load(const std::string &path)
+{
+  clear();
+
+  cv::FileStorage storage(path, cv::FileStorage::READ);
+  if (!storage.isOpened()) return false;
+
+  cv::Mat intrinsics, rotations, translations;
+  storage["intrinsics"] >> intrinsics;
+  storage["width"] >> frame_size.width;
+  storage["height"] >> frame_size.height;
+  storage["fps"] >> fps;
+  storage["rotations"] >> rotations;
+  storage["translations"] >> translations;
+  storage.release();
+
+  if (intrinsics.total() != 4 || rotations.cols != 9 || translations.cols != 3 || rotations.rows != translations.rows)
+  {
+    return false;
+  }
+
+  intrinsics.convertTo(intrinsics, CV_64F);
+  for (int i = 0; i < 4; ++i) camera_params[i] = intrinsics.at<double>(i);
+
+  for (int i = 0; i < rotations.rows; ++i)
+  {
+    add(rotations.row(i).reshape(1, 3), translations.row(i).reshape(1, 3));
+  }
+  return true;
+}
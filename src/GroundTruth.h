@@ -0,0 +1,44 @@
+/*
+ * GroundTruth.h
+ *
+ *  The camera and the true pose of every frame of a synthetic video.
+ */
+
+#ifndef GROUNDTRUTH_H_
+#define GROUNDTRUTH_H_
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+class GroundTruth
+{
+public:
+  GroundTruth();
+
+  // The file next to a video: its path without the extension, then "_gt.yml"
+  static std::string pathOf(const std::string &video_path);
+
+  bool load(const std::string &path);
+  bool save(const std::string &path) const;
+
+  void clear();
+  void add(const cv::Mat &R, const cv::Mat &t);
+
+  int size() const { return (int)rotations_.size(); }
+  const cv::Mat& R(int frame) const { return rotations_[frame]; }
+  const cv::Mat& t(int frame) const { return translations_[frame]; }
+
+  /** Intrinsic camera parameters: fx, fy, cx, cy */
+  double camera_params[4];
+  /** The frame size and rate of the video */
+  cv::Size frame_size;
+  double fps;
+
+private:
+  /** The object to camera rotation and translation of each frame */
+  std::vector<cv::Mat> rotations_, translations_;
+};
+
+#endif /* GROUNDTRUTH_H_ */
@@ -0,0 +1,90 @@
+/*
+ * LatencyController.cpp
+ *
+ *  Tunes the feature budget of the detector and the RANSAC iterations cap
+ *  per frame to meet a target frame latency.
+ */
+
+#include "LatencyController.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+
+// Weight of the last frame in the smoothed measurements
+const double SMOOTHING = 0.3;
+// Largest change of the feature budget from one frame to the next
+const double MAX_STEP = 1.25;
+
+double smooth(double average, double value)
+{
+  return average < 0 ? value : (1.0 - SMOOTHING) * average + SMOOTHING * value;
+}
+
+}
+
+LatencyController::LatencyController(const cv::Ptr<cv::ORB> &detector, double target_ms, int min_inliers,
+                                     double confidence, int min_features, int max_features,
+                                     int min_iterations, int max_iterations, int iterations, int sample_size)
+  : detector_(detector), target_ms_(target_ms), min_inliers_(min_inliers), confidence_(confidence),
+    sample_size_(sample_size), min_features_(min_features), max_features_(std::max(min_features, max_features)),
+    min_iterations_(min_iterations), max_iterations_(std::max(min_iterations, max_iterations)),
+    features_(max_features_), iterations_(max_iterations_), ms_per_feature_(-1), ms_per_iteration_(-1),
+    inliers_(-1), inlier_ratio_(-1)
+{
+  // Start from the settings of the first frame, which runs before any update
+  features_ = std::min(std::max(detector_->getMaxFeatures(), min_features_), max_features_);
+  detector_->setMaxFeatures(features_);
+  iterations_ = std::min(std::max(iterations, min_iterations_), max_iterations_);
+}
+
+LatencyController::~LatencyController()
+{
+}
+
+void LatencyController::update(double detect_ms, double estimate_ms, double ransac_ms, int n_keypoints,
+                               int n_matches, int n_inliers)
+{
+  // 1. Smoothed costs and difficulty of the scene. The cost of a feature is taken over
+  // the keypoints actually detected, the budget is only an upper bound; the RANSAC time
+  // depends on the iterations cap, not on the features, and is accounted for separately
+  if (n_keypoints > 0)
+  {
+    ms_per_feature_ = smooth(ms_per_feature_, std::max(detect_ms + estimate_ms - ransac_ms, 0.0) / n_keypoints);
+  }
+  if (ransac_ms > 0)
+  {
+    ms_per_iteration_ = smooth(ms_per_iteration_, ransac_ms / iterations_);
+  }
+  inliers_ = smooth(inliers_, n_inliers);
+  inlier_ratio_ = smooth(inlier_ratio_, n_matches > 0 ? (double)n_inliers / n_matches : 0.0);
+
+  // 2. RANSAC iterations for the confidence at the observed inlier ratio,
+  // with some margin since the ratio of the next frame is not known
+  double p_good_sample = std::pow(inlier_ratio_, sample_size_);
+  double required = max_iterations_;
+  if (p_good_sample >= 1.0)
+  {
+    required = min_iterations_;
+  }
+  else if (p_good_sample > 0)
+  {
+    required = 1.5 * std::log(1.0 - confidence_) / std::log(1.0 - p_good_sample);
+  }
+  iterations_ = (int)std::min(std::max(required, (double)min_iterations_), (double)max_iterations_);
+
+  // 3. Feature budget: as many as the target latency affords once RANSAC is paid for,
+  // and on easy frames only as many as needed to keep twice the inliers the tracking needs
+  if (ms_per_feature_ < 0) return;
+
+  double ransac_budget = ms_per_iteration_ > 0 ? ms_per_iteration_ * iterations_ : 0.0;
+  double affordable = std::max(target_ms_ - ransac_budget, 0.0) / std::max(ms_per_feature_, 1e-6);
+  double needed = inliers_ > 0 ? features_ * (2.0 * min_inliers_) / inliers_ : max_features_;
+
+  double next = std::min(affordable, needed);
+  next = std::min(std::max(next, features_ / MAX_STEP), features_ * MAX_STEP);
+  features_ = std::min(std::max((int)next, min_features_), max_features_);
+  detector_->setMaxFeatures(features_);
+}
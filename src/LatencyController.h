@@ -0,0 +1,58 @@
+/*
+ * LatencyController.h
+ *
+ *  Tunes the feature budget of the detector and the RANSAC iterations cap
+ *  per frame to meet a target frame latency.
+ */
+
+#ifndef LATENCYCONTROLLER_H_
+#define LATENCYCONTROLLER_H_
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+class LatencyController
+{
+public:
+  // min_inliers is the inlier count the tracking needs, confidence the RANSAC
+  // confidence, iterations the RANSAC iterations cap the estimator starts with,
+  // sample_size the points of a RANSAC hypothesis
+  LatencyController(const cv::Ptr<cv::ORB> &detector, double target_ms, int min_inliers, double confidence,
+                    int min_features, int max_features, int min_iterations, int max_iterations,
+                    int iterations, int sample_size = 5);
+  virtual ~LatencyController();
+
+  // Feed the stage times, the RANSAC share of estimate_ms, the detected keypoints and the
+  // matching result of the last frame and choose the settings of the next one. The feature
+  // budget is set on the detector.
+  void update(double detect_ms, double estimate_ms, double ransac_ms, int n_keypoints,
+              int n_matches, int n_inliers);
+
+  double target() const { return target_ms_; }
+  int features() const { return features_; }
+  int iterations() const { return iterations_; }
+
+private:
+  /** The detector whose feature budget is tuned */
+  cv::Ptr<cv::ORB> detector_;
+  /** The target latency of a frame in ms */
+  double target_ms_;
+  /** Inliers needed by the tracking, the budget aims at twice as many */
+  int min_inliers_;
+  /** RANSAC confidence and hypothesis size, to derive the iterations from the inlier ratio */
+  double confidence_;
+  int sample_size_;
+  /** Bounds of the settings */
+  int min_features_, max_features_;
+  int min_iterations_, max_iterations_;
+  /** Current settings */
+  int features_;
+  int iterations_;
+  /** Smoothed measurements, negative until the first update */
+  double ms_per_feature_;
+  double ms_per_iteration_;
+  double inliers_;
+  double inlier_ratio_;
+};
+
+#endif /* LATENCYCONTROLLER_H_ */
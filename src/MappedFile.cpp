@@ -0,0 +1,117 @@
+/*
+ * MappedFile.cpp
+ *
+ *  Read-only memory mapping of a whole file.
+ */
+
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() : data_(NULL), size_(0)
+#ifdef _WIN32
+  , file_(INVALID_HANDLE_VALUE), mapping_(NULL)
+#else
+  , fd_(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string &path)
+{
+  close();
+
+  file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file_ == INVALID_HANDLE_VALUE) return false;
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file_, &file_size) || file_size.QuadPart == 0)
+  {
+    close();
+    return false;
+  }
+
+  mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping_ == NULL)
+  {
+    close();
+    return false;
+  }
+
+  data_ = (unsigned char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+  if (data_ == NULL)
+  {
+    close();
+    return false;
+  }
+
+  size_ = (size_t)file_size.QuadPart;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (data_ != NULL) UnmapViewOfFile(data_);
+  if (mapping_ != NULL) CloseHandle(mapping_);
+  if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+
+  data_ = NULL;
+  size_ = 0;
+  mapping_ = NULL;
+  file_ = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool MappedFile::open(const std::string &path)
+{
+  close();
+
+  fd_ = ::open(path.c_str(), O_RDONLY);
+  if (fd_ < 0) return false;
+
+  struct stat file_stat;
+  if (fstat(fd_, &file_stat) != 0 || file_stat.st_size == 0)
+  {
+    close();
+    return false;
+  }
+
+  void *addr = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+  if (addr == MAP_FAILED)
+  {
+    close();
+    return false;
+  }
+
+  data_ = (unsigned char*)addr;
+  size_ = (size_t)file_stat.st_size;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (data_ != NULL) munmap(data_, size_);
+  if (fd_ >= 0) ::close(fd_);
+
+  data_ = NULL;
+  size_ = 0;
+  fd_ = -1;
+}
+
+#endif
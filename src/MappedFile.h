@@ -0,0 +1,43 @@
+/*
+ * MappedFile.h
+ *
+ *  Read-only memory mapping of a whole file.
+ */
+
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+#include <cstddef>
+#include <string>
+
+class MappedFile
+{
+public:
+  MappedFile();
+  virtual ~MappedFile();
+
+  bool open(const std::string &path);
+  void close();
+
+  const unsigned char* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool isOpened() const { return data_ != NULL; }
+
+private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  /** The first byte of the mapped file */
+  unsigned char *data_;
+  /** The size in bytes of the mapped file */
+  size_t size_;
+#ifdef _WIN32
+  /** The file and file mapping handles */
+  void *file_, *mapping_;
+#else
+  /** The file descriptor */
+  int fd_;
+#endif
+};
+
+#endif /* MAPPEDFILE_H_ */
@@ -5,6 +5,8 @@
  *      Author: edgar
  */
 
+#include <algorithm>
+
 #include "Mesh.h"
 #include "CsvReader.h"
 
@@ -47,7 +49,7 @@ Ray::~Ray()
 // --------------------------------------------------- //
 
 /** The default constructor of the ObjectMesh Class */
-Mesh::Mesh() : list_vertex_(0) , list_triangles_(0)
+Mesh::Mesh() : list_vertex_(0) , list_triangles_(0), list_edges_(0)
 {
   id_ = 0;
   num_vertexs_ = 0;
@@ -79,4 +81,28 @@ void Mesh::load(const std::string path)
   num_vertexs_ = (int)list_vertex_.size();
   num_triangles_ = (int)list_triangles_.size();
 
+  // Shared triangle edges are drawn only once
+  buildEdges();
+
+}
+
+/** Build the list of unique edges from the triangles list **/
+void Mesh::buildEdges()
+{
+  list_edges_.clear();
+  list_edges_.reserve(list_triangles_.size() * 3);
+
+  for (size_t i = 0; i < list_triangles_.size(); ++i)
+  {
+    const std::vector<int> &triangle = list_triangles_[i];
+    for (int j = 0; j < 3; ++j)
+    {
+      int v0 = triangle[j];
+      int v1 = triangle[(j + 1) % 3];
+      list_edges_.push_back(std::make_pair(std::min(v0, v1), std::max(v0, v1)));
+    }
+  }
+
+  std::sort(list_edges_.begin(), list_edges_.end());
+  list_edges_.erase(std::unique(list_edges_.begin(), list_edges_.end()), list_edges_.end());
 }
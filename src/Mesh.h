@@ -65,12 +65,16 @@ public:
   virtual ~Mesh();
 
   std::vector<std::vector<int> > getTrianglesList() const { return list_triangles_; }
+  const std::vector<cv::Point3f>& getVertices() const { return list_vertex_; }
+  const std::vector<std::pair<int, int> >& getEdgesList() const { return list_edges_; }
   cv::Point3f getVertex(int pos) const { return list_vertex_[pos]; }
   int getNumVertices() const { return num_vertexs_; }
 
   void load(const std::string path_file);
 
 private:
+  void buildEdges();
+
   /** The identification number of the mesh */
   int id_;
   /** The current number of vertices in the mesh */
@@ -81,6 +85,8 @@ private:
   std::vector<cv::Point3f> list_vertex_;
   /* The list of triangles of the mesh */
   std::vector<std::vector<int> > list_triangles_;
+  /* The list of unique edges of the mesh, as sorted vertex index pairs */
+  std::vector<std::pair<int, int> > list_edges_;
 };
 
 #endif /* OBJECTMESH_H_ */
@@ -0,0 +1,208 @@
+/*
+ * MeshRenderer.cpp
+ *
+ *  Software rendering of a mesh textured from registered images, to make
+ *  synthetic frames with a known pose.
+ */
+
+#include "MeshRenderer.h"
+
+#include <algorithm>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+namespace
+{
+
+// Sub-pixel bits of the polygon filling
+const int FILL_SHIFT = 4;
+
+cv::Point2f project(const double params[], const cv::Vec3d &p)
+{
+  return cv::Point2f((float)(params[0] * p[0] / p[2] + params[2]), (float)(params[1] * p[1] / p[2] + params[3]));
+}
+
+double triangleArea(const cv::Point2f p[3])
+{
+  return 0.5 * std::abs((p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (p[1].y - p[0].y));
+}
+
+cv::Matx33d toMatx33d(const cv::Mat &R)
+{
+  cv::Mat R64;
+  R.convertTo(R64, CV_64F);
+  return cv::Matx33d(R64.ptr<double>());
+}
+
+cv::Vec3d toVec3d(const cv::Mat &t)
+{
+  cv::Mat t64;
+  t.convertTo(t64, CV_64F);
+  return cv::Vec3d(t64.at<double>(0), t64.at<double>(1), t64.at<double>(2));
+}
+
+// The far triangles are drawn first
+struct FartherFirst
+{
+  bool operator()(const std::pair<double, int> &a, const std::pair<double, int> &b) const { return a.first > b.first; }
+};
+
+}
+
+MeshRenderer::MeshRenderer(const Mesh &mesh)
+  : vertices_(mesh.getVertices()), triangles_(mesh.getTrianglesList()), size_(0),
+    textures_(triangles_.size())
+{
+  if (vertices_.empty()) return;
+
+  cv::Point3f lo = vertices_[0], hi = vertices_[0];
+  for (size_t i = 1; i < vertices_.size(); ++i)
+  {
+    lo.x = std::min(lo.x, vertices_[i].x); hi.x = std::max(hi.x, vertices_[i].x);
+    lo.y = std::min(lo.y, vertices_[i].y); hi.y = std::max(hi.y, vertices_[i].y);
+    lo.z = std::min(lo.z, vertices_[i].z); hi.z = std::max(hi.z, vertices_[i].z);
+  }
+  center_ = cv::Point3d((lo.x + hi.x) / 2, (lo.y + hi.y) / 2, (lo.z + hi.z) / 2);
+  size_ = cv::norm(hi - lo);
+}
+
+// The winding of the triangles is not consistent in the PLY files, so the normal
+// of a triangle is taken pointing away from the mesh center: right for convex meshes
+bool MeshRenderer::cameraPoints(int triangle, const cv::Matx33d &R, const cv::Vec3d &t, cv::Vec3d points[4]) const
+{
+  const std::vector<int> &indices = triangles_[triangle];
+
+  cv::Vec3d v[3];
+  for (int i = 0; i < 3; ++i)
+  {
+    const cv::Point3f &p = vertices_[indices[i]];
+    v[i] = cv::Vec3d(p.x, p.y, p.z);
+  }
+  cv::Vec3d centroid = (v[0] + v[1] + v[2]) * (1.0 / 3);
+  cv::Vec3d normal = (v[1] - v[0]).cross(v[2] - v[0]);
+  if (normal.dot(centroid - cv::Vec3d(center_.x, center_.y, center_.z)) < 0) normal = -normal;
+
+  // Facing the camera: the camera center is on the outer side of the triangle
+  cv::Vec3d camera = -(R.t() * t);
+  if (normal.dot(camera - centroid) <= 0) return false;
+
+  for (int i = 0; i < 3; ++i) points[i] = R * v[i] + t;
+  points[3] = R * centroid + t;
+
+  for (int i = 0; i < 4; ++i)
+  {
+    if (points[i][2] <= 1e-6) return false;
+  }
+  return true;
+}
+
+int MeshRenderer::addView(const cv::Mat &image, const double params[], const cv::Mat &R, const cv::Mat &t)
+{
+  const cv::Matx33d R_view = toMatx33d(R);
+  const cv::Vec3d t_view = toVec3d(t);
+  const int view = (int)views_.size();
+
+  int textured = 0;
+  for (int i = 0; i < (int)triangles_.size(); ++i)
+  {
+    cv::Vec3d points[4];
+    if (!cameraPoints(i, R_view, t_view, points)) continue;
+
+    Texture texture;
+    bool inside = true;
+    for (int k = 0; k < 4; ++k)
+    {
+      texture.points[k] = project(params, points[k]);
+      inside = inside && texture.points[k].x >= 0 && texture.points[k].y >= 0 &&
+               texture.points[k].x <= image.cols - 1 && texture.points[k].y <= image.rows - 1;
+    }
+    texture.area = triangleArea(texture.points);
+
+    if (!inside || texture.area <= textures_[i].area) continue;
+
+    texture.view = view;
+    textures_[i] = texture;
+    ++textured;
+  }
+
+  views_.push_back(image);
+  return textured;
+}
+
+void MeshRenderer::render(const double params[], const cv::Mat &R, const cv::Mat &t, cv::Mat &frame) const
+{
+  const cv::Matx33d R_cam = toMatx33d(R);
+  const cv::Vec3d t_cam = toVec3d(t);
+  const cv::Rect frame_rect(0, 0, frame.cols, frame.rows);
+
+  // Painter's algorithm over the triangles facing the camera
+  std::vector<std::pair<double, int> > order;
+  for (int i = 0; i < (int)triangles_.size(); ++i)
+  {
+    cv::Vec3d points[4];
+    if (cameraPoints(i, R_cam, t_cam, points)) order.push_back(std::make_pair(points[3][2], i));
+  }
+  std::sort(order.begin(), order.end(), FartherFirst());
+
+  cv::Mat patch, mask;
+  for (size_t k = 0; k < order.size(); ++k)
+  {
+    const int i = order[k].second;
+    cv::Vec3d points[4];
+    cameraPoints(i, R_cam, t_cam, points);
+
+    cv::Point2f projected[4];
+    for (int p = 0; p < 4; ++p) projected[p] = project(params, points[p]);
+
+    std::vector<cv::Point2f> corners(projected, projected + 3);
+    cv::Rect roi = cv::boundingRect(corners);
+    roi.width += 1;
+    roi.height += 1;
+    roi &= frame_rect;
+    if (roi.area() == 0) continue;
+
+    cv::Point polygon[3];
+    for (int p = 0; p < 3; ++p)
+    {
+      polygon[p] = cv::Point(cvRound((projected[p].x - roi.x) * (1 << FILL_SHIFT)),
+                             cvRound((projected[p].y - roi.y) * (1 << FILL_SHIFT)));
+    }
+
+    const Texture &texture = textures_[i];
+    if (texture.view < 0)
+    {
+      cv::Mat target = frame(roi);
+      cv::fillConvexPoly(target, polygon, 3, cv::Scalar(128, 128, 128), cv::LINE_AA, FILL_SHIFT);
+      continue;
+    }
+
+    // The homography from the view to the frame in the plane of the triangle,
+    // shifted to the region of interest
+    for (int p = 0; p < 4; ++p) projected[p] -= cv::Point2f((float)roi.x, (float)roi.y);
+    cv::Mat H = cv::getPerspectiveTransform(texture.points, projected);
+    cv::warpPerspective(views_[texture.view], patch, H, roi.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+
+    mask.create(roi.size(), CV_8UC1);
+    mask.setTo(cv::Scalar(0));
+    cv::fillConvexPoly(mask, polygon, 3, cv::Scalar(255), cv::LINE_8, FILL_SHIFT);
+
+    cv::Mat target = frame(roi);
+    patch.copyTo(target, mask);
+  }
+}
+
+cv::Rect MeshRenderer::boundingRect(const double params[], const cv::Mat &R, const cv::Mat &t) const
+{
+  const cv::Matx33d R_cam = toMatx33d(R);
+  const cv::Vec3d t_cam = toVec3d(t);
+
+  std::vector<cv::Point2f> projected;
+  for (size_t i = 0; i < vertices_.size(); ++i)
+  {
+    const cv::Point3f &p = vertices_[i];
+    cv::Vec3d q = R_cam * cv::Vec3d(p.x, p.y, p.z) + t_cam;
+    if (q[2] <= 1e-6) return cv::Rect();
+    projected.push_back(project(params, q));
+  }
+  return projected.empty() ? cv::Rect() : cv::boundingRect(projected);
+}
@@ -0,0 +1,65 @@
+/*
+ * MeshRenderer.h
+ *
+ *  Software rendering of a mesh textured from registered images, to make
+ *  synthetic frames with a known pose.
+ */
+
+#ifndef MESHRENDERER_H_
+#define MESHRENDERER_H_
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "Mesh.h"
+
+class MeshRenderer
+{
+public:
+  explicit MeshRenderer(const Mesh &mesh);
+
+  // Texture the triangles seen by an image of known intrinsics (fx, fy, cx, cy)
+  // and pose: a triangle keeps the image that sees it the largest. Returns the
+  // number of triangles textured from this image.
+  int addView(const cv::Mat &image, const double params[], const cv::Mat &R, const cv::Mat &t);
+
+  // Draw the mesh seen by a camera of the given intrinsics and pose over the frame.
+  // The triangles no image sees are filled with a flat color.
+  void render(const double params[], const cv::Mat &R, const cv::Mat &t, cv::Mat &frame) const;
+
+  // The bounding box of the mesh in a frame, empty if it is behind the camera
+  cv::Rect boundingRect(const double params[], const cv::Mat &R, const cv::Mat &t) const;
+
+  // The center of the bounding box of the mesh and its diagonal
+  cv::Point3d center() const { return center_; }
+  double size() const { return size_; }
+
+private:
+  // Where a triangle is taken from: its three vertices and the projection of
+  // its centroid in one of the views, the 4 points of a plane homography
+  struct Texture
+  {
+    Texture() : view(-1), area(0) {}
+
+    int view;
+    cv::Point2f points[4];
+    double area;
+  };
+
+  // The camera coordinates of the triangle vertices and centroid, false if a
+  // point is behind the camera or the triangle faces away from it
+  bool cameraPoints(int triangle, const cv::Matx33d &R, const cv::Vec3d &t, cv::Vec3d points[4]) const;
+
+  /** The mesh vertices and triangles */
+  std::vector<cv::Point3f> vertices_;
+  std::vector<std::vector<int> > triangles_;
+  /** The center of the mesh and its bounding box diagonal */
+  cv::Point3d center_;
+  double size_;
+  /** The registered images and the texture of each triangle */
+  std::vector<cv::Mat> views_;
+  std::vector<Texture> textures_;
+};
+
+#endif /* MESHRENDERER_H_ */
@@ -5,10 +5,116 @@
  *      Author: edgar
  */
 
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <map>
+
+#include <opencv2/calib3d/calib3d.hpp>
+
 #include "Model.h"
 #include "CsvWriter.h"
 
-Model::Model() : list_points2d_in_(0), list_points2d_out_(0), list_points3d_in_(0)
+namespace
+{
+
+/*
+ * Binary model format, in native byte order:
+ *
+ *   ModelFileHeader
+ *   points_3d    num_points x cv::Point3f
+ *   points_2d    num_points x cv::Point2f        (optional)
+ *   keypoints    num_points x ModelFileKeyPoint  (optional)
+ *   normals      num_points x cv::Point3f        (optional)
+ *   sizes        num_points x float               (optional, since version 2)
+ *   descriptors  num_points x descriptor_size bytes
+ *
+ * Every section starts at a 16 bytes aligned offset, an offset of 0 marks
+ * an absent section. The file can be mapped and its sections used in place.
+ */
+
+const char MODEL_FILE_MAGIC[4] = { 'P', 'N', 'P', 'M' };
+const uint32_t MODEL_FILE_VERSION = 2;
+const uint64_t MODEL_FILE_ALIGNMENT = 16;
+
+struct ModelFileHeader
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t num_points;
+  int32_t descriptor_type;
+  uint32_t descriptor_cols;
+  uint32_t descriptor_size;   // bytes per descriptor
+  uint32_t reserved;
+  uint64_t points3d_offset;
+  uint64_t points2d_offset;
+  uint64_t keypoints_offset;
+  uint64_t normals_offset;
+  uint64_t descriptors_offset;
+  uint64_t file_size;
+  uint64_t feature_sizes_offset;   // version 2
+};
+
+/* Version 1 headers end before feature_sizes_offset */
+const uint32_t MODEL_FILE_HEADER_SIZE_V1 = (uint32_t)offsetof(ModelFileHeader, feature_sizes_offset);
+
+struct ModelFileKeyPoint
+{
+  float x, y;
+  float size;
+  float angle;
+  float response;
+  int32_t octave;
+  int32_t class_id;
+  int32_t reserved;
+};
+
+uint64_t alignOffset(uint64_t offset)
+{
+  return (offset + MODEL_FILE_ALIGNMENT - 1) & ~(MODEL_FILE_ALIGNMENT - 1);
+}
+
+bool hasExtension(const std::string &path, const std::string &ext)
+{
+  return path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+bool isSectionValid(uint64_t offset, uint64_t bytes, uint64_t file_size)
+{
+  return offset == 0 || (offset % MODEL_FILE_ALIGNMENT == 0 && offset <= file_size && bytes <= file_size - offset);
+}
+
+void padTo(std::ofstream &file, uint64_t offset)
+{
+  while ((uint64_t)file.tellp() < offset) file.put(0);
+}
+
+/* A cell of the uniform grid used to find nearby 3D points */
+typedef std::pair<int, std::pair<int, int> > GridCell;
+
+GridCell gridCell(const cv::Point3f &point, float cell_size, int dx = 0, int dy = 0, int dz = 0)
+{
+  return std::make_pair(cvFloor(point.x / cell_size) + dx,
+                        std::make_pair(cvFloor(point.y / cell_size) + dy, cvFloor(point.z / cell_size) + dz));
+}
+
+/* Sorts point indices by decreasing keypoint response */
+struct ResponseGreater
+{
+  explicit ResponseGreater(const std::vector<cv::KeyPoint> &keypoints) : keypoints_(keypoints) {}
+  bool operator()(int a, int b) const { return keypoints_[a].response > keypoints_[b].response; }
+  const std::vector<cv::KeyPoint> &keypoints_;
+};
+
+}
+
+Model::Model() : list_points2d_in_(0), list_points2d_out_(0), list_points3d_in_(0), list_normals_(0),
+                 list_feature_sizes_(0)
 {
   n_correspondences_ = 0;
 }
@@ -40,9 +146,210 @@ void Model::add_keypoint(const cv::KeyPoint &kp)
   list_keypoints_.push_back(kp);
 }
 
+void Model::add_normal(const cv::Point3f &normal)
+{
+  list_normals_.push_back(normal);
+}
+
+void Model::add_feature_size(float size)
+{
+  list_feature_sizes_.push_back(size);
+}
+
+
+/** Merge the descriptors that land on the same 3D point.
+ *
+ *  Points closer than radius whose descriptors are closer than
+ *  max_descriptor_distance are clustered together, and only the strongest
+ *  keypoint of each cluster is kept. Distinct descriptors at the same place
+ *  (e.g. seen from very different viewpoints) are all kept. */
+int Model::compact(float radius, double max_descriptor_distance)
+{
+  const int num_points = (int)list_points3d_in_.size();
+  if (num_points == 0 || radius <= 0) return 0;
+
+  const bool has_points2d = (int)list_points2d_in_.size() == num_points;
+  const bool has_keypoints = (int)list_keypoints_.size() == num_points;
+  const bool has_normals = (int)list_normals_.size() == num_points;
+  const bool has_feature_sizes = (int)list_feature_sizes_.size() == num_points;
+  const int norm_type = descriptors_.depth() == CV_8U ? cv::NORM_HAMMING : cv::NORM_L2;
+
+  // Strongest keypoints become the cluster representatives
+  std::vector<int> order(num_points);
+  for (int i = 0; i < num_points; ++i) order[i] = i;
+  if (has_keypoints)
+  {
+    std::stable_sort(order.begin(), order.end(), ResponseGreater(list_keypoints_));
+  }
+
+  std::map<GridCell, std::vector<int> > grid;
+  std::vector<int> kept;
+  kept.reserve(num_points);
+
+  for (int n = 0; n < num_points; ++n)
+  {
+    const int i = order[n];
+    const cv::Point3f &point = list_points3d_in_[i];
+    bool duplicated = false;
+
+    for (int dx = -1; dx <= 1 && !duplicated; ++dx)
+    for (int dy = -1; dy <= 1 && !duplicated; ++dy)
+    for (int dz = -1; dz <= 1 && !duplicated; ++dz)
+    {
+      std::map<GridCell, std::vector<int> >::const_iterator cell = grid.find(gridCell(point, radius, dx, dy, dz));
+      if (cell == grid.end()) continue;
 
-/** Save a CSV file and fill the object mesh */
+      for (size_t k = 0; k < cell->second.size(); ++k)
+      {
+        const int j = cell->second[k];
+        if (cv::norm(point - list_points3d_in_[j]) <= radius &&
+            cv::norm(descriptors_.row(i), descriptors_.row(j), norm_type) <= max_descriptor_distance)
+        {
+          duplicated = true;
+          break;
+        }
+      }
+    }
+
+    if (!duplicated)
+    {
+      grid[gridCell(point, radius)].push_back(i);
+      kept.push_back(i);
+    }
+  }
+
+  // Keep the original ordering of the representatives
+  std::sort(kept.begin(), kept.end());
+
+  std::vector<cv::Point3f> points3d(kept.size());
+  std::vector<cv::Point2f> points2d;
+  std::vector<cv::KeyPoint> keypoints;
+  std::vector<cv::Point3f> normals;
+  std::vector<float> feature_sizes;
+  cv::Mat descriptors((int)kept.size(), descriptors_.cols, descriptors_.type());
+
+  for (size_t k = 0; k < kept.size(); ++k)
+  {
+    points3d[k] = list_points3d_in_[kept[k]];
+    if (has_points2d) points2d.push_back(list_points2d_in_[kept[k]]);
+    if (has_keypoints) keypoints.push_back(list_keypoints_[kept[k]]);
+    if (has_normals) normals.push_back(list_normals_[kept[k]]);
+    if (has_feature_sizes) feature_sizes.push_back(list_feature_sizes_[kept[k]]);
+    descriptors_.row(kept[k]).copyTo(descriptors.row((int)k));
+  }
+
+  list_points3d_in_.swap(points3d);
+  list_points2d_in_.swap(points2d);
+  list_keypoints_.swap(keypoints);
+  list_normals_.swap(normals);
+  list_feature_sizes_.swap(feature_sizes);
+  descriptors_ = descriptors;
+  mapping_ = cv::Ptr<MappedFile>();
+  n_correspondences_ = (int)kept.size();
+
+  return num_points - (int)kept.size();
+}
+
+/** Save the model, the file format is chosen by extension */
 void Model::save(const std::string path)
+{
+  if (hasExtension(path, ".bin"))
+  {
+    saveBinary(path);
+  }
+  else
+  {
+    saveYAML(path);
+  }
+}
+
+/** Load the model, the file format is chosen by extension */
+void Model::load(const std::string path)
+{
+  if (hasExtension(path, ".bin"))
+  {
+    loadBinary(path);
+  }
+  else
+  {
+    loadYAML(path);
+  }
+
+  n_correspondences_ = (int)list_points3d_in_.size();
+
+  // Models registered before the feature sizes were stored can still be scale gated
+  if (list_feature_sizes_.size() != list_points3d_in_.size())
+  {
+    list_feature_sizes_.clear();
+    deriveFeatureSizes();
+  }
+}
+
+/** Estimate the feature sizes from the keypoint sizes and the registration pose
+ *
+ *  A keypoint of size s seen at depth z has the diameter s * z / fx in model units.
+ *  The registration camera is not stored, so the pose is solved with a nominal
+ *  camera centred on the registered points: z / fx is what the projection fixes,
+ *  and it is nearly independent of the assumed focal length. Models merged from
+ *  several views do not fit a single pose and are left without feature sizes.
+ */
+bool Model::deriveFeatureSizes()
+{
+  const size_t num_points = list_points3d_in_.size();
+  if (num_points < 4 || list_points2d_in_.size() != num_points || list_keypoints_.size() != num_points)
+  {
+    return false;
+  }
+
+  cv::Point2f min_point = list_points2d_in_[0], max_point = list_points2d_in_[0];
+  for (size_t i = 1; i < num_points; ++i)
+  {
+    min_point.x = std::min(min_point.x, list_points2d_in_[i].x);
+    min_point.y = std::min(min_point.y, list_points2d_in_[i].y);
+    max_point.x = std::max(max_point.x, list_points2d_in_[i].x);
+    max_point.y = std::max(max_point.y, list_points2d_in_[i].y);
+  }
+  const double extent = std::max(max_point.x - min_point.x, max_point.y - min_point.y);
+  if (extent <= 0) return false;
+
+  // The object filling about half of the registration image
+  const double fx = 2.0 * extent;
+  const cv::Matx33d A(fx, 0, 0.5 * (min_point.x + max_point.x),
+                      0, fx, 0.5 * (min_point.y + max_point.y),
+                      0, 0, 1);
+
+  cv::Mat rvec, tvec;
+  if (!cv::solvePnP(list_points3d_in_, list_points2d_in_, A, cv::noArray(), rvec, tvec)) return false;
+
+  std::vector<cv::Point2f> projected;
+  cv::projectPoints(list_points3d_in_, rvec, tvec, A, cv::noArray(), projected);
+  double squared_error = 0;
+  for (size_t i = 0; i < num_points; ++i)
+  {
+    const cv::Point2f d = projected[i] - list_points2d_in_[i];
+    squared_error += d.x * d.x + d.y * d.y;
+  }
+  if (std::sqrt(squared_error / num_points) > 0.02 * extent) return false;
+
+  cv::Mat R;
+  cv::Rodrigues(rvec, R);
+
+  std::vector<float> feature_sizes(num_points);
+  for (size_t i = 0; i < num_points; ++i)
+  {
+    const cv::Point3f &p = list_points3d_in_[i];
+    const double depth = R.at<double>(2, 0) * p.x + R.at<double>(2, 1) * p.y +
+                         R.at<double>(2, 2) * p.z + tvec.at<double>(2);
+    if (depth <= 0) return false;
+    feature_sizes[i] = (float)(list_keypoints_[i].size * depth / fx);
+  }
+
+  list_feature_sizes_.swap(feature_sizes);
+  return true;
+}
+
+/** Save a YAML file using OpenCv functions */
+void Model::saveYAML(const std::string &path)
 {
   cv::Mat points3dmatrix = cv::Mat(list_points3d_in_);
   cv::Mat points2dmatrix = cv::Mat(list_points2d_in_);
@@ -53,21 +360,266 @@ void Model::save(const std::string path)
   storage << "points_2d" << points2dmatrix;
   storage << "keypoints" << list_keypoints_;
   storage << "descriptors" << descriptors_;
+  if (!list_normals_.empty())
+  {
+    storage << "normals" << cv::Mat(list_normals_);
+  }
+  if (!list_feature_sizes_.empty())
+  {
+    storage << "feature_sizes" << cv::Mat(list_feature_sizes_);
+  }
 
   storage.release();
 }
 
 /** Load a YAML file using OpenCv functions **/
-void Model::load(const std::string path)
+void Model::loadYAML(const std::string &path)
 {
-  cv::Mat points3d_mat;
+  cv::Mat points3d_mat, points2d_mat, normals_mat, feature_sizes_mat;
+
+  // The descriptors may wrap the mapped file: release them before unmapping it,
+  // or reading a matrix of the same size would write into the unmapped memory
+  descriptors_.release();
+  mapping_ = cv::Ptr<MappedFile>();
+  list_points2d_in_.clear();
+  list_keypoints_.clear();
+  list_normals_.clear();
+  list_feature_sizes_.clear();
 
   cv::FileStorage storage(path, cv::FileStorage::READ);
   storage["points_3d"] >> points3d_mat;
+  storage["points_2d"] >> points2d_mat;
+  storage["keypoints"] >> list_keypoints_;
   storage["descriptors"] >> descriptors_;
 
   points3d_mat.copyTo(list_points3d_in_);
+  if (!points2d_mat.empty()) points2d_mat.copyTo(list_points2d_in_);
+
+  // Normals are optional, older models do not have them
+  if (!storage["normals"].empty())
+  {
+    storage["normals"] >> normals_mat;
+    normals_mat.copyTo(list_normals_);
+  }
+  if (!storage["feature_sizes"].empty())
+  {
+    storage["feature_sizes"] >> feature_sizes_mat;
+    feature_sizes_mat.copyTo(list_feature_sizes_);
+  }
 
   storage.release();
 
 }
+
+/** Save the binary model format, see ModelFileHeader */
+void Model::saveBinary(const std::string &path)
+{
+  const uint32_t num_points = (uint32_t)descriptors_.rows;
+  if (list_points3d_in_.size() != num_points)
+  {
+    std::cerr << "Model: " << num_points << " descriptors for " << list_points3d_in_.size()
+              << " 3D points, not saving " << path << std::endl;
+    return;
+  }
+
+  const bool has_points2d = list_points2d_in_.size() == num_points;
+  const bool has_keypoints = list_keypoints_.size() == num_points;
+  const bool has_normals = list_normals_.size() == num_points;
+  const bool has_feature_sizes = list_feature_sizes_.size() == num_points;
+
+  // Section layout
+  ModelFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+  header.version = MODEL_FILE_VERSION;
+  header.header_size = (uint32_t)sizeof(ModelFileHeader);
+  header.num_points = num_points;
+  header.descriptor_type = descriptors_.type();
+  header.descriptor_cols = (uint32_t)descriptors_.cols;
+  header.descriptor_size = (uint32_t)(descriptors_.cols * descriptors_.elemSize());
+
+  uint64_t offset = alignOffset(sizeof(ModelFileHeader));
+  header.points3d_offset = offset;
+  offset = alignOffset(offset + num_points * sizeof(cv::Point3f));
+  if (has_points2d)
+  {
+    header.points2d_offset = offset;
+    offset = alignOffset(offset + num_points * sizeof(cv::Point2f));
+  }
+  if (has_keypoints)
+  {
+    header.keypoints_offset = offset;
+    offset = alignOffset(offset + num_points * sizeof(ModelFileKeyPoint));
+  }
+  if (has_normals)
+  {
+    header.normals_offset = offset;
+    offset = alignOffset(offset + num_points * sizeof(cv::Point3f));
+  }
+  if (has_feature_sizes)
+  {
+    header.feature_sizes_offset = offset;
+    offset = alignOffset(offset + num_points * sizeof(float));
+  }
+  header.descriptors_offset = offset;
+  header.file_size = offset + (uint64_t)num_points * header.descriptor_size;
+
+  std::ofstream file(path.c_str(), std::ofstream::out | std::ofstream::binary);
+  if (!file.is_open())
+  {
+    std::cerr << "Model: could not open " << path << " for writing" << std::endl;
+    return;
+  }
+
+  file.write((const char*)&header, sizeof(header));
+
+  padTo(file, header.points3d_offset);
+  if (num_points > 0) file.write((const char*)&list_points3d_in_[0], num_points * sizeof(cv::Point3f));
+
+  if (has_points2d)
+  {
+    padTo(file, header.points2d_offset);
+    if (num_points > 0) file.write((const char*)&list_points2d_in_[0], num_points * sizeof(cv::Point2f));
+  }
+
+  if (has_keypoints)
+  {
+    padTo(file, header.keypoints_offset);
+    for (uint32_t i = 0; i < num_points; ++i)
+    {
+      const cv::KeyPoint &kp = list_keypoints_[i];
+      ModelFileKeyPoint record = { kp.pt.x, kp.pt.y, kp.size, kp.angle, kp.response, kp.octave, kp.class_id, 0 };
+      file.write((const char*)&record, sizeof(record));
+    }
+  }
+
+  if (has_normals)
+  {
+    padTo(file, header.normals_offset);
+    if (num_points > 0) file.write((const char*)&list_normals_[0], num_points * sizeof(cv::Point3f));
+  }
+
+  if (has_feature_sizes)
+  {
+    padTo(file, header.feature_sizes_offset);
+    if (num_points > 0) file.write((const char*)&list_feature_sizes_[0], num_points * sizeof(float));
+  }
+
+  padTo(file, header.descriptors_offset);
+  for (int i = 0; i < descriptors_.rows; ++i)
+  {
+    file.write((const char*)descriptors_.ptr(i), header.descriptor_size);
+  }
+
+  // A truncated file would be mapped with sections past its end: remove it
+  file.flush();
+  if (!file || (uint64_t)file.tellp() != header.file_size)
+  {
+    std::cerr << "Model: could not write " << path << std::endl;
+    file.close();
+    std::remove(path.c_str());
+  }
+}
+
+/** Map a binary model file, the descriptors are used in place */
+void Model::loadBinary(const std::string &path)
+{
+  list_points3d_in_.clear();
+  list_points2d_in_.clear();
+  list_keypoints_.clear();
+  list_normals_.clear();
+  list_feature_sizes_.clear();
+  descriptors_.release();
+  mapping_ = cv::Ptr<MappedFile>();
+
+  cv::Ptr<MappedFile> mapping = cv::makePtr<MappedFile>();
+  if (!mapping->open(path))
+  {
+    std::cerr << "Model: could not map " << path << std::endl;
+    return;
+  }
+
+  const unsigned char *data = mapping->data();
+  const uint64_t size = mapping->size();
+
+  // Fields missing from older headers are read as absent sections
+  ModelFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  if (size < MODEL_FILE_HEADER_SIZE_V1)
+  {
+    std::cerr << "Model: " << path << " is not a binary model" << std::endl;
+    return;
+  }
+  std::memcpy(&header, data, MODEL_FILE_HEADER_SIZE_V1);
+
+  if (std::memcmp(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic)) != 0)
+  {
+    std::cerr << "Model: " << path << " is not a binary model" << std::endl;
+    return;
+  }
+  if (header.version < 1 || header.version > MODEL_FILE_VERSION)
+  {
+    std::cerr << "Model: " << path << " has unsupported version " << header.version << std::endl;
+    return;
+  }
+
+  const uint32_t header_size = header.version == 1 ? MODEL_FILE_HEADER_SIZE_V1 : (uint32_t)sizeof(ModelFileHeader);
+  if (header.header_size != header_size || size < header_size)
+  {
+    std::cerr << "Model: " << path << " is truncated or corrupted" << std::endl;
+    return;
+  }
+  std::memcpy(&header, data, header_size);
+
+  const uint64_t n = header.num_points;
+  const uint64_t descriptor_bytes = (uint64_t)header.descriptor_cols * CV_ELEM_SIZE(header.descriptor_type);
+  if (header.file_size != size || descriptor_bytes != header.descriptor_size ||
+      !isSectionValid(header.points3d_offset, n * sizeof(cv::Point3f), size) ||
+      !isSectionValid(header.points2d_offset, n * sizeof(cv::Point2f), size) ||
+      !isSectionValid(header.keypoints_offset, n * sizeof(ModelFileKeyPoint), size) ||
+      !isSectionValid(header.normals_offset, n * sizeof(cv::Point3f), size) ||
+      !isSectionValid(header.feature_sizes_offset, n * sizeof(float), size) ||
+      !isSectionValid(header.descriptors_offset, n * header.descriptor_size, size) ||
+      header.points3d_offset == 0 || header.descriptors_offset == 0)
+  {
+    std::cerr << "Model: " << path << " is truncated or corrupted" << std::endl;
+    return;
+  }
+
+  const cv::Point3f *points3d = (const cv::Point3f*)(data + header.points3d_offset);
+  list_points3d_in_.assign(points3d, points3d + n);
+
+  if (header.points2d_offset != 0)
+  {
+    const cv::Point2f *points2d = (const cv::Point2f*)(data + header.points2d_offset);
+    list_points2d_in_.assign(points2d, points2d + n);
+  }
+
+  if (header.keypoints_offset != 0)
+  {
+    const ModelFileKeyPoint *keypoints = (const ModelFileKeyPoint*)(data + header.keypoints_offset);
+    list_keypoints_.reserve(n);
+    for (uint64_t i = 0; i < n; ++i)
+    {
+      const ModelFileKeyPoint &kp = keypoints[i];
+      list_keypoints_.push_back(cv::KeyPoint(kp.x, kp.y, kp.size, kp.angle, kp.response, kp.octave, kp.class_id));
+    }
+  }
+
+  if (header.normals_offset != 0)
+  {
+    const cv::Point3f *normals = (const cv::Point3f*)(data + header.normals_offset);
+    list_normals_.assign(normals, normals + n);
+  }
+
+  if (header.feature_sizes_offset != 0)
+  {
+    const float *feature_sizes = (const float*)(data + header.feature_sizes_offset);
+    list_feature_sizes_.assign(feature_sizes, feature_sizes + n);
+  }
+
+  // The descriptors are not copied, the mapping is kept alive with the model
+  descriptors_ = cv::Mat((int)n, (int)header.descriptor_cols, header.descriptor_type,
+                         (void*)(data + header.descriptors_offset));
+  mapping_ = mapping;
+}
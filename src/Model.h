@@ -12,16 +12,20 @@
 #include <opencv2/core/core.hpp>
 #include <opencv2/features2d/features2d.hpp>
 
+#include "MappedFile.h"
+
 class Model
 {
 public:
   Model();
   virtual ~Model();
 
-  std::vector<cv::Point2f> get_points2d_in() const { return list_points2d_in_; }
-  std::vector<cv::Point2f> get_points2d_out() const { return list_points2d_out_; }
-  std::vector<cv::Point3f> get_points3d() const { return list_points3d_in_; }
-  std::vector<cv::KeyPoint> get_keypoints() const { return list_keypoints_; }
+  const std::vector<cv::Point2f>& get_points2d_in() const { return list_points2d_in_; }
+  const std::vector<cv::Point2f>& get_points2d_out() const { return list_points2d_out_; }
+  const std::vector<cv::Point3f>& get_points3d() const { return list_points3d_in_; }
+  const std::vector<cv::KeyPoint>& get_keypoints() const { return list_keypoints_; }
+  const std::vector<cv::Point3f>& get_normals() const { return list_normals_; }
+  const std::vector<float>& get_feature_sizes() const { return list_feature_sizes_; }
   cv::Mat get_descriptors() const { return descriptors_; }
   int get_numDescriptors() const { return descriptors_.rows; }
 
@@ -30,13 +34,28 @@ public:
   void add_outlier(const cv::Point2f &point2d);
   void add_descriptor(const cv::Mat &descriptor);
   void add_keypoint(const cv::KeyPoint &kp);
+  void add_normal(const cv::Point3f &normal);
+  void add_feature_size(float size);
+
+  // Merge the descriptors of the same 3D point, returns the number of removed points
+  int compact(float radius, double max_descriptor_distance);
 
 
+  // The format is chosen by extension: *.bin is the binary model format,
+  // anything else is read and written with cv::FileStorage (YAML/XML)
   void save(const std::string path);
   void load(const std::string path);
 
 
 private:
+  void saveYAML(const std::string &path);
+  void loadYAML(const std::string &path);
+  void saveBinary(const std::string &path);
+  void loadBinary(const std::string &path);
+
+  // Fill the missing feature sizes of a single view model from its registration view
+  bool deriveFeatureSizes();
+
   /** The current number of correspondecnes */
   int n_correspondences_;
   /** The list of 2D points on the model surface */
@@ -47,8 +66,14 @@ private:
   std::vector<cv::Point2f> list_points2d_out_;
   /** The list of 3D points on the model surface */
   std::vector<cv::Point3f> list_points3d_in_;
+  /** The list of surface normals at each 3D point */
+  std::vector<cv::Point3f> list_normals_;
+  /** The diameter of each keypoint on the model surface, in model units */
+  std::vector<float> list_feature_sizes_;
   /** The list of 2D points descriptors */
   cv::Mat descriptors_;
+  /** The mapped binary model file, the descriptors point into it */
+  cv::Ptr<MappedFile> mapping_;
 };
 
 #endif /* OBJECTMODEL_H_ */
@@ -0,0 +1,65 @@
+/*
+ * ModelIndex.cpp
+ *
+ *  Nearest neighbour index over the model descriptors, built once and
+ *  searched read-only, so that several threads can share it.
+ */
+
+#include "ModelIndex.h"
+
+ModelIndex::ModelIndex(const cv::Mat &descriptors, const cv::Ptr<cv::flann::IndexParams> &indexParams,
+                       const cv::Ptr<cv::flann::SearchParams> &searchParams)
+  : descriptors_(descriptors), searchParams_(searchParams)
+{
+  if (descriptors_.empty()) return;
+
+  cvflann::flann_distance_t distance = descriptors_.depth() == CV_8U ? cvflann::FLANN_DIST_HAMMING
+                                                                     : cvflann::FLANN_DIST_L2;
+  if (distance == cvflann::FLANN_DIST_L2 && descriptors_.type() != CV_32F)
+  {
+    descriptors_.convertTo(descriptors_, CV_32F);
+  }
+  index_.build(descriptors_, *indexParams, distance);
+}
+
+ModelIndex::~ModelIndex()
+{
+}
+
+void ModelIndex::knnMatch(const cv::Mat &query, std::vector<std::vector<cv::DMatch> > &matches, int k) const
+{
+  cv::Mat indices, dists;
+  knnMatch(query, matches, k, indices, dists);
+}
+
+void ModelIndex::knnMatch(const cv::Mat &query, std::vector<std::vector<cv::DMatch> > &matches, int k,
+                          cv::Mat &indices, cv::Mat &dists) const
+{
+  // The inner vectors are emptied, not freed, so they keep their capacity
+  for (size_t i = 0; i < matches.size(); ++i) matches[i].clear();
+  if (query.empty() || descriptors_.empty())
+  {
+    matches.clear();
+    return;
+  }
+
+  cv::Mat query_descriptors = query;
+  if (descriptors_.depth() != query.depth()) query.convertTo(query_descriptors, descriptors_.type());
+
+  index_.knnSearch(query_descriptors, indices, dists, k, *searchParams_);
+
+  // Hamming distances are integers
+  const bool integer_dists = dists.depth() == CV_32S;
+
+  matches.resize(query.rows);
+  for (int i = 0; i < indices.rows; ++i)
+  {
+    const int *idx = indices.ptr<int>(i);
+    for (int j = 0; j < indices.cols; ++j)
+    {
+      if (idx[j] < 0) break;  // fewer than k neighbours found
+      float dist = integer_dists ? (float)dists.ptr<int>(i)[j] : dists.ptr<float>(i)[j];
+      matches[i].push_back(cv::DMatch(i, idx[j], dist));
+    }
+  }
+}
@@ -0,0 +1,48 @@
+/*
+ * ModelIndex.h
+ *
+ *  Nearest neighbour index over the model descriptors, built once and
+ *  searched read-only, so that several threads can share it.
+ */
+
+#ifndef MODELINDEX_H_
+#define MODELINDEX_H_
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <opencv2/flann/flann.hpp>
+
+class ModelIndex
+{
+public:
+  // Binary descriptors are indexed with Hamming distance, the others with L2
+  ModelIndex(const cv::Mat &descriptors, const cv::Ptr<cv::flann::IndexParams> &indexParams,
+             const cv::Ptr<cv::flann::SearchParams> &searchParams);
+  virtual ~ModelIndex();
+
+  int size() const { return descriptors_.rows; }
+
+  // Find the k nearest model descriptors of each query descriptor, as
+  // DescriptorMatcher::knnMatch does with the model as train set
+  void knnMatch(const cv::Mat &query, std::vector<std::vector<cv::DMatch> > &matches, int k) const;
+
+  // The same, with the search buffers of the caller: the index is shared by several
+  // threads, each one keeps its own buffers to reuse them from one frame to the next
+  void knnMatch(const cv::Mat &query, std::vector<std::vector<cv::DMatch> > &matches, int k,
+                cv::Mat &indices, cv::Mat &dists) const;
+
+private:
+  ModelIndex(const ModelIndex&);
+  ModelIndex& operator=(const ModelIndex&);
+
+  /** The indexed descriptors, the index refers to their data */
+  cv::Mat descriptors_;
+  /** The FLANN index, knnSearch is not const but only reads the built index */
+  mutable cv::flann::Index index_;
+  /** The search parameters */
+  cv::Ptr<cv::flann::SearchParams> searchParams_;
+};
+
+#endif /* MODELINDEX_H_ */
@@ -0,0 +1,62 @@
+/*
+ * PerfStats.cpp
+ *
+ *  Latency samples of a processing stage and their summary.
+ */
+
+#include "PerfStats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+
+PerfStats::PerfStats(const std::string &name, const std::string &unit) : name_(name), unit_(unit), samples_(), total_(0)
+{
+}
+
+double PerfStats::now()
+{
+  typedef std::chrono::steady_clock clock;
+  return std::chrono::duration<double, std::milli>(clock::now().time_since_epoch()).count();
+}
+
+void PerfStats::add(double ms)
+{
+  samples_.push_back(ms);
+  total_ += ms;
+}
+
+void PerfStats::clear()
+{
+  samples_.clear();
+  total_ = 0;
+}
+
+double PerfStats::mean() const
+{
+  return samples_.empty() ? 0 : total_ / samples_.size();
+}
+
+double PerfStats::percentile(double p) const
+{
+  if (samples_.empty()) return 0;
+
+  std::vector<double> sorted(samples_);
+  size_t rank = (size_t)std::ceil(p / 100.0 * sorted.size());
+  rank = std::min(std::max(rank, (size_t)1), sorted.size());
+  std::nth_element(sorted.begin(), sorted.begin() + (rank - 1), sorted.end());
+  return sorted[rank - 1];
+}
+
+void PerfStats::print(std::ostream &os) const
+{
+  std::ios::fmtflags flags = os.flags();
+  os << std::left << std::setw(12) << name_ << std::right << std::fixed << std::setprecision(3)
+     << " n=" << std::setw(6) << count()
+     << " mean=" << std::setw(9) << mean()
+     << " p50=" << std::setw(9) << percentile(50)
+     << " p99=" << std::setw(9) << percentile(99)
+     << " max=" << std::setw(9) << percentile(100) << " " << unit_ << std::endl;
+  os.flags(flags);
+}
@@ -0,0 +1,46 @@
+/*
+ * PerfStats.h
+ *
+ *  Latency samples of a processing stage and their summary.
+ */
+
+#ifndef PERFSTATS_H_
+#define PERFSTATS_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+class PerfStats
+{
+public:
+  explicit PerfStats(const std::string &name = "", const std::string &unit = "ms");
+
+  /** Milliseconds on a monotonic high resolution clock */
+  static double now();
+
+  void add(double ms);
+  void clear();
+
+  const std::string& name() const { return name_; }
+  size_t count() const { return samples_.size(); }
+  double total() const { return total_; }
+  double mean() const;
+  /** Nearest rank percentile, p in [0, 100] */
+  double percentile(double p) const;
+
+  /** Print one summary line: count, mean, p50, p99 and max */
+  void print(std::ostream &os) const;
+
+private:
+  /** The stage name */
+  std::string name_;
+  /** The unit of the samples, ms for latencies */
+  std::string unit_;
+  /** The value of each sample */
+  std::vector<double> samples_;
+  /** Sum of the samples */
+  double total_;
+};
+
+#endif /* PERFSTATS_H_ */
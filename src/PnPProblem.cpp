@@ -10,6 +10,7 @@
 
 #include "PnPProblem.h"
 #include "Mesh.h"
+#include "StageTimer.h"
 
 #include <opencv2/calib3d/calib3d.hpp>
 
@@ -17,7 +18,6 @@
 cv::Point3f CROSS(cv::Point3f v1, cv::Point3f v2);
 double DOT(cv::Point3f v1, cv::Point3f v2);
 cv::Point3f SUB(cv::Point3f v1, cv::Point3f v2);
-cv::Point3f get_nearest_3D_point(std::vector<cv::Point3f> &points_list, cv::Point3f origin);
 
 
 /* Functions for Möller–Trumbore intersection algorithm */
@@ -48,25 +48,6 @@ cv::Point3f SUB(cv::Point3f v1, cv::Point3f v2)
 /* End functions for Möller–Trumbore intersection algorithm
  *  */
 
-// Function to get the nearest 3D point to the Ray origin
-cv::Point3f get_nearest_3D_point(std::vector<cv::Point3f> &points_list, cv::Point3f origin)
-{
-  cv::Point3f p1 = points_list[0];
-  cv::Point3f p2 = points_list[1];
-
-  double d1 = std::sqrt( std::pow(p1.x-origin.x, 2) + std::pow(p1.y-origin.y, 2) + std::pow(p1.z-origin.z, 2) );
-  double d2 = std::sqrt( std::pow(p2.x-origin.x, 2) + std::pow(p2.y-origin.y, 2) + std::pow(p2.z-origin.z, 2) );
-
-  if(d1 < d2)
-  {
-      return p1;
-  }
-  else
-  {
-      return p2;
-  }
-}
-
 // Custom constructor given the intrinsic camera parameters
 
 PnPProblem::PnPProblem(const double params[])
@@ -80,6 +61,9 @@ PnPProblem::PnPProblem(const double params[])
   _R_matrix = cv::Mat::zeros(3, 3, CV_64FC1);   // rotation matrix
   _t_matrix = cv::Mat::zeros(3, 1, CV_64FC1);   // translation matrix
   _P_matrix = cv::Mat::zeros(3, 4, CV_64FC1);   // rotation-translation matrix
+  _distCoeffs = cv::Mat::zeros(4, 1, CV_64FC1); // vector of distortion coefficients
+  _rvec = cv::Mat::zeros(3, 1, CV_64FC1);       // output rotation vector
+  _tvec = cv::Mat::zeros(3, 1, CV_64FC1);       // output translation vector
 }
 
 PnPProblem::~PnPProblem()
@@ -103,6 +87,14 @@ void PnPProblem::set_P_matrix( const cv::Mat &R_matrix, const cv::Mat &t_matrix)
   _P_matrix.at<double>(2,3) = t_matrix.at<double>(2);
 }
 
+// Set a known pose, e.g. the ground truth of a registration image
+void PnPProblem::set_pose( const cv::Mat &R_matrix, const cv::Mat &t_matrix)
+{
+  R_matrix.convertTo(_R_matrix, CV_64F);
+  t_matrix.convertTo(_t_matrix, CV_64F);
+  this->set_P_matrix(_R_matrix, _t_matrix);
+}
+
 
 // Estimate the pose given a list of 2D/3D correspondences and the method to use
 bool PnPProblem::estimatePose( const std::vector<cv::Point3f> &list_points3d,
@@ -136,19 +128,28 @@ void PnPProblem::estimatePoseRANSAC( const std::vector<cv::Point3f> &list_points
                                      int flags, cv::Mat &inliers, int iterationsCount,  // PnP method; inliers container
                                      float reprojectionError, double confidence )    // Ransac parameters
 {
-  cv::Mat distCoeffs = cv::Mat::zeros(4, 1, CV_64FC1);  // vector of distortion coefficients
-  cv::Mat rvec = cv::Mat::zeros(3, 1, CV_64FC1);          // output rotation vector
-  cv::Mat tvec = cv::Mat::zeros(3, 1, CV_64FC1);    // output translation vector
+  StageTimer timer(STAGE_RANSAC);
+  TRACE_ARG("points", list_points2d.size());
+  TRACE_ARG("max_iterations", iterationsCount);
+
+  // The distortion coefficients and the output vectors are members, allocated once
 
   bool useExtrinsicGuess = false;   // if true the function uses the provided rvec and tvec values as
             // initial approximations of the rotation and translation vectors
 
-  cv::solvePnPRansac( list_points3d, list_points2d, _A_matrix, distCoeffs, rvec, tvec,
+  // The output vectors are reused: reset them on failure, so that a failed estimation
+  // gives the identity pose as with fresh vectors and not the pose of the previous call
+  if (!cv::solvePnPRansac( list_points3d, list_points2d, _A_matrix, _distCoeffs, _rvec, _tvec,
                 useExtrinsicGuess, iterationsCount, reprojectionError, confidence,
-                inliers, flags );
+                inliers, flags ))
+  {
+    _rvec.setTo(cv::Scalar(0));
+    _tvec.setTo(cv::Scalar(0));
+  }
+  TRACE_ARG("inliers", inliers.rows);
 
-  Rodrigues(rvec,_R_matrix);      // converts Rotation Vector to Matrix
-  _t_matrix = tvec;       // set translation matrix
+  Rodrigues(_rvec,_R_matrix);      // converts Rotation Vector to Matrix
+  _tvec.copyTo(_t_matrix);       // set translation matrix
 
   this->set_P_matrix(_R_matrix, _t_matrix); // set rotation-translation matrix
 
@@ -192,8 +193,37 @@ cv::Point2f PnPProblem::backproject3DPoint(const cv::Point3f &point3d)
   return point2d;
 }
 
+// Backproject a list of 3D points to 2D, building the projection matrix only once
+
+void PnPProblem::backproject3DPoints(const std::vector<cv::Point3f> &list_points3d,
+                                     std::vector<cv::Point2f> &list_points2d) const
+{
+  // Projection matrix A*[R|t]
+  cv::Matx34d AP = cv::Matx33d(_A_matrix) * cv::Matx34d(_P_matrix);
+
+  list_points2d.resize(list_points3d.size());
+  for (size_t i = 0; i < list_points3d.size(); ++i)
+  {
+    const cv::Point3f &p = list_points3d[i];
+    double u = AP(0,0)*p.x + AP(0,1)*p.y + AP(0,2)*p.z + AP(0,3);
+    double v = AP(1,0)*p.x + AP(1,1)*p.y + AP(1,2)*p.z + AP(1,3);
+    double w = AP(2,0)*p.x + AP(2,1)*p.y + AP(2,2)*p.z + AP(2,3);
+
+    list_points2d[i].x = (float)(u / w);
+    list_points2d[i].y = (float)(v / w);
+  }
+}
+
 // Back project a 2D point to 3D and returns if it's on the object surface
 bool PnPProblem::backproject2DPoint(const Mesh *mesh, const cv::Point2f &point2d, cv::Point3f &point3d)
+{
+  cv::Point3f normal;
+  return this->backproject2DPoint(mesh, point2d, point3d, normal);
+}
+
+// Back project a 2D point to 3D and returns if it's on the object surface.
+// The normal of the hit triangle is oriented towards the camera.
+bool PnPProblem::backproject2DPoint(const Mesh *mesh, const cv::Point2f &point2d, cv::Point3f &point3d, cv::Point3f &normal)
 {
   // Triangles list of the object mesh
   std::vector<std::vector<int> > triangles_list = mesh->getTrianglesList();
@@ -224,8 +254,9 @@ bool PnPProblem::backproject2DPoint(const Mesh *mesh, const cv::Point2f &point2d
   // Set up Ray
   Ray R((cv::Point3f)C_op, (cv::Point3f)ray);
 
-  // A vector to store the intersections found
-  std::vector<cv::Point3f> intersections_list;
+  // The nearest intersection found
+  int nearest_idx = -1;
+  double nearest_t = 0;
 
   // Loop for all the triangles and check the intersection
   for (unsigned int i = 0; i < triangles_list.size(); i++)
@@ -237,22 +268,71 @@ bool PnPProblem::backproject2DPoint(const Mesh *mesh, const cv::Point2f &point2d
     Triangle T(i, V0, V1, V2);
 
     double out;
-    if(this->intersect_MollerTrumbore(R, T, &out))
+    if(this->intersect_MollerTrumbore(R, T, &out) && (nearest_idx < 0 || out < nearest_t))
     {
-      cv::Point3f tmp_pt = R.getP0() + out*R.getP1(); // P = O + t*D
-      intersections_list.push_back(tmp_pt);
+      nearest_idx = (int)i;
+      nearest_t = out;
     }
   }
 
-  // If there are intersection, find the nearest one
-  if (!intersections_list.empty())
+  // If there are intersection, keep the nearest one
+  if (nearest_idx < 0)
   {
-    point3d = get_nearest_3D_point(intersections_list, R.getP0());
-    return true;
+    return false;
   }
-  else
+
+  point3d = R.getP0() + nearest_t*R.getP1(); // P = O + t*D
+
+  cv::Point3f V0 = mesh->getVertex(triangles_list[nearest_idx][0]);
+  cv::Point3f V1 = mesh->getVertex(triangles_list[nearest_idx][1]);
+  cv::Point3f V2 = mesh->getVertex(triangles_list[nearest_idx][2]);
+
+  normal = CROSS(SUB(V1, V0), SUB(V2, V0));
+  normal = normal * (float)(1.0 / std::sqrt(DOT(normal, normal)));
+  if (DOT(normal, R.getP1()) > 0) normal = -normal; // facing the ray origin
+
+  return true;
+}
+
+// Given the current pose, compute the image size of objects of known size at each 3D point.
+// Points behind the camera get a size of 0.
+
+void PnPProblem::projectedSizes(const std::vector<cv::Point3f> &list_points3d,
+                                const std::vector<float> &list_sizes3d,
+                                std::vector<float> &list_sizes2d) const
+{
+  cv::Matx34d P(_P_matrix);
+  const double fx = _A_matrix.at<double>(0, 0);
+
+  list_sizes2d.resize(list_points3d.size());
+  for (size_t i = 0; i < list_points3d.size(); ++i)
   {
-    return false;
+    const cv::Point3f &p = list_points3d[i];
+    double depth = P(2,0)*p.x + P(2,1)*p.y + P(2,2)*p.z + P(2,3);
+    list_sizes2d[i] = depth > 0 ? (float)(list_sizes3d[i] * fx / depth) : 0.f;
+  }
+}
+
+// Given the current pose, select the model points whose normals face the camera
+
+void PnPProblem::visiblePoints(const std::vector<cv::Point3f> &list_points3d,
+                               const std::vector<cv::Point3f> &list_normals,
+                               std::vector<int> &visible_idx) const
+{
+  // Center of projection in object coordinates: C = -R'*t
+  cv::Matx34d P(_P_matrix);
+  cv::Point3f C;
+  C.x = (float)-(P(0,0)*P(0,3) + P(1,0)*P(1,3) + P(2,0)*P(2,3));
+  C.y = (float)-(P(0,1)*P(0,3) + P(1,1)*P(1,3) + P(2,1)*P(2,3));
+  C.z = (float)-(P(0,2)*P(0,3) + P(1,2)*P(1,3) + P(2,2)*P(2,3));
+
+  visible_idx.clear();
+  for (size_t i = 0; i < list_points3d.size(); ++i)
+  {
+    if (DOT(list_normals[i], SUB(C, list_points3d[i])) > 0)
+    {
+      visible_idx.push_back((int)i);
+    }
   }
 }
 
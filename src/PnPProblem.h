@@ -24,9 +24,15 @@ public:
   virtual ~PnPProblem();
 
   bool backproject2DPoint(const Mesh *mesh, const cv::Point2f &point2d, cv::Point3f &point3d);
+  bool backproject2DPoint(const Mesh *mesh, const cv::Point2f &point2d, cv::Point3f &point3d, cv::Point3f &normal);
   bool intersect_MollerTrumbore(Ray &R, Triangle &T, double *out);
   std::vector<cv::Point2f> verify_points(Mesh *mesh);
   cv::Point2f backproject3DPoint(const cv::Point3f &point3d);
+  void backproject3DPoints(const std::vector<cv::Point3f> &list_points3d, std::vector<cv::Point2f> &list_points2d) const;
+  void projectedSizes(const std::vector<cv::Point3f> &list_points3d, const std::vector<float> &list_sizes3d,
+                      std::vector<float> &list_sizes2d) const;
+  void visiblePoints(const std::vector<cv::Point3f> &list_points3d, const std::vector<cv::Point3f> &list_normals,
+                     std::vector<int> &visible_idx) const;
   bool estimatePose(const std::vector<cv::Point3f> &list_points3d, const std::vector<cv::Point2f> &list_points2d, int flags);
   void estimatePoseRANSAC( const std::vector<cv::Point3f> &list_points3d, const std::vector<cv::Point2f> &list_points2d,
                            int flags, cv::Mat &inliers,
@@ -38,6 +44,7 @@ public:
   cv::Mat get_P_matrix() const { return _P_matrix; }
 
   void set_P_matrix( const cv::Mat &R_matrix, const cv::Mat &t_matrix);
+  void set_pose( const cv::Mat &R_matrix, const cv::Mat &t_matrix);
 
 private:
   /** The calibration matrix */
@@ -48,6 +55,9 @@ private:
   cv::Mat _t_matrix;
   /** The computed projection matrix */
   cv::Mat _P_matrix;
+
+  /** The RANSAC inputs and outputs, reused from one estimation to the next */
+  cv::Mat _distCoeffs, _rvec, _tvec;
 };
 
 // Functions for Möller–Trumbore intersection algorithm
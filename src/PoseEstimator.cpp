@@ -0,0 +1,319 @@
+/*
+ * PoseEstimator.cpp
+ *
+ *  Detection and tracking of a textured model in a stream of frames: feature
+ *  detection, robust matching, PnP RANSAC and Kalman filtering.
+ */
+
+#include "PoseEstimator.h"
+
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "PerfStats.h"
+#include "Trace.h"
+#include "Utils.h"
+
+namespace
+{
+
+cv::Ptr<cv::flann::IndexParams> lshIndexParams()
+{
+  return cv::makePtr<cv::flann::LshIndexParams>(6, 12, 1);
+}
+
+cv::Ptr<cv::flann::SearchParams> lshSearchParams()
+{
+  return cv::makePtr<cv::flann::SearchParams>(50);
+}
+
+}
+
+PoseEstimatorConfig::PoseEstimatorConfig()
+  : num_keypoints(2000), downscale(1.0),
+    ratio_test(0.70f), fast_match(true), visibility(false), gating(false), octave_tolerance(1.0f),
+    pnp_method(cv::SOLVEPNP_ITERATIVE), ransac_iterations(500), reprojection_error(2.0f), confidence(0.95),
+    min_inliers_kalman(30), dt(0.125), lost_covariance_growth(10)
+{
+  // UVC webcam: 55 mm focal length, 22.3 x 14.9 mm sensor, 640 x 480 image
+  camera_params[0] = 640 * 55 / 22.3;   // fx
+  camera_params[1] = 480 * 55 / 14.9;   // fy
+  camera_params[2] = 640 / 2;           // cx
+  camera_params[3] = 480 / 2;           // cy
+}
+
+PoseResult::PoseResult()
+  : n_matches(0), n_inliers(0), ransac_done(false), ransac_ms(0), good_measurement(false), lost(true),
+    has_estimate(false)
+{
+}
+
+void PoseResult::clear()
+{
+  n_matches = 0;
+  n_inliers = 0;
+  ransac_done = false;
+  ransac_ms = 0;
+  good_measurement = false;
+  has_estimate = false;
+  lost = true;
+  points2d_matched.clear();
+  points2d_inliers.clear();
+}
+
+PoseEstimator::PoseEstimator(const Model &model, const PoseEstimatorConfig &config)
+  : config_(config),
+    list_points3d_model_(model.get_points3d()), descriptors_model_(model.get_descriptors()),
+    list_normals_model_(model.get_normals()), list_feature_sizes_model_(model.get_feature_sizes()),
+    model_index_(createIndex(model)),
+    pnp_detection_(config.camera_params), pnp_detection_est_(config.camera_params),
+    kf_(config.dt, config.min_inliers_kalman), good_measurement_(false)
+{
+  init();
+}
+
+PoseEstimator::PoseEstimator(const Model &model, const cv::Ptr<ModelIndex> &index, const PoseEstimatorConfig &config)
+  : config_(config),
+    list_points3d_model_(model.get_points3d()), descriptors_model_(model.get_descriptors()),
+    list_normals_model_(model.get_normals()), list_feature_sizes_model_(model.get_feature_sizes()),
+    model_index_(index),
+    pnp_detection_(config.camera_params), pnp_detection_est_(config.camera_params),
+    kf_(config.dt, config.min_inliers_kalman), good_measurement_(false)
+{
+  init();
+}
+
+PoseEstimator::~PoseEstimator()
+{
+}
+
+cv::Ptr<ModelIndex> PoseEstimator::createIndex(const Model &model)
+{
+  return cv::makePtr<ModelIndex>(model.get_descriptors(), lshIndexParams(), lshSearchParams());
+}
+
+void PoseEstimator::init()
+{
+  if (config_.visibility && list_normals_model_.size() != list_points3d_model_.size())
+  {
+    config_.visibility = false;
+  }
+  if (config_.gating && list_feature_sizes_model_.size() != list_points3d_model_.size())
+  {
+    config_.gating = false;
+  }
+  if (config_.downscale <= 0 || config_.downscale > 1)
+  {
+    config_.downscale = 1.0;
+  }
+
+  kf_.setMaxCovarianceGrowth(config_.lost_covariance_growth);
+
+  orb_ = cv::ORB::create(config_.num_keypoints);
+
+  rmatcher_.setFeatureDetector(orb_);        // set feature detector
+  rmatcher_.setDescriptorExtractor(orb_);    // set descriptor extractor
+
+  // instantiate FlannBased matcher, for the matching against a subset of the model
+  cv::Ptr<cv::DescriptorMatcher> matcher = cv::makePtr<cv::FlannBasedMatcher>(lshIndexParams(), lshSearchParams());
+  rmatcher_.setDescriptorMatcher(matcher);   // set matcher
+  rmatcher_.setRatio(config_.ratio_test);    // set ratio test parameter
+}
+
+const PoseResult& PoseEstimator::process(const cv::Mat &frame, double timestamp)
+{
+  detect(frame, keypoints_, descriptors_);
+  measure(keypoints_, descriptors_, result_);
+  track(result_, timestamp);
+  return result_;
+}
+
+// -- Step 1a: Compute the scene keypoints and descriptors. The frame is converted to
+// grayscale once and optionally downscaled, the keypoints are scaled back to full
+// resolution so the camera intrinsics and the drawing stay unchanged.
+void PoseEstimator::detect(const cv::Mat &frame, std::vector<cv::KeyPoint> &keypoints, cv::Mat &descriptors)
+{
+  TRACE_SCOPE("detect");
+
+  const cv::Mat *image = &frame;
+  if (frame.channels() == 3)
+  {
+    cv::cvtColor(frame, gray_, cv::COLOR_BGR2GRAY);
+    image = &gray_;
+  }
+
+  if (config_.downscale < 1.0)
+  {
+    cv::resize(*image, small_, cv::Size(), config_.downscale, config_.downscale, cv::INTER_AREA);
+    image = &small_;
+  }
+
+  rmatcher_.computeKeyPoints(*image, keypoints);
+  rmatcher_.computeDescriptors(*image, keypoints, descriptors);
+
+  if (config_.downscale < 1.0)
+  {
+    const float up = (float)(1.0 / config_.downscale);
+    for (unsigned int i = 0; i < keypoints.size(); ++i)
+    {
+      keypoints[i].pt *= up;
+      keypoints[i].size *= up;
+    }
+  }
+  TRACE_ARG("keypoints", keypoints.size());
+}
+
+// -- Step 1b: Robust matching between model descriptors and scene descriptors
+void PoseEstimator::match(const std::vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors)
+{
+  // While tracking, back facing model points cannot match
+  visible_idx_.clear();
+  if (config_.visibility && tracking())
+  {
+    pnp_detection_est_.visiblePoints(list_points3d_model_, list_normals_model_, visible_idx_);
+  }
+
+  cv::Mat descriptors_match = descriptors_model_;
+  if (!visible_idx_.empty())
+  {
+    selectDescriptors(descriptors_model_, visible_idx_, descriptors_visible_);
+    descriptors_match = descriptors_visible_;
+  }
+
+  if (config_.gating && tracking())
+  {
+    // Expected keypoint size of the matched model points at the predicted pose
+    pnp_detection_est_.projectedSizes(list_points3d_model_, list_feature_sizes_model_, list_sizes2d_model_);
+    if (!visible_idx_.empty())
+    {
+      for (unsigned int i = 0; i < visible_idx_.size(); ++i)
+      {
+        list_sizes2d_model_[i] = list_sizes2d_model_[ visible_idx_[i] ];
+      }
+      list_sizes2d_model_.resize(visible_idx_.size());
+    }
+
+    rmatcher_.fastRobustMatchScaleGatedDescriptors(keypoints, descriptors, descriptors_match,
+                                                   list_sizes2d_model_, orb_->getScaleFactor(),
+                                                   config_.octave_tolerance, good_matches_);
+  }
+  else if (config_.fast_match && visible_idx_.empty())
+  {
+    rmatcher_.fastRobustMatchIndexed(descriptors, *model_index_, good_matches_);
+  }
+  else if (config_.fast_match)
+  {
+    rmatcher_.fastRobustMatchDescriptors(descriptors, descriptors_match, good_matches_);
+  }
+  else
+  {
+    rmatcher_.robustMatchDescriptors(descriptors, descriptors_match, good_matches_);
+  }
+
+  // Back to model indices
+  if (!visible_idx_.empty())
+  {
+    for (unsigned int match_index = 0; match_index < good_matches_.size(); ++match_index)
+    {
+      good_matches_[match_index].trainIdx = visible_idx_[ good_matches_[match_index].trainIdx ];
+    }
+  }
+}
+
+// -- Step 1b to 4: Match the scene with the model and measure the pose
+void PoseEstimator::measure(const std::vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors,
+                            PoseResult &result)
+{
+  TRACE_SCOPE("measure");
+  result.clear();
+
+  match(keypoints, descriptors);
+  result.n_matches = (int)good_matches_.size();
+
+
+  // -- Step 2: Find out the 2D/3D correspondences
+
+  list_points3d_model_match_.clear();
+
+  for (unsigned int match_index = 0; match_index < good_matches_.size(); ++match_index)
+  {
+    cv::Point3f point3d_model = list_points3d_model_[ good_matches_[match_index].trainIdx ];  // 3D point from model
+    cv::Point2f point2d_scene = keypoints[ good_matches_[match_index].queryIdx ].pt;         // 2D point from the scene
+    list_points3d_model_match_.push_back(point3d_model);   // add 3D point
+    result.points2d_matched.push_back(point2d_scene);      // add 2D point
+  }
+
+
+  inliers_idx_.release();
+
+  if (good_matches_.size() > 0) // None matches, then RANSAC crashes
+  {
+
+    // -- Step 3: Estimate the pose using RANSAC approach
+    double ransac_start = PerfStats::now();
+    pnp_detection_.estimatePoseRANSAC( list_points3d_model_match_, result.points2d_matched,
+                                       config_.pnp_method, inliers_idx_,
+                                       config_.ransac_iterations, config_.reprojection_error,
+                                       config_.confidence );
+    result.ransac_ms = PerfStats::now() - ransac_start;
+
+    // -- Step 4: Catch the inliers keypoints to draw
+    for (int inliers_index = 0; inliers_index < inliers_idx_.rows; ++inliers_index)
+    {
+      int n = inliers_idx_.at<int>(inliers_index);           // i-inlier
+      cv::Point2f point2d = result.points2d_matched[n];      // i-inlier point 2D
+      result.points2d_inliers.push_back(point2d);            // add i-inlier to list
+    }
+
+    result.ransac_done = true;
+  }
+
+  result.n_inliers = inliers_idx_.rows;
+  TRACE_ARG("matches", result.n_matches);
+  TRACE_ARG("inliers", result.n_inliers);
+  pnp_detection_.get_R_matrix().copyTo(result.R_measured);
+  pnp_detection_.get_t_matrix().copyTo(result.t_measured);
+}
+
+// -- Step 5 and 6: Filter the measured pose
+void PoseEstimator::track(PoseResult &result, double timestamp)
+{
+  // Without RANSAC the pose is only predicted, once there is an estimate
+  if (result.ransac_done || !rotation_estimated_.empty())
+  {
+
+    // -- Step 5: Kalman Filter
+
+    // Get the measured translation and rotation
+    result.t_measured.copyTo(translation_);
+    result.R_measured.copyTo(rotation_);
+
+    int n_inliers = result.ransac_done ? result.n_inliers : 0;
+    good_measurement_ = kf_.predictPose(n_inliers, translation_, rotation_, timestamp);
+
+
+    // -- Step 6: Set estimated projection matrix
+
+    pnp_detection_est_.set_P_matrix(rotation_, translation_);
+    translation_.copyTo(translation_estimated_);
+    rotation_.copyTo(rotation_estimated_);
+
+  }
+
+  result.good_measurement = good_measurement_;
+  result.lost = kf_.lost();
+  result.has_estimate = !rotation_estimated_.empty();
+  if (result.has_estimate)
+  {
+    rotation_estimated_.copyTo(result.R_estimated);
+    translation_estimated_.copyTo(result.t_estimated);
+  }
+}
+
+bool PoseEstimator::predictAt(double timestamp, cv::Mat &R, cv::Mat &t) const
+{
+  if (rotation_estimated_.empty()) return false;
+
+  kf_.predictAt(timestamp, t, R);
+  return true;
+}
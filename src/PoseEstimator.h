@@ -0,0 +1,152 @@
+/*
+ * PoseEstimator.h
+ *
+ *  Detection and tracking of a textured model in a stream of frames: feature
+ *  detection, robust matching, PnP RANSAC and Kalman filtering.
+ */
+
+#ifndef POSEESTIMATOR_H_
+#define POSEESTIMATOR_H_
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+#include "Model.h"
+#include "ModelIndex.h"
+#include "PnPProblem.h"
+#include "RobustMatcher.h"
+#include "kalman_filter_tracker.h"
+
+struct PoseEstimatorConfig
+{
+  PoseEstimatorConfig();
+
+  /** Intrinsic camera parameters: fx, fy, cx, cy */
+  double camera_params[4];
+
+  // Feature detection
+  int num_keypoints;        // ORB feature budget
+  double downscale;         // the frames are downscaled by this factor before detection
+
+  // Matching
+  float ratio_test;         // ratio test
+  bool fast_match;          // fastRobustMatch() or robustMatch()
+  bool visibility;          // match only model points facing the predicted camera
+  bool gating;              // match only model points at a compatible scale
+  float octave_tolerance;   // max octaves between expected and detected scale
+
+  // RANSAC
+  int pnp_method;           // PnP method
+  int ransac_iterations;    // number of Ransac iterations
+  float reprojection_error; // maximum allowed distance to consider it an inlier
+  double confidence;        // ransac successful confidence
+
+  // Kalman Filter
+  int min_inliers_kalman;   // Kalman threshold updating
+  double dt;                // time between measurements
+  double lost_covariance_growth; // position variance growth without measurement at which the track is lost
+};
+
+struct PoseResult
+{
+  PoseResult();
+
+  // Reset for a new frame, the buffers keep their memory
+  void clear();
+
+  int n_matches;                              // matches between the scene and the model
+  int n_inliers;                              // RANSAC inliers
+  bool ransac_done;                           // RANSAC ran on this frame
+  double ransac_ms;                           // time spent in RANSAC on this frame
+  bool good_measurement;                      // the pose was measured, not only predicted
+  bool lost;                                  // the prediction is too uncertain to guide the matching
+  bool has_estimate;                          // R_estimated and t_estimated are set
+  cv::Mat R_measured, t_measured;             // last measured pose
+  cv::Mat R_estimated, t_estimated;           // last Kalman estimated pose
+  std::vector<cv::Point2f> points2d_matched;  // matched 2D points of the scene
+  std::vector<cv::Point2f> points2d_inliers;  // RANSAC inliers
+};
+
+// All the state of one tracked object in one stream. The model and the index
+// are only read, so several estimators, one per thread, can share them; the
+// model must outlive its estimators. detect() and measure()/track() use
+// disjoint members, a pipeline may call them from two threads.
+class PoseEstimator
+{
+public:
+  PoseEstimator(const Model &model, const PoseEstimatorConfig &config);
+  PoseEstimator(const Model &model, const cv::Ptr<ModelIndex> &index, const PoseEstimatorConfig &config);
+  virtual ~PoseEstimator();
+
+  // The LSH index of the model descriptors used by the estimators
+  static cv::Ptr<ModelIndex> createIndex(const Model &model);
+
+  // Detect, measure and track a frame taken at a time in seconds, negative for
+  // the fixed config dt. The result is reused by the next call.
+  const PoseResult& process(const cv::Mat &frame, double timestamp = -1);
+
+  // The stages of process(). Only measure() reads the tracked pose, for the
+  // visibility and scale gating; track() must be called in frame order.
+  void detect(const cv::Mat &frame, std::vector<cv::KeyPoint> &keypoints, cv::Mat &descriptors);
+  void measure(const std::vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors, PoseResult &result);
+  void track(PoseResult &result, double timestamp = -1);
+
+  // The tracked pose extrapolated to a time in seconds, in the timestamps of
+  // track(). False if there is no estimate yet.
+  bool predictAt(double timestamp, cv::Mat &R, cv::Mat &t) const;
+
+  const PoseEstimatorConfig& config() const { return config_; }
+  const cv::Ptr<cv::ORB>& detector() const { return orb_; }
+  // The tracked pose guides the matching until the track is lost, then the
+  // whole model is matched again
+  bool tracking() const { return !kf_.lost(); }
+
+  int ransacIterations() const { return config_.ransac_iterations; }
+  void setRansacIterations(int iterations) { config_.ransac_iterations = iterations; }
+  void setTimeStep(double dt) { kf_.setTimeStep(dt); }
+
+private:
+  PoseEstimator(const PoseEstimator&);
+  PoseEstimator& operator=(const PoseEstimator&);
+
+  void init();
+  void match(const std::vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors);
+
+  /** The settings, visibility and gating are disabled if the model lacks their data */
+  PoseEstimatorConfig config_;
+
+  /** The model data and the index of its descriptors */
+  const std::vector<cv::Point3f> &list_points3d_model_;
+  const cv::Mat descriptors_model_;
+  const std::vector<cv::Point3f> &list_normals_model_;
+  const std::vector<float> &list_feature_sizes_model_;
+  cv::Ptr<ModelIndex> model_index_;
+
+  /** Detector, extractor and matcher */
+  cv::Ptr<cv::ORB> orb_;
+  RobustMatcher rmatcher_;
+
+  /** Measured and estimated pose */
+  PnPProblem pnp_detection_;
+  PnPProblem pnp_detection_est_;
+  KalmanFilterTracker kf_;
+  bool good_measurement_;
+  cv::Mat translation_estimated_, rotation_estimated_;
+
+  /** Per frame buffers, reused from one frame to the next */
+  cv::Mat gray_, small_;
+  std::vector<cv::KeyPoint> keypoints_;
+  cv::Mat descriptors_;
+  cv::Mat descriptors_visible_;
+  std::vector<int> visible_idx_;
+  std::vector<float> list_sizes2d_model_;
+  std::vector<cv::DMatch> good_matches_;
+  std::vector<cv::Point3f> list_points3d_model_match_;
+  cv::Mat inliers_idx_;
+  cv::Mat translation_, rotation_;
+  PoseResult result_;
+};
+
+#endif /* POSEESTIMATOR_H_ */
@@ -0,0 +1,119 @@
+/*
+ * PoseWriter.cpp
+ *
+ *  Writes one pose row per frame, as CSV or as fixed size binary records.
+ */
+
+#include "PoseWriter.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+
+// Binary layout: a PoseFileHeader followed by one PoseFileRecord per frame,
+// little endian as written by the host
+const char POSE_FILE_MAGIC[4] = { 'P', 'N', 'P', 'T' };
+const uint32_t POSE_FILE_VERSION = 1;
+
+struct PoseFileHeader
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t reserved;
+};
+
+struct PoseFileRecord
+{
+  int32_t frame;
+  int32_t inliers;
+  int32_t measured;
+  float ms;
+  double R[9];   // row major
+  double t[3];
+};
+
+// Element i in row major order of a CV_32F or CV_64F matrix, read in place
+double element(const cv::Mat &m, int i)
+{
+  const int row = i / m.cols, col = i % m.cols;
+  return m.depth() == CV_32F ? (double)m.ptr<float>(row)[col] : m.ptr<double>(row)[col];
+}
+
+// Copy the pose into row major doubles, NaN if there is no pose
+void poseToArray(const cv::Mat &R, const cv::Mat &t, double *R_out, double *t_out)
+{
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+
+  for (int i = 0; i < 9; ++i) R_out[i] = R.empty() ? nan : element(R, i);
+  for (int i = 0; i < 3; ++i) t_out[i] = t.empty() ? nan : element(t, i);
+}
+
+}
+
+PoseWriter::PoseWriter() : format_(CSV)
+{
+}
+
+PoseWriter::~PoseWriter()
+{
+  close();
+}
+
+bool PoseWriter::open(const std::string &path, Format format)
+{
+  close();
+  format_ = format;
+
+  if (format_ == BINARY)
+  {
+    file_.open(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file_.is_open()) return false;
+
+    PoseFileHeader header;
+    std::copy(POSE_FILE_MAGIC, POSE_FILE_MAGIC + 4, header.magic);
+    header.version = POSE_FILE_VERSION;
+    header.record_size = sizeof(PoseFileRecord);
+    header.reserved = 0;
+    file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  }
+  else
+  {
+    file_.open(path.c_str(), std::ios::out | std::ios::trunc);
+    if (!file_.is_open()) return false;
+
+    file_ << "frame,r11,r12,r13,r21,r22,r23,r31,r32,r33,tx,ty,tz,inliers,measured,ms" << std::endl;
+    file_.precision(std::numeric_limits<double>::digits10 + 2);
+  }
+
+  return true;
+}
+
+void PoseWriter::close()
+{
+  if (file_.is_open()) file_.close();
+}
+
+void PoseWriter::write(int frame, const cv::Mat &R, const cv::Mat &t, int inliers, bool measured, double ms)
+{
+  PoseFileRecord record;
+  record.frame = frame;
+  record.inliers = inliers;
+  record.measured = measured ? 1 : 0;
+  record.ms = (float)ms;
+  poseToArray(R, t, record.R, record.t);
+
+  if (format_ == BINARY)
+  {
+    file_.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    return;
+  }
+
+  file_ << record.frame;
+  for (int i = 0; i < 9; ++i) file_ << "," << record.R[i];
+  for (int i = 0; i < 3; ++i) file_ << "," << record.t[i];
+  file_ << "," << record.inliers << "," << record.measured << "," << ms << "\n";
+}
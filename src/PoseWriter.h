@@ -0,0 +1,40 @@
+/*
+ * PoseWriter.h
+ *
+ *  Writes one pose row per frame, as CSV or as fixed size binary records.
+ */
+
+#ifndef POSEWRITER_H_
+#define POSEWRITER_H_
+
+#include <fstream>
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+class PoseWriter
+{
+public:
+  enum Format { CSV, BINARY };
+
+  PoseWriter();
+  virtual ~PoseWriter();
+
+  bool open(const std::string &path, Format format);
+  void close();
+  bool isOpened() const { return file_.is_open(); }
+
+  // Write the pose of a frame, an empty R or t is written as NaN (no pose yet)
+  void write(int frame, const cv::Mat &R, const cv::Mat &t, int inliers, bool measured, double ms);
+
+private:
+  PoseWriter(const PoseWriter&);
+  PoseWriter& operator=(const PoseWriter&);
+
+  /** The output file */
+  std::ofstream file_;
+  /** The output format */
+  Format format_;
+};
+
+#endif /* POSEWRITER_H_ */
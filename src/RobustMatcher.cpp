@@ -6,7 +6,11 @@
  */
 
 #include "RobustMatcher.h"
+#include "StageTimer.h"
+#include "Utils.h"
 #include <time.h>
+#include <cmath>
+#include <algorithm>
 
 #include <opencv2/features2d/features2d.hpp>
 
@@ -17,16 +21,20 @@ RobustMatcher::~RobustMatcher()
 
 void RobustMatcher::computeKeyPoints( const cv::Mat& image, std::vector<cv::KeyPoint>& keypoints)
 {
+  StageTimer timer(STAGE_DETECT);
   detector_->detect(image, keypoints);
 }
 
 void RobustMatcher::computeDescriptors( const cv::Mat& image, std::vector<cv::KeyPoint>& keypoints, cv::Mat& descriptors)
 {
+  StageTimer timer(STAGE_DESCRIBE);
   extractor_->compute(image, keypoints, descriptors);
 }
 
 int RobustMatcher::ratioTest(std::vector<std::vector<cv::DMatch> > &matches)
 {
+  StageTimer timer(STAGE_RATIO_TEST);
+  TRACE_ARG("matches", matches.size());
   int removed = 0;
   // for all matches
   for ( std::vector<std::vector<cv::DMatch> >::iterator
@@ -48,6 +56,7 @@ int RobustMatcher::ratioTest(std::vector<std::vector<cv::DMatch> > &matches)
       removed++;
     }
   }
+  TRACE_ARG("removed", removed);
   return removed;
 }
 
@@ -55,6 +64,7 @@ void RobustMatcher::symmetryTest( const std::vector<std::vector<cv::DMatch> >& m
                      const std::vector<std::vector<cv::DMatch> >& matches2,
                      std::vector<cv::DMatch>& symMatches )
 {
+  StageTimer timer(STAGE_SYMMETRY_TEST);
 
   // for all matches image 1 -> image 2
    for (std::vector<std::vector<cv::DMatch> >::const_iterator
@@ -88,6 +98,7 @@ void RobustMatcher::symmetryTest( const std::vector<std::vector<cv::DMatch> >& m
         }
       }
    }
+   TRACE_ARG("matches", symMatches.size());
 
 }
 
@@ -103,46 +114,190 @@ void RobustMatcher::robustMatch( const cv::Mat& frame, std::vector<cv::DMatch>&
   this->computeDescriptors(frame, keypoints_frame, descriptors_frame);
 
   // 2. Match the two image descriptors
-  std::vector<std::vector<cv::DMatch> > matches12, matches21;
+  this->robustMatchDescriptors(descriptors_frame, descriptors_model, good_matches);
 
-  // 2a. From image 1 to image 2
-  matcher_->knnMatch(descriptors_frame, descriptors_model, matches12, 2); // return 2 nearest neighbours
+}
+
+void RobustMatcher::fastRobustMatch( const cv::Mat& frame, std::vector<cv::DMatch>& good_matches,
+                                 std::vector<cv::KeyPoint>& keypoints_frame,
+                                 const cv::Mat& descriptors_model )
+{
+  // 1a. Detection of the ORB features
+  this->computeKeyPoints(frame, keypoints_frame);
+
+  // 1b. Extraction of the ORB descriptors
+  cv::Mat descriptors_frame;
+  this->computeDescriptors(frame, keypoints_frame, descriptors_frame);
 
-  // 2b. From image 2 to image 1
-  matcher_->knnMatch(descriptors_model, descriptors_frame, matches21, 2); // return 2 nearest neighbours
+  // 2. Match the two image descriptors
+  this->fastRobustMatchDescriptors(descriptors_frame, descriptors_model, good_matches);
+
+}
+
+void RobustMatcher::fastRobustMatchScaleGated( const cv::Mat& frame, std::vector<cv::DMatch>& good_matches,
+                                               std::vector<cv::KeyPoint>& keypoints_frame,
+                                               const cv::Mat& descriptors_model,
+                                               const std::vector<float>& model_sizes,
+                                               float scale_factor, float octave_tolerance )
+{
+  // 1a. Detection of the ORB features
+  this->computeKeyPoints(frame, keypoints_frame);
+
+  // 1b. Extraction of the ORB descriptors
+  cv::Mat descriptors_frame;
+  this->computeDescriptors(frame, keypoints_frame, descriptors_frame);
 
-  // 3. Remove matches for which NN ratio is > than threshold
+  // 2. Match the two image descriptors
+  this->fastRobustMatchScaleGatedDescriptors(keypoints_frame, descriptors_frame, descriptors_model,
+                                             model_sizes, scale_factor, octave_tolerance, good_matches);
+
+}
+
+void RobustMatcher::robustMatchDescriptors( const cv::Mat& descriptors_frame, const cv::Mat& descriptors_model,
+                                            std::vector<cv::DMatch>& good_matches )
+{
+  good_matches.clear();
+
+  // 1. Match the two image descriptors
+  std::vector<std::vector<cv::DMatch> > &matches12 = matches_, &matches21 = matches21_;
+
+  {
+    StageTimer timer(STAGE_MATCH);
+
+    // 1a. From image 1 to image 2
+    matcher_->knnMatch(descriptors_frame, descriptors_model, matches12, 2); // return 2 nearest neighbours
+
+    // 1b. From image 2 to image 1
+    matcher_->knnMatch(descriptors_model, descriptors_frame, matches21, 2); // return 2 nearest neighbours
+  }
+
+  // 2. Remove matches for which NN ratio is > than threshold
   // clean image 1 -> image 2 matches
   ratioTest(matches12);
   // clean image 2 -> image 1 matches
   ratioTest(matches21);
 
-  // 4. Remove non-symmetrical matches
+  // 3. Remove non-symmetrical matches
   symmetryTest(matches12, matches21, good_matches);
 
 }
 
-void RobustMatcher::fastRobustMatch( const cv::Mat& frame, std::vector<cv::DMatch>& good_matches,
-                                 std::vector<cv::KeyPoint>& keypoints_frame,
-                                 const cv::Mat& descriptors_model )
+void RobustMatcher::fastRobustMatchDescriptors( const cv::Mat& descriptors_frame, const cv::Mat& descriptors_model,
+                                                std::vector<cv::DMatch>& good_matches )
 {
   good_matches.clear();
 
-  // 1a. Detection of the ORB features
-  this->computeKeyPoints(frame, keypoints_frame);
+  // 1. Match the two image descriptors
+  std::vector<std::vector<cv::DMatch> > &matches = matches_;
+  {
+    StageTimer timer(STAGE_MATCH);
+    matcher_->knnMatch(descriptors_frame, descriptors_model, matches, 2);
+  }
 
-  // 1b. Extraction of the ORB descriptors
-  cv::Mat descriptors_frame;
-  this->computeDescriptors(frame, keypoints_frame, descriptors_frame);
+  // 2. Remove matches for which NN ratio is > than threshold
+  ratioTest(matches);
 
-  // 2. Match the two image descriptors
-  std::vector<std::vector<cv::DMatch> > matches;
-  matcher_->knnMatch(descriptors_frame, descriptors_model, matches, 2);
+  // 3. Fill good matches container
+  for ( std::vector<std::vector<cv::DMatch> >::iterator
+         matchIterator= matches.begin(); matchIterator!= matches.end(); ++matchIterator)
+  {
+    if (!matchIterator->empty()) good_matches.push_back((*matchIterator)[0]);
+  }
+
+}
+
+void RobustMatcher::fastRobustMatchScaleGatedDescriptors( const std::vector<cv::KeyPoint>& keypoints_frame,
+                                                          const cv::Mat& descriptors_frame,
+                                                          const cv::Mat& descriptors_model,
+                                                          const std::vector<float>& model_sizes,
+                                                          float scale_factor, float octave_tolerance,
+                                                          std::vector<cv::DMatch>& good_matches )
+{
+  good_matches.clear();
+
+  if (keypoints_frame.empty()) return;
+
+  // 1. Group the frame keypoints by pyramid octave
+  int min_octave = keypoints_frame[0].octave, max_octave = keypoints_frame[0].octave;
+  for (int i = 1; i < (int)keypoints_frame.size(); ++i)
+  {
+    min_octave = std::min(min_octave, keypoints_frame[i].octave);
+    max_octave = std::max(max_octave, keypoints_frame[i].octave);
+  }
+
+  std::vector<std::vector<int> > &octaves = octaves_;
+  octaves.resize(max_octave - min_octave + 1);
+  for (size_t o = 0; o < octaves.size(); ++o) octaves[o].clear();
+  for (int i = 0; i < (int)keypoints_frame.size(); ++i)
+  {
+    octaves[keypoints_frame[i].octave - min_octave].push_back(i);
+  }
+
+  const double log_scale = std::log((double)scale_factor);
+  std::vector<int> &candidates = candidates_;
+  std::vector<std::vector<cv::DMatch> > &matches = matches_;
+
+  for (std::vector<std::vector<int> >::const_iterator
+       octaveIterator = octaves.begin(); octaveIterator != octaves.end(); ++octaveIterator)
+  {
+    const std::vector<int>& query_idx = *octaveIterator;
+    if (query_idx.empty()) continue;
+    const double octave_size = keypoints_frame[query_idx[0]].size;
+
+    // 2. Model descriptors expected at a compatible octave
+    candidates.clear();
+    for (int j = 0; j < (int)model_sizes.size(); ++j)
+    {
+      if (model_sizes[j] > 0 &&
+          std::fabs(std::log(octave_size / model_sizes[j]) / log_scale) <= octave_tolerance)
+      {
+        candidates.push_back(j);
+      }
+    }
+    if (candidates.size() < 2) continue;
+
+    // 3. Match the octave descriptors against the candidates only
+    {
+      StageTimer timer(STAGE_MATCH);
+      selectDescriptors(descriptors_frame, query_idx, descriptors_query_);
+      selectDescriptors(descriptors_model, candidates, descriptors_train_);
+      gated_matcher_->knnMatch(descriptors_query_, descriptors_train_, matches, 2);
+    }
+
+    // 4. Remove matches for which NN ratio is > than threshold
+    ratioTest(matches);
+
+    // 5. Fill good matches container, back to frame and model indices
+    for ( std::vector<std::vector<cv::DMatch> >::iterator
+           matchIterator= matches.begin(); matchIterator!= matches.end(); ++matchIterator)
+    {
+      if (matchIterator->empty()) continue;
+
+      cv::DMatch match = (*matchIterator)[0];
+      match.queryIdx = query_idx[match.queryIdx];
+      match.trainIdx = candidates[match.trainIdx];
+      good_matches.push_back(match);
+    }
+  }
+
+}
+
+void RobustMatcher::fastRobustMatchIndexed( const cv::Mat& descriptors_frame, const ModelIndex& model_index,
+                                            std::vector<cv::DMatch>& good_matches )
+{
+  good_matches.clear();
+
+  // 1. Match the frame descriptors against the model index
+  std::vector<std::vector<cv::DMatch> > &matches = matches_;
+  {
+    StageTimer timer(STAGE_MATCH);
+    model_index.knnMatch(descriptors_frame, matches, 2, indices_, dists_);
+  }
 
-  // 3. Remove matches for which NN ratio is > than threshold
+  // 2. Remove matches for which NN ratio is > than threshold
   ratioTest(matches);
 
-  // 4. Fill good matches container
+  // 3. Fill good matches container
   for ( std::vector<std::vector<cv::DMatch> >::iterator
          matchIterator= matches.begin(); matchIterator!= matches.end(); ++matchIterator)
   {
@@ -14,6 +14,8 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/features2d/features2d.hpp>
 
+#include "ModelIndex.h"
+
 class RobustMatcher {
 public:
   RobustMatcher() : ratio_(0.8f)
@@ -25,6 +27,9 @@ public:
     // BruteFroce matcher with Norm Hamming is the default matcher
     matcher_ = cv::makePtr<cv::BFMatcher>((int)cv::NORM_HAMMING, false);
 
+    // the scale gated candidate sets change every octave, brute force avoids an index rebuild
+    gated_matcher_ = cv::makePtr<cv::BFMatcher>((int)cv::NORM_HAMMING, false);
+
   }
   virtual ~RobustMatcher();
 
@@ -67,6 +72,33 @@ public:
                        std::vector<cv::KeyPoint>& keypoints_frame,
                        const cv::Mat& descriptors_model );
 
+ // Match feature points using ratio test, each frame keypoint is matched only against
+ // the model descriptors whose expected image size is within octave_tolerance pyramid
+ // octaves of its own octave
+ void fastRobustMatchScaleGated( const cv::Mat& frame, std::vector<cv::DMatch>& good_matches,
+                                 std::vector<cv::KeyPoint>& keypoints_frame,
+                                 const cv::Mat& descriptors_model,
+                                 const std::vector<float>& model_sizes,
+                                 float scale_factor, float octave_tolerance );
+
+ // The same matching strategies, given the already computed frame descriptors
+ void robustMatchDescriptors( const cv::Mat& descriptors_frame, const cv::Mat& descriptors_model,
+                              std::vector<cv::DMatch>& good_matches );
+
+ void fastRobustMatchDescriptors( const cv::Mat& descriptors_frame, const cv::Mat& descriptors_model,
+                                  std::vector<cv::DMatch>& good_matches );
+
+ void fastRobustMatchScaleGatedDescriptors( const std::vector<cv::KeyPoint>& keypoints_frame,
+                                            const cv::Mat& descriptors_frame,
+                                            const cv::Mat& descriptors_model,
+                                            const std::vector<float>& model_sizes,
+                                            float scale_factor, float octave_tolerance,
+                                            std::vector<cv::DMatch>& good_matches );
+
+ // Match feature points using ratio test against a prebuilt index of the model descriptors
+ void fastRobustMatchIndexed( const cv::Mat& descriptors_frame, const ModelIndex& model_index,
+                              std::vector<cv::DMatch>& good_matches );
+
 private:
   // pointer to the feature point detector object
   cv::Ptr<cv::FeatureDetector> detector_;
@@ -74,8 +106,17 @@ private:
   cv::Ptr<cv::DescriptorExtractor> extractor_;
   // pointer to the matcher object
   cv::Ptr<cv::DescriptorMatcher> matcher_;
+  // pointer to the matcher of the scale gated candidate sets
+  cv::Ptr<cv::DescriptorMatcher> gated_matcher_;
   // max ratio between 1st and 2nd NN
   float ratio_;
+
+  // matching buffers, reused from one frame to the next
+  std::vector<std::vector<cv::DMatch> > matches_, matches21_;
+  std::vector<std::vector<int> > octaves_;
+  std::vector<int> candidates_;
+  cv::Mat descriptors_query_, descriptors_train_;
+  cv::Mat indices_, dists_;
 };
 
 #endif /* ROBUSTMATCHER_H_ */
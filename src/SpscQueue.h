@@ -0,0 +1,144 @@
+/*
+ * SpscQueue.h
+ *
+ *  Bounded single-producer/single-consumer lock-free ring buffer. The blocking
+ *  push() and pop() sleep once a short spin fails, an idle stage takes no CPU.
+ */
+
+#ifndef SPSCQUEUE_H_
+#define SPSCQUEUE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class SpscQueue
+{
+public:
+  explicit SpscQueue(size_t capacity)
+    : buffer_(capacity + 1), head_(0), tail_(0), producer_waiting_(false), consumer_waiting_(false) {}
+
+  size_t capacity() const { return buffer_.size() - 1; }
+
+  // Producer side: moves the item into the queue, returns false if it is full
+  bool tryPush(T &item)
+  {
+    if (!pushItem(item)) return false;
+
+    wake(consumer_waiting_, not_empty_);
+    return true;
+  }
+
+  // Producer side: waits until there is room for the item
+  void push(T &item)
+  {
+    for (int i = 0; i < SPIN_TRIES; ++i)
+    {
+      if (tryPush(item)) return;
+      std::this_thread::yield();
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wait(producer_waiting_);
+      while (!pushItem(item)) not_full_.wait(lock);
+      producer_waiting_.store(false, std::memory_order_relaxed);
+    }
+    wake(consumer_waiting_, not_empty_);
+  }
+
+  // Consumer side: moves the oldest item out of the queue, returns false if it is empty
+  bool tryPop(T &item)
+  {
+    if (!popItem(item)) return false;
+
+    wake(producer_waiting_, not_full_);
+    return true;
+  }
+
+  // Consumer side: waits until there is an item
+  void pop(T &item)
+  {
+    for (int i = 0; i < SPIN_TRIES; ++i)
+    {
+      if (tryPop(item)) return;
+      std::this_thread::yield();
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wait(consumer_waiting_);
+      while (!popItem(item)) not_empty_.wait(lock);
+      consumer_waiting_.store(false, std::memory_order_relaxed);
+    }
+    wake(producer_waiting_, not_full_);
+  }
+
+private:
+  SpscQueue(const SpscQueue&);
+  SpscQueue& operator=(const SpscQueue&);
+
+  size_t increment(size_t i) const { return i + 1 == buffer_.size() ? 0 : i + 1; }
+
+  // The lock-free ring operations, without waking the other side
+  bool pushItem(T &item)
+  {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    const size_t next = increment(tail);
+    if (next == head_.load(std::memory_order_acquire)) return false;
+
+    buffer_[tail] = std::move(item);
+    tail_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool popItem(T &item)
+  {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) return false;
+
+    item = std::move(buffer_[head]);
+    head_.store(increment(head), std::memory_order_release);
+    return true;
+  }
+
+  // The fences order the flag against the index of the other side: either the
+  // waiter sees the new index before sleeping, or the other side sees the flag
+  // and notifies under the mutex, which the waiter holds until it sleeps
+  static void wait(std::atomic<bool> &waiting)
+  {
+    waiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  void wake(std::atomic<bool> &waiting, std::condition_variable &condition)
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!waiting.load(std::memory_order_relaxed)) return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    condition.notify_one();
+  }
+
+  /** Failed tries of push() and pop() before they sleep */
+  enum { SPIN_TRIES = 64 };
+
+  /** The ring buffer, one slot is kept empty to tell full from empty */
+  std::vector<T> buffer_;
+  /** The next slot to pop, written by the consumer only */
+  alignas(64) std::atomic<size_t> head_;
+  /** The next slot to push, written by the producer only */
+  alignas(64) std::atomic<size_t> tail_;
+  /** Set while a side sleeps in push() or pop() */
+  std::atomic<bool> producer_waiting_, consumer_waiting_;
+  /** Wake the sleeping side */
+  std::mutex mutex_;
+  std::condition_variable not_full_, not_empty_;
+};
+
+#endif /* SPSCQUEUE_H_ */
@@ -0,0 +1,220 @@
+/*
+ * StageTimer.cpp
+ *
+ *  Monotonic clock timing of the processing stages, recorded in per-thread
+ *  buffers without locks and summed up on demand.
+ */
+
+#include "StageTimer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <mutex>
+
+namespace
+{
+
+// The last durations kept per stage and thread for the percentiles
+const int RECENT_SAMPLES = 1024;
+
+// The durations of one stage recorded by one thread. Only the owner thread
+// writes, with relaxed stores; count is released last so that a reader sees
+// the samples it counts.
+struct StageBuffer
+{
+  StageBuffer() : count(0), total(0), max(0)
+  {
+    for (int i = 0; i < RECENT_SAMPLES; ++i) recent[i].store(0, std::memory_order_relaxed);
+  }
+
+  std::atomic<long long> count;
+  std::atomic<double> total;
+  std::atomic<double> max;
+  std::atomic<float> recent[RECENT_SAMPLES];
+};
+
+struct ThreadBuffers
+{
+  StageBuffer stages[N_STAGES];
+};
+
+// The durations of the threads that exited, merged under the registry lock
+struct RetiredStage
+{
+  RetiredStage() : count(0), total(0), max(0), recent(RECENT_SAMPLES, 0) {}
+
+  long long count;
+  double total;
+  double max;
+  std::vector<float> recent;   // a ring of the last samples, indexed by count
+};
+
+// The buffers of the running threads. A thread takes a buffer on its first
+// record, the only locked operation besides its exit: then its durations are
+// merged into the retired ones and the buffer is reset and kept for the next
+// thread, so the memory is bounded by the threads running at once.
+std::mutex registry_mutex;
+std::vector<ThreadBuffers*> registry;
+std::vector<ThreadBuffers*> free_buffers;
+RetiredStage retired[N_STAGES];
+
+std::atomic<bool> enabled(true);
+
+void retireBuffers(ThreadBuffers *buffers)
+{
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry.erase(std::find(registry.begin(), registry.end(), buffers));
+
+  for (int s = 0; s < N_STAGES; ++s)
+  {
+    StageBuffer &buffer = buffers->stages[s];
+    RetiredStage &stage = retired[s];
+
+    const long long n = buffer.count.load(std::memory_order_relaxed);
+    for (long long i = std::max(0LL, n - RECENT_SAMPLES); i < n; ++i)
+    {
+      stage.recent[(stage.count + i) % RECENT_SAMPLES] = buffer.recent[i % RECENT_SAMPLES].load(std::memory_order_relaxed);
+    }
+    stage.count += n;
+    stage.total += buffer.total.load(std::memory_order_relaxed);
+    stage.max = std::max(stage.max, buffer.max.load(std::memory_order_relaxed));
+
+    buffer.count.store(0, std::memory_order_relaxed);
+    buffer.total.store(0, std::memory_order_relaxed);
+    buffer.max.store(0, std::memory_order_relaxed);
+  }
+
+  free_buffers.push_back(buffers);
+}
+
+// Owns the buffers of a thread, retires them when the thread exits
+struct ThreadBuffersHolder
+{
+  ThreadBuffersHolder() : buffers(NULL) {}
+  ~ThreadBuffersHolder()
+  {
+    if (buffers) retireBuffers(buffers);
+  }
+
+  ThreadBuffers *buffers;
+};
+
+ThreadBuffers* threadBuffers()
+{
+  static thread_local ThreadBuffersHolder holder;
+  if (!holder.buffers)
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    if (free_buffers.empty())
+    {
+      holder.buffers = new ThreadBuffers();
+    }
+    else
+    {
+      holder.buffers = free_buffers.back();
+      free_buffers.pop_back();
+    }
+    registry.push_back(holder.buffers);
+  }
+  return holder.buffers;
+}
+
+const char* const stage_names[N_STAGES] =
+{
+  "detect", "describe", "match", "ratio test", "symmetry", "ransac", "kalman", "draw"
+};
+
+}
+
+void recordStageTime(PipelineStage stage, double ms)
+{
+  StageBuffer &buffer = threadBuffers()->stages[stage];
+
+  const long long n = buffer.count.load(std::memory_order_relaxed);
+  buffer.recent[n % RECENT_SAMPLES].store((float)ms, std::memory_order_relaxed);
+  buffer.total.store(buffer.total.load(std::memory_order_relaxed) + ms, std::memory_order_relaxed);
+  if (ms > buffer.max.load(std::memory_order_relaxed)) buffer.max.store(ms, std::memory_order_relaxed);
+  buffer.count.store(n + 1, std::memory_order_release);
+}
+
+void setStageTimingEnabled(bool on)
+{
+  enabled.store(on, std::memory_order_relaxed);
+}
+
+bool stageTimingEnabled()
+{
+  return enabled.load(std::memory_order_relaxed);
+}
+
+const char* stageName(PipelineStage stage)
+{
+  return stage >= 0 && stage < N_STAGES ? stage_names[stage] : "";
+}
+
+void stageTimingSnapshot(std::vector<StageSnapshot> &snapshot)
+{
+  snapshot.assign(N_STAGES, StageSnapshot());
+  for (int s = 0; s < N_STAGES; ++s)
+  {
+    snapshot[s].recent = PerfStats(stage_names[s]);
+  }
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (int s = 0; s < N_STAGES; ++s)
+  {
+    const RetiredStage &stage = retired[s];
+    snapshot[s].count = stage.count;
+    snapshot[s].total = stage.total;
+    snapshot[s].max = stage.max;
+
+    const long long first = std::max(0LL, stage.count - RECENT_SAMPLES);
+    for (long long i = first; i < stage.count; ++i)
+    {
+      snapshot[s].recent.add(stage.recent[i % RECENT_SAMPLES]);
+    }
+  }
+
+  for (size_t t = 0; t < registry.size(); ++t)
+  {
+    for (int s = 0; s < N_STAGES; ++s)
+    {
+      const StageBuffer &buffer = registry[t]->stages[s];
+      StageSnapshot &stage = snapshot[s];
+
+      const long long n = buffer.count.load(std::memory_order_acquire);
+      stage.count += n;
+      stage.total += buffer.total.load(std::memory_order_relaxed);
+      stage.max = std::max(stage.max, buffer.max.load(std::memory_order_relaxed));
+
+      // The owner may overwrite the oldest samples meanwhile, they are as recent
+      const long long first = std::max(0LL, n - RECENT_SAMPLES);
+      for (long long i = first; i < n; ++i)
+      {
+        stage.recent.add(buffer.recent[i % RECENT_SAMPLES].load(std::memory_order_relaxed));
+      }
+    }
+  }
+}
+
+void printStageTimings(std::ostream &os)
+{
+  std::vector<StageSnapshot> snapshot;
+  stageTimingSnapshot(snapshot);
+
+  std::ios::fmtflags flags = os.flags();
+  for (int s = 0; s < N_STAGES; ++s)
+  {
+    const StageSnapshot &stage = snapshot[s];
+    if (stage.count == 0) continue;
+
+    os << std::left << std::setw(12) << stage_names[s] << std::right << std::fixed << std::setprecision(3)
+       << " n=" << std::setw(6) << stage.count
+       << " mean=" << std::setw(9) << stage.total / stage.count
+       << " p50=" << std::setw(9) << stage.recent.percentile(50)
+       << " p99=" << std::setw(9) << stage.recent.percentile(99)
+       << " max=" << std::setw(9) << stage.max << " ms" << std::endl;
+  }
+  os.flags(flags);
+}
@@ -0,0 +1,86 @@
+/*
+ * StageTimer.h
+ *
+ *  Monotonic clock timing of the processing stages, recorded in per-thread
+ *  buffers without locks and summed up on demand.
+ */
+
+#ifndef STAGETIMER_H_
+#define STAGETIMER_H_
+
+#include <iostream>
+#include <vector>
+
+#include "PerfStats.h"
+#include "Trace.h"
+
+enum PipelineStage
+{
+  STAGE_DETECT,
+  STAGE_DESCRIBE,
+  STAGE_MATCH,
+  STAGE_RATIO_TEST,
+  STAGE_SYMMETRY_TEST,
+  STAGE_RANSAC,
+  STAGE_KALMAN,
+  STAGE_DRAW,
+  N_STAGES
+};
+
+// The summary of a stage over all the threads
+struct StageSnapshot
+{
+  StageSnapshot() : count(0), total(0), max(0) {}
+
+  long long count;   // durations recorded since the start
+  double total;      // their sum in ms
+  double max;        // the longest one in ms
+  PerfStats recent;  // the last durations of each thread, for the percentiles
+};
+
+// Record the duration of a stage in the buffer of the calling thread. Each
+// thread only writes its own buffer, the snapshots read them with atomics.
+void recordStageTime(PipelineStage stage, double ms);
+
+// The timing is on by default, it costs two clock reads per timed stage
+void setStageTimingEnabled(bool enabled);
+bool stageTimingEnabled();
+
+// The name of a stage
+const char* stageName(PipelineStage stage);
+
+// The summary of every stage, indexed by PipelineStage
+void stageTimingSnapshot(std::vector<StageSnapshot> &snapshot);
+
+// One line per stage that ran: count, mean, p50, p99 and max in ms
+void printStageTimings(std::ostream &os);
+
+// Times the enclosing scope as a stage, and traces it as a span when the
+// tracing is compiled in
+class StageTimer
+{
+public:
+  explicit StageTimer(PipelineStage stage)
+    : stage_(stage), start_(stageTimingEnabled() ? PerfStats::now() : -1)
+#ifdef PNP_ENABLE_TRACING
+    , trace_(stageName(stage))
+#endif
+  {}
+
+  ~StageTimer()
+  {
+    if (start_ >= 0) recordStageTime(stage_, PerfStats::now() - start_);
+  }
+
+private:
+  StageTimer(const StageTimer&);
+  StageTimer& operator=(const StageTimer&);
+
+  PipelineStage stage_;
+  double start_;
+#ifdef PNP_ENABLE_TRACING
+  TraceScope trace_;
+#endif
+};
+
+#endif /* STAGETIMER_H_ */
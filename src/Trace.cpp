@@ -0,0 +1,162 @@
+/*
+ * Trace.cpp
+ *
+ *  Begin/end spans of the processing, kept in a ring buffer and written as
+ *  Chrome trace-event JSON (chrome://tracing, Perfetto). The scopes are only
+ *  compiled with PNP_ENABLE_TRACING, they cost nothing otherwise.
+ */
+
+#include "Trace.h"
+
+#ifdef PNP_ENABLE_TRACING
+
+#include <atomic>
+#include <fstream>
+#include <vector>
+
+#include "PerfStats.h"
+
+namespace
+{
+
+// The spans kept, the oldest ones are overwritten
+const size_t TRACE_CAPACITY = 1 << 16;
+
+// A complete span ("ph": "X")
+struct TraceEvent
+{
+  const char *name;
+  double start, duration;   // ms on the PerfStats clock
+  int tid;
+  int n_args;
+  const char *arg_names[TraceScope::MAX_ARGS];
+  long long arg_values[TraceScope::MAX_ARGS];
+};
+
+// The threads claim the slots with an atomic counter, so they never wait for
+// each other; a slot is only read by traceWrite() once the threads are done.
+struct TraceBuffer
+{
+  TraceBuffer() : events(TRACE_CAPACITY), next(0) {}
+
+  std::vector<TraceEvent> events;
+  std::atomic<unsigned long long> next;
+};
+
+TraceBuffer& traceBuffer()
+{
+  static TraceBuffer buffer;
+  return buffer;
+}
+
+std::atomic<int> next_tid(0);
+
+int threadId()
+{
+  static thread_local int tid = next_tid++;
+  return tid;
+}
+
+thread_local TraceScope *current_scope = NULL;
+
+}
+
+TraceScope::TraceScope(const char *name)
+  : name_(name), start_(PerfStats::now()), n_args_(0), parent_(current_scope)
+{
+  current_scope = this;
+}
+
+TraceScope::~TraceScope()
+{
+  double end = PerfStats::now();
+  current_scope = parent_;
+
+  TraceBuffer &buffer = traceBuffer();
+  TraceEvent &event = buffer.events[buffer.next++ % TRACE_CAPACITY];
+  event.name = name_;
+  event.start = start_;
+  event.duration = end - start_;
+  event.tid = threadId();
+  event.n_args = n_args_;
+  for (int i = 0; i < n_args_; ++i)
+  {
+    event.arg_names[i] = arg_names_[i];
+    event.arg_values[i] = arg_values_[i];
+  }
+}
+
+void TraceScope::arg(const char *name, long long value)
+{
+  if (n_args_ >= MAX_ARGS) return;
+  arg_names_[n_args_] = name;
+  arg_values_[n_args_] = value;
+  ++n_args_;
+}
+
+TraceScope* TraceScope::current()
+{
+  return current_scope;
+}
+
+bool traceCompiled()
+{
+  return true;
+}
+
+bool traceWrite(const std::string &path)
+{
+  std::ofstream file(path.c_str());
+  if (!file.is_open()) return false;
+
+  TraceBuffer &buffer = traceBuffer();
+  const unsigned long long n = buffer.next.load();
+  const unsigned long long first = n > TRACE_CAPACITY ? n - TRACE_CAPACITY : 0;
+
+  // The earliest span kept is the time origin
+  double origin = 0;
+  for (unsigned long long i = first; i < n; ++i)
+  {
+    const TraceEvent &event = buffer.events[i % TRACE_CAPACITY];
+    if (i == first || event.start < origin) origin = event.start;
+  }
+
+  file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+  file.setf(std::ios::fixed);
+  file.precision(3);
+  for (unsigned long long i = first; i < n; ++i)
+  {
+    const TraceEvent &event = buffer.events[i % TRACE_CAPACITY];
+
+    // Timestamps and durations are in microseconds
+    file << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.tid
+         << ", \"ts\": " << (event.start - origin) * 1000.0 << ", \"dur\": " << event.duration * 1000.0;
+    if (event.n_args > 0)
+    {
+      file << ", \"args\": {";
+      for (int a = 0; a < event.n_args; ++a)
+      {
+        file << (a > 0 ? ", " : "") << "\"" << event.arg_names[a] << "\": " << event.arg_values[a];
+      }
+      file << "}";
+    }
+    file << "}" << (i + 1 < n ? "," : "") << std::endl;
+  }
+  file << "]}" << std::endl;
+
+  return true;
+}
+
+#else
+
+bool traceCompiled()
+{
+  return false;
+}
+
+bool traceWrite(const std::string &)
+{
+  return false;
+}
+
+#endif
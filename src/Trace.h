@@ -0,0 +1,69 @@
+/*
+ * Trace.h
+ *
+ *  Begin/end spans of the processing, kept in a ring buffer and written as
+ *  Chrome trace-event JSON (chrome://tracing, Perfetto). The scopes are only
+ *  compiled with PNP_ENABLE_TRACING, they cost nothing otherwise.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <string>
+
+// Write the spans in the ring buffer as a Chrome trace-event JSON file. Call it
+// once the traced threads are done. False if it could not be written or the
+// tracing is not compiled in.
+bool traceWrite(const std::string &path);
+
+// True if the library was built with PNP_ENABLE_TRACING
+bool traceCompiled();
+
+#ifdef PNP_ENABLE_TRACING
+
+// A span from its construction to its destruction, on the calling thread.
+// The name must be a string literal, it is kept as a pointer.
+class TraceScope
+{
+public:
+  explicit TraceScope(const char *name);
+  ~TraceScope();
+
+  // Attach an integer argument to the span, up to MAX_ARGS
+  void arg(const char *name, long long value);
+
+  // The innermost open span of the calling thread, NULL if none
+  static TraceScope* current();
+
+  enum { MAX_ARGS = 4 };
+
+private:
+  TraceScope(const TraceScope&);
+  TraceScope& operator=(const TraceScope&);
+
+  const char *name_;
+  double start_;
+  int n_args_;
+  const char *arg_names_[MAX_ARGS];
+  long long arg_values_[MAX_ARGS];
+  TraceScope *parent_;
+};
+
+#define PNP_TRACE_CONCAT_(a, b) a##b
+#define PNP_TRACE_CONCAT(a, b) PNP_TRACE_CONCAT_(a, b)
+
+// Trace the enclosing scope as a span
+#define TRACE_SCOPE(name) TraceScope PNP_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+// Attach an argument to the innermost open span of the thread
+#define TRACE_ARG(name, value) \
+  do { if (TraceScope::current()) TraceScope::current()->arg(name, (long long)(value)); } while (0)
+
+#else
+
+#define TRACE_SCOPE(name) do { } while (0)
+#define TRACE_ARG(name, value) do { } while (0)
+
+#endif
+
+#endif /* TRACE_H_ */
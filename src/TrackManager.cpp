@@ -0,0 +1,281 @@
+/*
+ * TrackManager.cpp
+ *
+ *  Tracks of many objects, filtered with the constant acceleration model of
+ *  KalmanFilterTracker and stored as structure of arrays so that all the
+ *  tracks are predicted together.
+ */
+
+#include "TrackManager.h"
+
+#include <algorithm>
+
+#include "Utils.h"
+#include "kalman_filter_tracker.h"
+
+// The arrays of the tracks never overlap: the loops over the tracks are vectorized
+// without run-time alias checks, which the compiler gives up on for this many arrays
+#if defined(__clang__)
+#define PNP_VECTORIZE_LOOP _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define PNP_VECTORIZE_LOOP _Pragma("GCC ivdep")
+#else
+#define PNP_VECTORIZE_LOOP
+#endif
+
+namespace
+{
+
+// The last element takes the place of the removed one, the arrays stay dense
+template <typename T>
+void swapRemove(std::vector<T> &values, int i)
+{
+  values[i] = values.back();
+  values.pop_back();
+}
+
+}
+
+TrackMeasurement::TrackMeasurement(int object_id, const cv::Mat &R, const cv::Mat &t)
+  : object_id(object_id), R(R), t(t.at<double>(0), t.at<double>(1), t.at<double>(2))
+{
+}
+
+TrackMeasurement::TrackMeasurement(int object_id, const PnPProblem &pnp)
+  : object_id(object_id), R(pnp.get_R_matrix())
+{
+  cv::Mat translation = pnp.get_t_matrix();
+  t = cv::Vec3d(translation.at<double>(0), translation.at<double>(1), translation.at<double>(2));
+}
+
+TrackManager::TrackManager(double dt, double gate, double maxCovarianceGrowth)
+  : processNoise_(1e-5), measurementNoise_(1e-2), dt_(dt), timestamp_(-1),
+    gate_(gate), maxCovarianceGrowth_(maxCovarianceGrowth), nextTrackId_(0)
+{
+}
+
+TrackManager::~TrackManager()
+{
+}
+
+void TrackManager::clear()
+{
+  trackIds_.clear();
+  objectIds_.clear();
+  coasting_.clear();
+  for (int c = 0; c < N_CHAINS; ++c)
+  {
+    for (int k = 0; k < 3; ++k) x_[c][k].clear();
+    for (int k = 0; k < N_COV; ++k) P_[c][k].clear();
+    correctedVariance_[c].clear();
+  }
+  for (int k = 0; k < 4; ++k) q_[k].clear();
+  timestamp_ = -1;
+}
+
+int TrackManager::find(int track_id) const
+{
+  std::vector<int>::const_iterator it = std::find(trackIds_.begin(), trackIds_.end(), track_id);
+  return it == trackIds_.end() ? -1 : (int)(it - trackIds_.begin());
+}
+
+// x = F x, P = F P F' + q I on every chain of every track. The chains share F,
+// so each chain is one branchless loop over contiguous arrays, vectorized with
+// optimizations on (e.g. 2 tracks per SSE2 instruction with gcc -O3). The rotation
+// error is left in the chains until the next correction, so no track needs a
+// trigonometric function here.
+void TrackManager::predict(double timestamp)
+{
+  double dt = dt_;
+  if (timestamp >= 0)
+  {
+    if (timestamp_ >= 0 && timestamp > timestamp_) dt = timestamp - timestamp_;
+    timestamp_ = timestamp;
+  }
+
+  //  F = [1 a b]
+  //      [0 1 a]
+  //      [0 0 1]
+  const double a = dt, b = 0.5*dt*dt, q = processNoise_;
+  const int n = size();
+
+  for (int c = 0; c < N_CHAINS; ++c)
+  {
+    double *x0 = x_[c][0].data(), *x1 = x_[c][1].data();
+    const double *x2 = x_[c][2].data();
+    double *p00 = P_[c][P00].data(), *p01 = P_[c][P01].data(), *p02 = P_[c][P02].data();
+    double *p11 = P_[c][P11].data(), *p12 = P_[c][P12].data(), *p22 = P_[c][P22].data();
+    PNP_VECTORIZE_LOOP
+    for (int i = 0; i < n; ++i)
+    {
+      chainPredict(a, b, q, x0[i], x1[i], x2[i], p00[i], p01[i], p02[i], p11[i], p12[i], p22[i]);
+    }
+  }
+
+  std::fill(coasting_.begin(), coasting_.end(), 1);
+}
+
+void TrackManager::update(const std::vector<TrackMeasurement> &measurements)
+{
+  const int n_measurements = (int)measurements.size();
+  const int n_tracks = size();
+
+  // 1. Gated candidate pairs of the same object
+  candidates_.clear();
+  for (int m = 0; m < n_measurements; ++m)
+  {
+    for (int i = 0; i < n_tracks; ++i)
+    {
+      if (objectIds_[i] != measurements[m].object_id) continue;
+
+      Candidate candidate;
+      candidate.distance = gateDistance(i, measurements[m].t);
+      candidate.measurement = m;
+      candidate.track = i;
+      if (candidate.distance <= gate_) candidates_.push_back(candidate);
+    }
+  }
+
+  // 2. Nearest pairs first, each measurement and each track used once
+  std::sort(candidates_.begin(), candidates_.end());
+  measurementUsed_.assign(n_measurements, 0);
+  trackUsed_.assign(n_tracks, 0);
+
+  for (size_t k = 0; k < candidates_.size(); ++k)
+  {
+    const Candidate &candidate = candidates_[k];
+    if (measurementUsed_[candidate.measurement] || trackUsed_[candidate.track]) continue;
+
+    correct(candidate.track, measurements[candidate.measurement]);
+    measurementUsed_[candidate.measurement] = 1;
+    trackUsed_[candidate.track] = 1;
+  }
+
+  // 3. Retire the lost tracks, before the new ones are added
+  for (int i = n_tracks - 1; i >= 0; --i)
+  {
+    if (lost(i)) removeTrack(i);
+  }
+
+  // 4. New tracks for the measurements left
+  for (int m = 0; m < n_measurements; ++m)
+  {
+    if (!measurementUsed_[m]) addTrack(measurements[m]);
+  }
+}
+
+// Squared translation distance normalized by the predicted and measurement variances
+double TrackManager::gateDistance(int i, const cv::Vec3d &t) const
+{
+  double distance = 0;
+  for (int c = 0; c < 3; ++c)
+  {
+    const double d = t[c] - x_[c][0][i];
+    distance += d * d / (P_[c][P00][i] + measurementNoise_);
+  }
+  return distance;
+}
+
+cv::Vec4d TrackManager::orientation(int i) const
+{
+  return cv::Vec4d(q_[0][i], q_[1][i], q_[2][i], q_[3][i]);
+}
+
+// The measurement update of KalmanChain on each chain of one track
+void TrackManager::correct(int i, const TrackMeasurement &measurement)
+{
+  // The measured rotation from the orientation, on SO(3)
+  const cv::Vec4d q = orientation(i);
+  const cv::Vec3d rotation_error = quatLog(quatMultiply(quatConjugate(q), rot2quat(measurement.R)));
+
+  for (int c = 0; c < N_CHAINS; ++c)
+  {
+    const double z = c < 3 ? measurement.t[c] : rotation_error[c - 3];
+
+    chainCorrect(z, measurementNoise_, x_[c][0][i], x_[c][1][i], x_[c][2][i],
+                 P_[c][P00][i], P_[c][P01][i], P_[c][P02][i], P_[c][P11][i], P_[c][P12][i], P_[c][P22][i]);
+
+    correctedVariance_[c][i] = P_[c][P00][i];
+  }
+
+  // Move the rotation error into the orientation and reset it
+  cv::Vec3d rotation_estimated(x_[3][0][i], x_[4][0][i], x_[5][0][i]);
+  cv::Vec4d corrected = quatMultiply(q, quatExp(rotation_estimated));
+  corrected *= 1.0 / cv::norm(corrected);
+  for (int k = 0; k < 4; ++k) q_[k][i] = corrected[k];
+  x_[3][0][i] = x_[4][0][i] = x_[5][0][i] = 0;
+
+  coasting_[i] = 0;
+}
+
+bool TrackManager::lost(int i) const
+{
+  for (int c = 0; c < N_CHAINS; ++c)
+  {
+    if (P_[c][P00][i] > maxCovarianceGrowth_ * correctedVariance_[c][i]) return true;
+  }
+  return false;
+}
+
+void TrackManager::pose(int i, cv::Mat &R, cv::Mat &t) const
+{
+  t.create(3, 1, CV_64F);
+  for (int c = 0; c < 3; ++c)
+  {
+    t.at<double>(c) = x_[c][0][i];
+  }
+
+  cv::Vec3d rotation_error(x_[3][0][i], x_[4][0][i], x_[5][0][i]);
+  const cv::Matx33d rotation = quat2rot(quatMultiply(orientation(i), quatExp(rotation_error)));
+  cv::Mat(rotation, false).copyTo(R);
+}
+
+// A new track at the measured pose, at rest, with the position as certain as
+// the measurement and the velocity and acceleration unknown. The unit velocity
+// variance grows the position variance quickly, so an unconfirmed track is retired
+// after a few missed frames (3 at the default settings) while a track measured
+// for a few seconds has converged and coasts longer (about 2 s): a spurious
+// measurement does not leave a track behind.
+int TrackManager::addTrack(const TrackMeasurement &measurement)
+{
+  trackIds_.push_back(nextTrackId_++);
+  objectIds_.push_back(measurement.object_id);
+  coasting_.push_back(0);
+
+  for (int c = 0; c < N_CHAINS; ++c)
+  {
+    x_[c][0].push_back(c < 3 ? measurement.t[c] : 0);
+    x_[c][1].push_back(0);
+    x_[c][2].push_back(0);
+
+    P_[c][P00].push_back(measurementNoise_);
+    P_[c][P01].push_back(0);
+    P_[c][P02].push_back(0);
+    P_[c][P11].push_back(1);
+    P_[c][P12].push_back(0);
+    P_[c][P22].push_back(1);
+
+    correctedVariance_[c].push_back(measurementNoise_);
+  }
+
+  cv::Vec4d q = rot2quat(measurement.R);
+  for (int k = 0; k < 4; ++k) q_[k].push_back(q[k]);
+
+  return size() - 1;
+}
+
+// The last track takes the place of the removed one
+void TrackManager::removeTrack(int i)
+{
+  swapRemove(trackIds_, i);
+  swapRemove(objectIds_, i);
+  swapRemove(coasting_, i);
+
+  for (int c = 0; c < N_CHAINS; ++c)
+  {
+    for (int k = 0; k < 3; ++k) swapRemove(x_[c][k], i);
+    for (int k = 0; k < N_COV; ++k) swapRemove(P_[c][k], i);
+    swapRemove(correctedVariance_[c], i);
+  }
+  for (int k = 0; k < 4; ++k) swapRemove(q_[k], i);
+}
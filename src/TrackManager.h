@@ -0,0 +1,116 @@
+/*
+ * TrackManager.h
+ *
+ *  Tracks of many objects, filtered with the constant acceleration model of
+ *  KalmanFilterTracker and stored as structure of arrays so that all the
+ *  tracks are predicted together.
+ */
+
+#ifndef TRACKMANAGER_H_
+#define TRACKMANAGER_H_
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "PnPProblem.h"
+
+// A measured pose of an object, e.g. a successful RANSAC of its PnPProblem
+struct TrackMeasurement
+{
+  TrackMeasurement() : object_id(0) {}
+  TrackMeasurement(int object_id, const cv::Mat &R, const cv::Mat &t);
+  TrackMeasurement(int object_id, const PnPProblem &pnp);
+
+  int object_id;     // the model the pose was measured with
+  cv::Matx33d R;     // rotation
+  cv::Vec3d t;       // translation
+};
+
+class TrackManager
+{
+public:
+  // dt: default time step. gate: maximum squared normalized distance between a
+  // measured and a predicted translation. maxCovarianceGrowth: variance growth
+  // without measurement at which a track is retired, see addTrack for how long
+  // new and converged tracks coast.
+  explicit TrackManager(double dt = 0.125, double gate = 11.34, double maxCovarianceGrowth = 10);
+  virtual ~TrackManager();
+
+  // Predict all the tracks to a time in seconds, the default dt if negative or
+  // not after the previous one
+  void predict(double timestamp = -1);
+
+  // Associate the measurements of a frame to the predicted tracks of the same
+  // object, nearest first within the gate, and correct them. The measurements
+  // left create new tracks, the lost tracks are retired.
+  void update(const std::vector<TrackMeasurement> &measurements);
+
+  // Remove all the tracks
+  void clear();
+
+  // The tracks, indexed from 0 to size() - 1. The indices change when a track
+  // is retired, the track ids do not.
+  int size() const { return (int)trackIds_.size(); }
+  int trackId(int i) const { return trackIds_[i]; }
+  int objectId(int i) const { return objectIds_[i]; }
+  int find(int track_id) const;
+
+  // The estimated pose of a track
+  void pose(int i, cv::Mat &R, cv::Mat &t) const;
+
+  // True if the track was not measured in the last frame
+  bool coasting(int i) const { return coasting_[i] != 0; }
+
+  // True if a variance has grown by more than maxCovarianceGrowth since the
+  // last measurement of the track
+  bool lost(int i) const;
+
+  /** The chains of a pose: x, y, z and the rotation error about x, y, z */
+  enum { N_CHAINS = 6 };
+
+private:
+  /** The upper triangle of a 3 x 3 covariance: 00 01 02 11 12 22 */
+  enum { P00, P01, P02, P11, P12, P22, N_COV };
+
+  int addTrack(const TrackMeasurement &measurement);
+  void removeTrack(int i);
+  void correct(int i, const TrackMeasurement &measurement);
+  double gateDistance(int i, const cv::Vec3d &t) const;
+  cv::Vec4d orientation(int i) const;
+
+  /** Noise variances, the same as KalmanFilterTracker */
+  double processNoise_, measurementNoise_;
+  /** Default time step, time of the last prediction, -1 if none */
+  double dt_, timestamp_;
+  /** Association gate and retirement threshold */
+  double gate_, maxCovarianceGrowth_;
+  /** The next track id */
+  int nextTrackId_;
+
+  // One element per track in each array
+
+  std::vector<int> trackIds_, objectIds_;
+  std::vector<char> coasting_;
+  /** Position, velocity and acceleration of each chain */
+  std::vector<double> x_[N_CHAINS][3];
+  /** Covariance of each chain */
+  std::vector<double> P_[N_CHAINS][N_COV];
+  /** Variance of each chain after its last correction */
+  std::vector<double> correctedVariance_[N_CHAINS];
+  /** Orientation (w, x, y, z), the rotation chains hold the error around it */
+  std::vector<double> q_[4];
+
+  // Association buffers, reused from one frame to the next
+
+  struct Candidate
+  {
+    double distance;
+    int measurement, track;
+    bool operator<(const Candidate &other) const { return distance < other.distance; }
+  };
+  std::vector<Candidate> candidates_;
+  std::vector<char> measurementUsed_, trackUsed_;
+};
+
+#endif /* TRACKMANAGER_H_ */
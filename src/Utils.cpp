@@ -5,6 +5,7 @@
  *      Author: Edgar Riba
  */
 
+#include <cstdio>
 #include <iostream>
 
 #include "PnPProblem.h"
@@ -150,22 +151,37 @@ void draw3DCoordinateAxes(cv::Mat image, const std::vector<cv::Point2f> &list_po
 // Draw the object mesh
 void drawObjectMesh(cv::Mat image, const Mesh *mesh, PnPProblem *pnpProblem, cv::Scalar color)
 {
-  std::vector<std::vector<int> > list_triangles = mesh->getTrianglesList();
-  for( size_t i = 0; i < list_triangles.size(); i++)
+  // Project every vertex once
+  std::vector<cv::Point2f> list_points2d;
+  pnpProblem->backproject3DPoints(mesh->getVertices(), list_points2d);
+
+  // Each unique edge is a two points polyline
+  const std::vector<std::pair<int, int> > &list_edges = mesh->getEdgesList();
+  const int num_edges = (int)list_edges.size();
+  if (num_edges == 0) return;
+
+  std::vector<cv::Point> edge_points(2 * num_edges);
+  std::vector<const cv::Point*> edge_ptrs(num_edges);
+  std::vector<int> edge_npts(num_edges, 2);
+  for (int i = 0; i < num_edges; ++i)
   {
-    std::vector<int> tmp_triangle = list_triangles.at(i);
-
-    cv::Point3f point_3d_0 = mesh->getVertex(tmp_triangle[0]);
-    cv::Point3f point_3d_1 = mesh->getVertex(tmp_triangle[1]);
-    cv::Point3f point_3d_2 = mesh->getVertex(tmp_triangle[2]);
+    const cv::Point2f &p0 = list_points2d[list_edges[i].first];
+    const cv::Point2f &p1 = list_points2d[list_edges[i].second];
+    edge_points[2*i] = cv::Point(cvRound(p0.x), cvRound(p0.y));
+    edge_points[2*i + 1] = cv::Point(cvRound(p1.x), cvRound(p1.y));
+    edge_ptrs[i] = &edge_points[2*i];
+  }
 
-    cv::Point2f point_2d_0 = pnpProblem->backproject3DPoint(point_3d_0);
-    cv::Point2f point_2d_1 = pnpProblem->backproject3DPoint(point_3d_1);
-    cv::Point2f point_2d_2 = pnpProblem->backproject3DPoint(point_3d_2);
+  cv::polylines(image, &edge_ptrs[0], &edge_npts[0], num_edges, false, color, 1);
+}
 
-    cv::line(image, point_2d_0, point_2d_1, color, 1);
-    cv::line(image, point_2d_1, point_2d_2, color, 1);
-    cv::line(image, point_2d_2, point_2d_0, color, 1);
+// Copies the given rows of a descriptors matrix
+void selectDescriptors(const cv::Mat &descriptors, const std::vector<int> &indices, cv::Mat &selected)
+{
+  selected.create((int)indices.size(), descriptors.cols, descriptors.type());
+  for (size_t i = 0; i < indices.size(); ++i)
+  {
+    descriptors.row(indices[i]).copyTo(selected.row((int)i));
   }
 }
 
@@ -179,24 +195,22 @@ double get_translation_error(const cv::Mat &t_true, const cv::Mat &t)
 double get_rotation_error(const cv::Mat &R_true, const cv::Mat &R)
 {
   cv::Mat error_vec, error_mat;
-  error_mat = R_true * cv::Mat(R.inv()).mul(-1);
+  error_mat = R_true * R.t();   // the rotation from R to R_true
   cv::Rodrigues(error_mat, error_vec);
 
   return cv::norm(error_vec);
 }
 
 // Converts a given Rotation Matrix to Euler angles
-cv::Mat rot2euler(const cv::Mat & rotationMatrix)
+cv::Vec3d rot2euler(const cv::Matx33d & rotationMatrix)
 {
-  cv::Mat euler(3,1,CV_64F);
-
-  double m00 = rotationMatrix.at<double>(0,0);
-  double m02 = rotationMatrix.at<double>(0,2);
-  double m10 = rotationMatrix.at<double>(1,0);
-  double m11 = rotationMatrix.at<double>(1,1);
-  double m12 = rotationMatrix.at<double>(1,2);
-  double m20 = rotationMatrix.at<double>(2,0);
-  double m22 = rotationMatrix.at<double>(2,2);
+  double m00 = rotationMatrix(0,0);
+  double m02 = rotationMatrix(0,2);
+  double m10 = rotationMatrix(1,0);
+  double m11 = rotationMatrix(1,1);
+  double m12 = rotationMatrix(1,2);
+  double m20 = rotationMatrix(2,0);
+  double m22 = rotationMatrix(2,2);
 
   double x, y, z;
 
@@ -218,21 +232,20 @@ cv::Mat rot2euler(const cv::Mat & rotationMatrix)
     z = atan2(-m20,m00);
   }
 
-  euler.at<double>(0) = x;
-  euler.at<double>(1) = y;
-  euler.at<double>(2) = z;
+  return cv::Vec3d(x, y, z);
+}
 
-  return euler;
+cv::Mat rot2euler(const cv::Mat & rotationMatrix)
+{
+  return cv::Mat(rot2euler(cv::Matx33d(rotationMatrix)), true);
 }
 
 // Converts a given Euler angles to Rotation Matrix
-cv::Mat euler2rot(const cv::Mat & euler)
+cv::Matx33d euler2rot(const cv::Vec3d & euler)
 {
-  cv::Mat rotationMatrix(3,3,CV_64F);
-
-  double x = euler.at<double>(0);
-  double y = euler.at<double>(1);
-  double z = euler.at<double>(2);
+  double x = euler[0];
+  double y = euler[1];
+  double z = euler[2];
 
   // Assuming the angles are in radians.
   double ch = cos(z);
@@ -254,17 +267,94 @@ cv::Mat euler2rot(const cv::Mat & euler)
   m21 = sh*sa*cb + ch*sb;
   m22 = -sh*sa*sb + ch*cb;
 
-  rotationMatrix.at<double>(0,0) = m00;
-  rotationMatrix.at<double>(0,1) = m01;
-  rotationMatrix.at<double>(0,2) = m02;
-  rotationMatrix.at<double>(1,0) = m10;
-  rotationMatrix.at<double>(1,1) = m11;
-  rotationMatrix.at<double>(1,2) = m12;
-  rotationMatrix.at<double>(2,0) = m20;
-  rotationMatrix.at<double>(2,1) = m21;
-  rotationMatrix.at<double>(2,2) = m22;
-
-  return rotationMatrix;
+  return cv::Matx33d(m00, m01, m02,
+                     m10, m11, m12,
+                     m20, m21, m22);
+}
+
+cv::Mat euler2rot(const cv::Mat & euler)
+{
+  return cv::Mat(euler2rot(cv::Vec3d(euler.at<double>(0), euler.at<double>(1), euler.at<double>(2))), true);
+}
+
+// Converts a given Rotation Matrix to a unit quaternion, from its largest
+// component so that it stays accurate for any rotation
+cv::Vec4d rot2quat(const cv::Matx33d & R)
+{
+  double trace = R(0,0) + R(1,1) + R(2,2);
+  cv::Vec4d q;
+
+  if (trace > 0)
+  {
+    double s = 2 * sqrt(1 + trace);
+    q = cv::Vec4d(0.25 * s, (R(2,1) - R(1,2)) / s, (R(0,2) - R(2,0)) / s, (R(1,0) - R(0,1)) / s);
+  }
+  else if (R(0,0) > R(1,1) && R(0,0) > R(2,2))
+  {
+    double s = 2 * sqrt(1 + R(0,0) - R(1,1) - R(2,2));
+    q = cv::Vec4d((R(2,1) - R(1,2)) / s, 0.25 * s, (R(0,1) + R(1,0)) / s, (R(0,2) + R(2,0)) / s);
+  }
+  else if (R(1,1) > R(2,2))
+  {
+    double s = 2 * sqrt(1 + R(1,1) - R(0,0) - R(2,2));
+    q = cv::Vec4d((R(0,2) - R(2,0)) / s, (R(0,1) + R(1,0)) / s, 0.25 * s, (R(1,2) + R(2,1)) / s);
+  }
+  else
+  {
+    double s = 2 * sqrt(1 + R(2,2) - R(0,0) - R(1,1));
+    q = cv::Vec4d((R(1,0) - R(0,1)) / s, (R(0,2) + R(2,0)) / s, (R(1,2) + R(2,1)) / s, 0.25 * s);
+  }
+
+  return q * (1.0 / cv::norm(q));
+}
+
+// Converts a given unit quaternion to Rotation Matrix
+cv::Matx33d quat2rot(const cv::Vec4d & q)
+{
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+
+  return cv::Matx33d(1 - 2*(y*y + z*z),     2*(x*y - w*z),     2*(x*z + w*y),
+                         2*(x*y + w*z), 1 - 2*(x*x + z*z),     2*(y*z - w*x),
+                         2*(x*z - w*y),     2*(y*z + w*x), 1 - 2*(x*x + y*y));
+}
+
+// Hamilton product of two quaternions
+cv::Vec4d quatMultiply(const cv::Vec4d & q1, const cv::Vec4d & q2)
+{
+  return cv::Vec4d(q1[0]*q2[0] - q1[1]*q2[1] - q1[2]*q2[2] - q1[3]*q2[3],
+                   q1[0]*q2[1] + q1[1]*q2[0] + q1[2]*q2[3] - q1[3]*q2[2],
+                   q1[0]*q2[2] - q1[1]*q2[3] + q1[2]*q2[0] + q1[3]*q2[1],
+                   q1[0]*q2[3] + q1[1]*q2[2] - q1[2]*q2[1] + q1[3]*q2[0]);
+}
+
+// The inverse rotation of a unit quaternion
+cv::Vec4d quatConjugate(const cv::Vec4d & q)
+{
+  return cv::Vec4d(q[0], -q[1], -q[2], -q[3]);
+}
+
+// Converts a given rotation vector to a unit quaternion
+cv::Vec4d quatExp(const cv::Vec3d & rotationVector)
+{
+  double angle = cv::norm(rotationVector);
+  if (angle < 1e-12) return cv::Vec4d(1, 0.5 * rotationVector[0], 0.5 * rotationVector[1], 0.5 * rotationVector[2]);
+
+  double s = sin(0.5 * angle) / angle;
+  return cv::Vec4d(cos(0.5 * angle), s * rotationVector[0], s * rotationVector[1], s * rotationVector[2]);
+}
+
+// Converts a given unit quaternion to the shortest rotation vector
+cv::Vec3d quatLog(const cv::Vec4d & q)
+{
+  // q and -q are the same rotation, take the one with the smaller angle
+  double sign = q[0] < 0 ? -1 : 1;
+  cv::Vec3d v(sign * q[1], sign * q[2], sign * q[3]);
+
+  double n = cv::norm(v);
+  if (n < 1e-12) return v * 2.0;
+
+  double angle = 2 * atan2(n, sign * q[0]);
+  return v * (angle / n);
 }
 
 // Converts a given string to an integer
@@ -286,7 +376,8 @@ std::string FloatToString ( float Number )
 // Converts a given integer to a string
 std::string IntToString ( int Number )
 {
-  std::ostringstream ss;
-  ss << Number;
-  return ss.str();
+  // short enough for the small string buffer, no stream and no heap allocation
+  char buffer[16];
+  std::snprintf(buffer, sizeof(buffer), "%d", Number);
+  return std::string(buffer);
 }
@@ -45,17 +45,34 @@ void draw3DCoordinateAxes(cv::Mat image, const std::vector<cv::Point2f> &list_po
 // Draw the object mesh
 void drawObjectMesh(cv::Mat image, const Mesh *mesh, PnPProblem *pnpProblem, cv::Scalar color);
 
+// Copies the given rows of a descriptors matrix
+void selectDescriptors(const cv::Mat &descriptors, const std::vector<int> &indices, cv::Mat &selected);
+
 // Computes the norm of the translation error
 double get_translation_error(const cv::Mat &t_true, const cv::Mat &t);
 
-// Computes the norm of the rotation error
+// Computes the angle of the rotation error, in radians
 double get_rotation_error(const cv::Mat &R_true, const cv::Mat &R);
 
 // Converts a given Rotation Matrix to Euler angles
 cv::Mat rot2euler(const cv::Mat & rotationMatrix);
+cv::Vec3d rot2euler(const cv::Matx33d & rotationMatrix);
 
 // Converts a given Euler angles to Rotation Matrix
 cv::Mat euler2rot(const cv::Mat & euler);
+cv::Matx33d euler2rot(const cv::Vec3d & euler);
+
+// Unit quaternions (w, x, y, z) of rotations, composed as the matrices: the
+// rotation of quatMultiply(q1, q2) is R(q1) * R(q2)
+cv::Vec4d rot2quat(const cv::Matx33d & rotationMatrix);
+cv::Matx33d quat2rot(const cv::Vec4d & q);
+cv::Vec4d quatMultiply(const cv::Vec4d & q1, const cv::Vec4d & q2);
+cv::Vec4d quatConjugate(const cv::Vec4d & q);
+
+// Rotation vector (axis * angle) to unit quaternion and back, the angle of
+// quatLog is in [0, pi]
+cv::Vec4d quatExp(const cv::Vec3d & rotationVector);
+cv::Vec3d quatLog(const cv::Vec4d & q);
 
 // Converts a given string to an integer
 int StringToInt ( const std::string &Text );
@@ -7,17 +7,41 @@
 
 #include "kalman_filter_tracker.h"
 
+#include "StageTimer.h"
 #include "Utils.h"
 
 using namespace cv; 
 
-KalmanFilterTracker::KalmanFilterTracker(const int nStates, 
-    const int nMeasurements, const int nInputs, const double dt, const int minInliersKalman) :
-  kf_(),
-  measurements_(nMeasurements, 1, CV_64F, 0.0),
+namespace
+{
+
+// The transition of one chain over a time step
+//
+//  [1 dt dt2]
+//  [0  1  dt]
+//  [0  0   1]
+Matx33d chainTransition(const double dt)
+{
+  return Matx33d(1, dt, 0.5*dt*dt,
+                 0,  1,        dt,
+                 0,  0,         1);
+}
+
+}
+
+KalmanFilterTracker::KalmanFilterTracker(const double dt, const int minInliersKalman) :
+  transition_(chainTransition(dt)),
+  dt_(dt),
+  timestamp_(-1),
+  processNoise_(1e-5),
+  measurementNoise_(1e-2),
+  maxCovarianceGrowth_(10),
+  orientation_(1, 0, 0, 0),
+  translationMeasured_(),
+  orientationMeasured_(1, 0, 0, 0),
   minInliersKalman_(minInliersKalman)
 {
-  initKalman(nStates, nMeasurements, nInputs, dt);
+  initKalman(dt);
 }
 
 
@@ -26,128 +50,158 @@ KalmanFilterTracker::~KalmanFilterTracker()
 }
 
 
-void KalmanFilterTracker::initKalman(const int nStates, const int nMeasurements, const int nInputs, const double dt)
+// The 18 states are the position, velocity and acceleration of the translation
+// and of the rotation:
+//
+//  [x y z  vx vy vz  ax ay az  dx dy dz  wx wy wz  alpha_x alpha_y alpha_z]
+//
+// The orientation itself is a unit quaternion outside of the filter, the filter
+// tracks the rotation vector d from it (error state) with the angular velocity w
+// and acceleration alpha, in the object frame. After each correction d is moved
+// into the quaternion and reset to zero, so d stays small and there is no
+// singular orientation, unlike euler angles at +-90 degrees of pitch.
+//
+// The transition matrix only couples a coordinate with its own velocity and
+// acceleration, and the noise covariances are diagonal, so the filter is six
+// independent chains of 3 states. The coupling of the rotation error with the
+// angular velocity is neglected, it is second order over one time step.
+void KalmanFilterTracker::initKalman(const double dt)
 {
 
-  kf_.init(nStates, nMeasurements, nInputs, CV_64F);         // init Kalman Filter
-
-  setIdentity(kf_.processNoiseCov, Scalar::all(1e-5));       // set process noise
-  setIdentity(kf_.measurementNoiseCov, Scalar::all(1e-2));   // set measurement noise
-  setIdentity(kf_.errorCovPost, Scalar::all(1));             // error covariance
+  for (int c = 0; c < N_CHAINS; ++c)
+  {
+    chains_[c] = KalmanChain();   // zero state, unit error covariance
+    correctedVariance_[c] = 0;    // not measured yet
+  }
+  orientation_ = Vec4d(1, 0, 0, 0);
+  dt_ = dt;
+  timestamp_ = -1;
 
 
                      /** DYNAMIC MODEL **/
 
-  //  [1 0 0 dt  0  0 dt2   0   0 0 0 0  0  0  0   0   0   0]
-  //  [0 1 0  0 dt  0   0 dt2   0 0 0 0  0  0  0   0   0   0]
-  //  [0 0 1  0  0 dt   0   0 dt2 0 0 0  0  0  0   0   0   0]
-  //  [0 0 0  1  0  0  dt   0   0 0 0 0  0  0  0   0   0   0]
-  //  [0 0 0  0  1  0   0  dt   0 0 0 0  0  0  0   0   0   0]
-  //  [0 0 0  0  0  1   0   0  dt 0 0 0  0  0  0   0   0   0]
-  //  [0 0 0  0  0  0   1   0   0 0 0 0  0  0  0   0   0   0]
-  //  [0 0 0  0  0  0   0   1   0 0 0 0  0  0  0   0   0   0]
-  //  [0 0 0  0  0  0   0   0   1 0 0 0  0  0  0   0   0   0]
-  //  [0 0 0  0  0  0   0   0   0 1 0 0 dt  0  0 dt2   0   0]
-  //  [0 0 0  0  0  0   0   0   0 0 1 0  0 dt  0   0 dt2   0]
-  //  [0 0 0  0  0  0   0   0   0 0 0 1  0  0 dt   0   0 dt2]
-  //  [0 0 0  0  0  0   0   0   0 0 0 0  1  0  0  dt   0   0]
-  //  [0 0 0  0  0  0   0   0   0 0 0 0  0  1  0   0  dt   0]
-  //  [0 0 0  0  0  0   0   0   0 0 0 0  0  0  1   0   0  dt]
-  //  [0 0 0  0  0  0   0   0   0 0 0 0  0  0  0   1   0   0]
-  //  [0 0 0  0  0  0   0   0   0 0 0 0  0  0  0   0   1   0]
-  //  [0 0 0  0  0  0   0   0   0 0 0 0  0  0  0   0   0   1]
-
-  // position
-  kf_.transitionMatrix.at<double>(0,3) = dt;
-  kf_.transitionMatrix.at<double>(1,4) = dt;
-  kf_.transitionMatrix.at<double>(2,5) = dt;
-  kf_.transitionMatrix.at<double>(3,6) = dt;
-  kf_.transitionMatrix.at<double>(4,7) = dt;
-  kf_.transitionMatrix.at<double>(5,8) = dt;
-  kf_.transitionMatrix.at<double>(0,6) = 0.5*pow(dt,2);
-  kf_.transitionMatrix.at<double>(1,7) = 0.5*pow(dt,2);
-  kf_.transitionMatrix.at<double>(2,8) = 0.5*pow(dt,2);
-
-  // orientation
-  kf_.transitionMatrix.at<double>(9,12) = dt;
-  kf_.transitionMatrix.at<double>(10,13) = dt;
-  kf_.transitionMatrix.at<double>(11,14) = dt;
-  kf_.transitionMatrix.at<double>(12,15) = dt;
-  kf_.transitionMatrix.at<double>(13,16) = dt;
-  kf_.transitionMatrix.at<double>(14,17) = dt;
-  kf_.transitionMatrix.at<double>(9,15) = 0.5*pow(dt,2);
-  kf_.transitionMatrix.at<double>(10,16) = 0.5*pow(dt,2);
-  kf_.transitionMatrix.at<double>(11,17) = 0.5*pow(dt,2);
+  setTimeStep(dt);
 
 
            /** MEASUREMENT MODEL **/
 
-  //  [1 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0]
-  //  [0 1 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0]
-  //  [0 0 1 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0]
-  //  [0 0 0 0 0 0 0 0 0 1 0 0 0 0 0 0 0 0]
-  //  [0 0 0 0 0 0 0 0 0 0 1 0 0 0 0 0 0 0]
-  //  [0 0 0 0 0 0 0 0 0 0 0 1 0 0 0 0 0 0]
+  //  [1 0 0] on each chain: the position and the rotation from the
+  //  estimated orientation are measured
+
+}
 
-  kf_.measurementMatrix.at<double>(0,0) = 1;  // x
-  kf_.measurementMatrix.at<double>(1,1) = 1;  // y
-  kf_.measurementMatrix.at<double>(2,2) = 1;  // z
-  kf_.measurementMatrix.at<double>(3,9) = 1;  // roll
-  kf_.measurementMatrix.at<double>(4,10) = 1; // pitch
-  kf_.measurementMatrix.at<double>(5,11) = 1; // yaw
 
+void KalmanFilterTracker::setTimeStep(const double dt)
+{
+
+  // Only the three entries depending on dt change from one step to the next
+  transition_(0,1) = dt;
+  transition_(1,2) = dt;
+  transition_(0,2) = 0.5*dt*dt;
 
 }
 
 
-bool KalmanFilterTracker::predictPose(const int nInliers, cv::Mat &translation, cv::Mat &rotation)
+bool KalmanFilterTracker::predictPose(const int nInliers, cv::Mat &translation, cv::Mat &rotation,
+                                      const double timestamp)
 {
+  StageTimer timer(STAGE_KALMAN);
   bool good_measurement = false;
 
+  // Time step from the frame timestamps, the default one if they go backwards
+  if(timestamp >= 0)
+  {
+    setTimeStep(timestamp_ >= 0 && timestamp > timestamp_ ? timestamp - timestamp_ : dt_);
+    timestamp_ = timestamp;
+  }
+
   if(nInliers > minInliersKalman_)
   {
     updateMeasurements(translation, rotation);
     good_measurement = true;
   }
 
-  // First predict, to update the internal statePre variable
-  Mat prediction = kf_.predict();
+  // First predict, to update the internal state
+  for (int c = 0; c < N_CHAINS; ++c)
+  {
+    chains_[c].predict(transition_, processNoise_);
+  }
+
+  // The "correct" phase that is going to use the predicted value and our measurement.
+  // Without a good measurement the prediction stands and its covariance keeps growing.
+  if(good_measurement)
+  {
+    // The measured rotation from the estimated orientation, on SO(3)
+    Vec3d rotation_error = quatLog(quatMultiply(quatConjugate(orientation_), orientationMeasured_));
+
+    for (int c = 0; c < N_CHAINS; ++c)
+    {
+      double measured = c < 3 ? translationMeasured_[c] : rotation_error[c - 3];
+      chains_[c].correct(measured, measurementNoise_);
+      correctedVariance_[c] = chains_[c].P(0,0);
+    }
+  }
 
-  // The "correct" phase that is going to use the predicted value and our measurement
-  Mat estimated = kf_.correct(measurements_);
+  // Move the estimated rotation error into the orientation and reset it
+  Vec3d rotation_estimated(chains_[3].x[0], chains_[4].x[0], chains_[5].x[0]);
+  orientation_ = quatMultiply(orientation_, quatExp(rotation_estimated));
+  orientation_ *= 1.0 / norm(orientation_);
+  chains_[3].x[0] = chains_[4].x[0] = chains_[5].x[0] = 0;
 
   // Estimated translation
-  translation.at<double>(0) = estimated.at<double>(0);
-  translation.at<double>(1) = estimated.at<double>(1);
-  translation.at<double>(2) = estimated.at<double>(2);
-
-  // Estimated euler angles
-  Mat eulers_estimated(3, 1, CV_64F);
-  eulers_estimated.at<double>(0) = estimated.at<double>(9);
-  eulers_estimated.at<double>(1) = estimated.at<double>(10);
-  eulers_estimated.at<double>(2) = estimated.at<double>(11);
+  translation.create(3, 1, CV_64F);
+  translation.at<double>(0) = chains_[0].x[0];
+  translation.at<double>(1) = chains_[1].x[0];
+  translation.at<double>(2) = chains_[2].x[0];
 
-  // Convert estimated quaternion to rotation matrix
-  rotation = euler2rot(eulers_estimated);
+  // Convert estimated quaternion to rotation matrix, the header wraps it without a copy
+  const Matx33d R = quat2rot(orientation_);
+  Mat(R, false).copyTo(rotation);
 
   return good_measurement;
 }
 
 
-void KalmanFilterTracker::updateMeasurements(const cv::Mat &translation_measured, const cv::Mat &rotation_measured)
+void KalmanFilterTracker::predictAt(const double timestamp, cv::Mat &translation, cv::Mat &rotation) const
 {
+  const Matx33d F = chainTransition(timestamp_ >= 0 ? timestamp - timestamp_ : 0);
+
+  // Extrapolated translation
+  translation.create(3, 1, CV_64F);
+  for (int c = 0; c < 3; ++c)
+  {
+    translation.at<double>(c) = (F * chains_[c].x)[0];
+  }
 
-  // Convert rotation matrix to euler angles
-  Mat measured_eulers(3, 1, CV_64F);
-  measured_eulers = rot2euler(rotation_measured);
+  // Extrapolated rotation from the estimated orientation
+  Vec3d rotation_predicted((F * chains_[3].x)[0], (F * chains_[4].x)[0], (F * chains_[5].x)[0]);
+  const Matx33d R = quat2rot(quatMultiply(orientation_, quatExp(rotation_predicted)));
+  Mat(R, false).copyTo(rotation);
+}
 
-  // Set measurement to predict
-  measurements_.at<double>(0) = translation_measured.at<double>(0); // x
-  measurements_.at<double>(1) = translation_measured.at<double>(1); // y
-  measurements_.at<double>(2) = translation_measured.at<double>(2); // z
-  measurements_.at<double>(3) = measured_eulers.at<double>(0);      // roll
-  measurements_.at<double>(4) = measured_eulers.at<double>(1);      // pitch
-  measurements_.at<double>(5) = measured_eulers.at<double>(2);      // yaw
 
+bool KalmanFilterTracker::lost() const
+{
+  for (int c = 0; c < N_CHAINS; ++c)
+  {
+    if (correctedVariance_[c] <= 0 || chains_[c].P(0,0) > maxCovarianceGrowth_ * correctedVariance_[c])
+    {
+      return true;
+    }
+  }
+  return false;
 }
 
+
+void KalmanFilterTracker::updateMeasurements(const cv::Mat &translation_measured, const cv::Mat &rotation_measured)
+{
+
+  // Set measurement to predict
+  translationMeasured_[0] = translation_measured.at<double>(0); // x
+  translationMeasured_[1] = translation_measured.at<double>(1); // y
+  translationMeasured_[2] = translation_measured.at<double>(2); // z
+
+  // Convert rotation matrix to quaternion
+  orientationMeasured_ = rot2quat(Matx33d(rotation_measured));
+
+}
@@ -9,7 +9,93 @@
 #define KALMAN_FILTER_TRACKER_H_
 
 #include <opencv2/core/core.hpp>
-#include <opencv2/video/tracking.hpp>
+
+// The steps of one chain on its state x0 x1 x2 and the upper triangle of its
+// symmetric covariance, shared by KalmanChain and the structure of arrays of
+// TrackManager.
+
+// x = F x, P = F P F' + q I with the transition
+//
+//  F = [1 a b]
+//      [0 1 a]
+//      [0 0 1]
+inline void chainPredict(const double a, const double b, const double q,
+                         double &x0, double &x1, const double x2,
+                         double &p00, double &p01, double &p02, double &p11, double &p12, double &p22)
+{
+  x0 += a*x1 + b*x2;
+  x1 += a*x2;
+
+  // F P
+  const double fp00 = p00 + a*p01 + b*p02;
+  const double fp01 = p01 + a*p11 + b*p12;
+  const double fp02 = p02 + a*p12 + b*p22;
+  const double fp11 = p11 + a*p12;
+  const double fp12 = p12 + a*p22;
+
+  // (F P) F' + q I
+  p00 = fp00 + a*fp01 + b*fp02 + q;
+  p01 = fp01 + a*fp02;
+  p02 = fp02;
+  p11 = fp11 + a*fp12 + q;
+  p12 = fp12;
+  p22 += q;
+}
+
+// Measurement z of the position with noise r: the innovation covariance is
+// a scalar, the gain is the first column of P divided by it
+inline void chainCorrect(const double z, const double r,
+                         double &x0, double &x1, double &x2,
+                         double &p00, double &p01, double &p02, double &p11, double &p12, double &p22)
+{
+  const double s = p00 + r;
+  const double k0 = p00 / s, k1 = p01 / s, k2 = p02 / s;
+  const double y = z - x0;
+
+  x0 += k0 * y;
+  x1 += k1 * y;
+  x2 += k2 * y;
+
+  // P = P - K H P, H P is the first row of P
+  const double h0 = p00, h1 = p01, h2 = p02;
+  p00 -= k0 * h0;  p01 -= k0 * h1;  p02 -= k0 * h2;
+                   p11 -= k1 * h1;  p12 -= k1 * h2;
+                                    p22 -= k2 * h2;
+}
+
+// One position / velocity / acceleration chain of the constant acceleration
+// model, measured through its position only. All the matrices are fixed size,
+// predict() and correct() do not allocate.
+struct KalmanChain
+{
+  KalmanChain() : x(0, 0, 0), P(cv::Matx33d::eye()) {}
+
+  // x = F x, P = F P F' + q I, F is the chain transition of chainPredict
+  void predict(const cv::Matx33d &F, const double q)
+  {
+    chainPredict(F(0,1), F(0,2), q, x[0], x[1], x[2], P(0,0), P(0,1), P(0,2), P(1,1), P(1,2), P(2,2));
+    mirror();
+  }
+
+  void correct(const double z, const double r)
+  {
+    chainCorrect(z, r, x[0], x[1], x[2], P(0,0), P(0,1), P(0,2), P(1,1), P(1,2), P(2,2));
+    mirror();
+  }
+
+  // Copy the upper triangle of P to the lower one
+  void mirror()
+  {
+    P(1,0) = P(0,1);
+    P(2,0) = P(0,2);
+    P(2,1) = P(1,2);
+  }
+
+  /** State: position, velocity, acceleration */
+  cv::Vec3d x;
+  /** Error covariance */
+  cv::Matx33d P;
+};
 
 class KalmanFilterTracker
 {
@@ -17,20 +103,51 @@ class KalmanFilterTracker
 public:
   /* Default constructor */
   explicit
-  KalmanFilterTracker(const int nStates, const int nMeasurements, const int nInputs, const double dt, const int minInliersKalman);
+  KalmanFilterTracker(const double dt, const int minInliersKalman);
   ~KalmanFilterTracker();
 
-  void initKalman(const int nStates, const int nMeasurements, const int nInputs, const double dt);
-  bool predictPose(const int nInliers, cv::Mat &translation, cv::Mat &rotation);
+  void initKalman(const double dt);
+  void setTimeStep(const double dt);
+
+  // Filter a measured pose. With a timestamp in seconds the time step is the time
+  // since the previous timestamped call, the first one uses the default dt; without
+  // one the last set time step is used.
+  bool predictPose(const int nInliers, cv::Mat &translation, cv::Mat &rotation, const double timestamp = -1);
+
+  // The pose extrapolated to a time in seconds from the last filtered state,
+  // without changing it. Before any timestamped call, the current estimate.
+  void predictAt(const double timestamp, cv::Mat &translation, cv::Mat &rotation) const;
+
+  // The track is lost when the variance of a coordinate has grown by more than
+  // the given factor since its last measurement, or before the first one: the
+  // predicted pose is no longer a useful prior for the matching
+  bool lost() const;
+  void setMaxCovarianceGrowth(const double growth) { maxCovarianceGrowth_ = growth; }
+
+  /** The chains of the pose: x, y, z and the rotation error about x, y, z */
+  enum { N_CHAINS = 6 };
 
 private:
   void updateMeasurements(const cv::Mat &translation_measured, const cv::Mat &rotation_measured);
 
-  /** The Linear Kalmnan Filter object */
-  cv::KalmanFilter kf_;
-  /** Matrix with the measurements */
-  cv::Mat measurements_;
-  /** Threshold to update the measurements matrix */
+  /** The independent chains of the 18 states filter */
+  KalmanChain chains_[N_CHAINS];
+  /** The transition matrix, the same for all the chains */
+  cv::Matx33d transition_;
+  /** The default time step and the time of the last filtered pose, -1 if none */
+  double dt_, timestamp_;
+  /** Process and measurement noise variances */
+  double processNoise_, measurementNoise_;
+  /** The variance of each coordinate after its last correction, 0 if none */
+  double correctedVariance_[N_CHAINS];
+  /** The variance growth from the last correction at which the track is lost */
+  double maxCovarianceGrowth_;
+  /** The estimated orientation, the rotation chains hold the error around it */
+  cv::Vec4d orientation_;
+  /** The last measured pose: translation and orientation */
+  cv::Vec3d translationMeasured_;
+  cv::Vec4d orientationMeasured_;
+  /** Threshold to update the measurements */
   const int minInliersKalman_;
 };
 
@@ -0,0 +1,512 @@
+// C++
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+// PnP Tutorial
+#include "GroundTruth.h"
+#include "Model.h"
+#include "ModelIndex.h"
+#include "PoseEstimator.h"
+#include "PerfStats.h"
+#include "StageTimer.h"
+#include "Utils.h"
+
+/**  GLOBAL VARIABLES  **/
+
+using namespace cv;
+using namespace std;
+
+string data_path = "../Data/";
+string model_file = "cookies_ORB.yml";       // 3dpts + descriptors, in data_path
+string video_files = "box.mp4,box2.mp4";     // the benchmarked videos, in data_path
+
+// Benchmark parameters
+int seed = 0;                   // seed of the randomized LSH tables
+int warmupFrames = 20;          // untimed frames before the first video
+int maxFrames = 0;              // frames per video, 0 for all
+string results_write_path = "benchmark.yml";
+string baseline_read_path = "";
+double timeTolerance = 0.15;      // relative slowdown accepted on throughput and latency
+double accuracyTolerance = 0.05;  // relative degradation accepted on inliers, tracking and jitter
+
+// Pose estimation parameters, the defaults of pnp_detection. A synthetic video
+// with a ground truth file brings its own intrinsics.
+PoseEstimatorConfig config;
+
+
+void help()
+{
+cout
+<< "--------------------------------------------------------------------------"   << endl
+<< "This program runs the detection pipeline headless over the bundled videos "
+<< "and records the throughput, the stage latencies, the inliers and the pose "
+<< "jitter, and the pose errors of the videos with a ground truth (pnp_synth). "
+<< "Given a baseline results file, it fails on a regression."                     << endl
+<< "Usage:"                                                                       << endl
+<< "./pnp_benchmark --output=benchmark.yml --baseline=baseline.yml"               << endl
+<< "--------------------------------------------------------------------------"   << endl
+<< endl;
+}
+
+
+/**  RESULTS  **/
+
+// The results of one video
+struct VideoResult
+{
+  VideoResult() : frames(0), fps(0), mean_ms(0), p50_ms(0), p99_ms(0), max_ms(0), tracked(0),
+                  mean_inliers(0), translation_jitter(0), rotation_jitter(0), truth_frames(0),
+                  translation_error(0), rotation_error(0) {}
+
+  string name;
+  int frames;
+  double fps;                   // frames per second of the processing, decoding excluded
+  double mean_ms, p50_ms, p99_ms, max_ms;   // per frame, detection to filtered pose
+  double tracked;               // fraction of the frames with a good measurement
+  double mean_inliers;
+  double translation_jitter;    // mean change of the estimated translation between two frames
+  double rotation_jitter;       // mean change of the estimated rotation between two frames, degrees
+  int truth_frames;             // frames with an estimate compared with the ground truth
+  double translation_error;     // mean error of the estimated translation
+  double rotation_error;        // mean error of the estimated rotation, degrees
+  vector<int> inliers;          // RANSAC inliers of each frame
+};
+
+// The latency of a stage over all the videos
+struct StageResult
+{
+  StageResult() : count(0), mean_ms(0), p50_ms(0), p99_ms(0), max_ms(0) {}
+
+  string name;
+  int count;
+  double mean_ms, p50_ms, p99_ms, max_ms;   // the percentiles over the last samples only
+};
+
+// The angle of the rotation between two rotation matrices, in degrees
+double rotationAngle(const Mat &R1, const Mat &R2)
+{
+  Mat rvec;
+  Rodrigues(Mat(R1.t() * R2), rvec);
+  return norm(rvec) * 180.0 / CV_PI;
+}
+
+// Processes every frame of a video on a fresh estimator, false if it can't be opened
+bool runVideo(const string &path, const Model &model, int frames, VideoResult &result)
+{
+  VideoCapture cap(path);
+  if(!cap.isOpened()) return false;
+
+  PoseEstimatorConfig video_config = config;
+  GroundTruth truth;
+  if(truth.load(GroundTruth::pathOf(path)))
+  {
+    for(int i = 0; i < 4; ++i) video_config.camera_params[i] = truth.camera_params[i];
+  }
+
+  // The LSH tables of the index are randomized: the same seed, the same index
+  srand(seed);
+  setRNGSeed(seed);
+  Ptr<ModelIndex> model_index = PoseEstimator::createIndex(model);
+  PoseEstimator estimator(model, model_index, video_config);
+
+  PerfStats latency;
+  Mat frame, R_previous, t_previous;
+  int good = 0, jitter_samples = 0;
+  double inliers = 0;
+
+  while((frames <= 0 || result.frames < frames) && cap.read(frame))
+  {
+    double timestamp = cap.get(CAP_PROP_POS_MSEC) / 1000.0;
+
+    double t0 = PerfStats::now();
+    const PoseResult &pose = estimator.process(frame, timestamp);
+    latency.add(PerfStats::now() - t0);
+
+    if(pose.has_estimate && result.frames < truth.size())
+    {
+      result.translation_error += get_translation_error(truth.t(result.frames), pose.t_estimated);
+      result.rotation_error += get_rotation_error(truth.R(result.frames), pose.R_estimated) * 180.0 / CV_PI;
+      ++result.truth_frames;
+    }
+
+    ++result.frames;
+    result.inliers.push_back(pose.n_inliers);
+    inliers += pose.n_inliers;
+    if(pose.good_measurement) ++good;
+
+    // Jitter between consecutive frames of a held track
+    if(pose.has_estimate && !pose.lost)
+    {
+      if(!R_previous.empty())
+      {
+        result.translation_jitter += norm(pose.t_estimated - t_previous);
+        result.rotation_jitter += rotationAngle(R_previous, pose.R_estimated);
+        ++jitter_samples;
+      }
+      pose.R_estimated.copyTo(R_previous);
+      pose.t_estimated.copyTo(t_previous);
+    }
+    else
+    {
+      R_previous.release();
+      t_previous.release();
+    }
+  }
+
+  if(result.frames > 0)
+  {
+    result.fps = latency.total() > 0 ? result.frames * 1000.0 / latency.total() : 0;
+    result.mean_ms = latency.mean();
+    result.p50_ms = latency.percentile(50);
+    result.p99_ms = latency.percentile(99);
+    result.max_ms = latency.percentile(100);
+    result.tracked = (double)good / result.frames;
+    result.mean_inliers = inliers / result.frames;
+  }
+  if(result.truth_frames > 0)
+  {
+    result.translation_error /= result.truth_frames;
+    result.rotation_error /= result.truth_frames;
+  }
+  if(jitter_samples > 0)
+  {
+    result.translation_jitter /= jitter_samples;
+    result.rotation_jitter /= jitter_samples;
+  }
+  return true;
+}
+
+void stageResults(vector<StageResult> &stages)
+{
+  vector<StageSnapshot> snapshot;
+  stageTimingSnapshot(snapshot);
+
+  stages.clear();
+  for(int s = 0; s < N_STAGES; ++s)
+  {
+    if(snapshot[s].count == 0) continue;
+
+    StageResult stage;
+    stage.name = stageName((PipelineStage)s);
+    stage.count = (int)snapshot[s].count;
+    stage.mean_ms = snapshot[s].total / snapshot[s].count;
+    stage.p50_ms = snapshot[s].recent.percentile(50);
+    stage.p99_ms = snapshot[s].recent.percentile(99);
+    stage.max_ms = snapshot[s].max;
+    stages.push_back(stage);
+  }
+}
+
+bool writeResults(const string &path, const vector<VideoResult> &videos, const vector<StageResult> &stages)
+{
+  FileStorage storage(path, FileStorage::WRITE);
+  if(!storage.isOpened()) return false;
+
+  storage << "opencv" << CV_VERSION;
+  storage << "seed" << seed;
+  storage << "keypoints" << config.num_keypoints;
+  storage << "method" << config.pnp_method;
+  storage << "fast" << (int)config.fast_match;
+  storage << "downscale" << config.downscale;
+
+  storage << "videos" << "[";
+  for(size_t i = 0; i < videos.size(); ++i)
+  {
+    const VideoResult &v = videos[i];
+    storage << "{" << "name" << v.name << "frames" << v.frames << "fps" << v.fps
+            << "mean_ms" << v.mean_ms << "p50_ms" << v.p50_ms << "p99_ms" << v.p99_ms << "max_ms" << v.max_ms
+            << "tracked" << v.tracked << "mean_inliers" << v.mean_inliers
+            << "translation_jitter" << v.translation_jitter << "rotation_jitter" << v.rotation_jitter
+            << "truth_frames" << v.truth_frames << "translation_error" << v.translation_error
+            << "rotation_error" << v.rotation_error << "inliers" << v.inliers << "}";
+  }
+  storage << "]";
+
+  storage << "stages" << "[";
+  for(size_t i = 0; i < stages.size(); ++i)
+  {
+    const StageResult &s = stages[i];
+    storage << "{" << "name" << s.name << "count" << s.count << "mean_ms" << s.mean_ms
+            << "p50_ms" << s.p50_ms << "p99_ms" << s.p99_ms << "max_ms" << s.max_ms << "}";
+  }
+  storage << "]";
+
+  storage.release();
+  return true;
+}
+
+bool readResults(const string &path, vector<VideoResult> &videos, vector<StageResult> &stages)
+{
+  FileStorage storage(path, FileStorage::READ);
+  if(!storage.isOpened()) return false;
+
+  FileNode video_nodes = storage["videos"];
+  for(FileNodeIterator it = video_nodes.begin(); it != video_nodes.end(); ++it)
+  {
+    FileNode node = *it;
+    VideoResult v;
+    node["name"] >> v.name;
+    node["frames"] >> v.frames;
+    node["fps"] >> v.fps;
+    node["mean_ms"] >> v.mean_ms;
+    node["p50_ms"] >> v.p50_ms;
+    node["p99_ms"] >> v.p99_ms;
+    node["max_ms"] >> v.max_ms;
+    node["tracked"] >> v.tracked;
+    node["mean_inliers"] >> v.mean_inliers;
+    node["translation_jitter"] >> v.translation_jitter;
+    node["rotation_jitter"] >> v.rotation_jitter;
+    node["truth_frames"] >> v.truth_frames;
+    node["translation_error"] >> v.translation_error;
+    node["rotation_error"] >> v.rotation_error;
+    node["inliers"] >> v.inliers;
+    videos.push_back(v);
+  }
+
+  FileNode stage_nodes = storage["stages"];
+  for(FileNodeIterator it = stage_nodes.begin(); it != stage_nodes.end(); ++it)
+  {
+    FileNode node = *it;
+    StageResult s;
+    node["name"] >> s.name;
+    node["count"] >> s.count;
+    node["mean_ms"] >> s.mean_ms;
+    node["p50_ms"] >> s.p50_ms;
+    node["p99_ms"] >> s.p99_ms;
+    node["max_ms"] >> s.max_ms;
+    stages.push_back(s);
+  }
+
+  storage.release();
+  return true;
+}
+
+
+/**  BASELINE COMPARISON  **/
+
+// Prints a metric next to its baseline, false if it is worse than the tolerance allows
+bool checkMetric(const string &name, double value, double baseline, double tolerance, bool higher_is_better)
+{
+  double limit = higher_is_better ? baseline * (1.0 - tolerance) : baseline * (1.0 + tolerance) + 1e-9;
+  bool ok = higher_is_better ? value >= limit : value <= limit;
+  double change = baseline != 0 ? 100.0 * (value - baseline) / baseline : 0;
+
+  cout << "  " << left << setw(20) << name << right << setw(12) << value << setw(12) << baseline
+       << setw(12) << change << " %" << (ok ? "" : "  REGRESSION") << endl;
+  return ok;
+}
+
+// Compares the videos with the baseline ones of the same name, false on any regression.
+// The stage latencies are only printed, their percentiles are too noisy to gate on.
+bool compareResults(const vector<VideoResult> &videos, const vector<StageResult> &stages,
+                    const vector<VideoResult> &baseline_videos, const vector<StageResult> &baseline_stages)
+{
+  bool ok = true;
+
+  for(size_t i = 0; i < videos.size(); ++i)
+  {
+    const VideoResult &v = videos[i];
+    const VideoResult *b = NULL;
+    for(size_t j = 0; j < baseline_videos.size(); ++j)
+    {
+      if(baseline_videos[j].name == v.name) b = &baseline_videos[j];
+    }
+
+    cout << v.name << ":" << endl;
+    if(!b)
+    {
+      cout << "  not in the baseline" << endl;
+      ok = false;
+      continue;
+    }
+    if(b->frames != v.frames)
+    {
+      cout << "  " << v.frames << " frames, " << b->frames << " in the baseline" << endl;
+      ok = false;
+      continue;
+    }
+
+    ok &= checkMetric("fps", v.fps, b->fps, timeTolerance, true);
+    ok &= checkMetric("p50 ms", v.p50_ms, b->p50_ms, timeTolerance, false);
+    ok &= checkMetric("p99 ms", v.p99_ms, b->p99_ms, timeTolerance, false);
+    ok &= checkMetric("tracked", v.tracked, b->tracked, accuracyTolerance, true);
+    ok &= checkMetric("mean inliers", v.mean_inliers, b->mean_inliers, accuracyTolerance, true);
+    ok &= checkMetric("translation jitter", v.translation_jitter, b->translation_jitter, accuracyTolerance, false);
+    ok &= checkMetric("rotation jitter", v.rotation_jitter, b->rotation_jitter, accuracyTolerance, false);
+    if(b->truth_frames > 0)
+    {
+      ok &= checkMetric("translation error", v.translation_error, b->translation_error, accuracyTolerance, false);
+      ok &= checkMetric("rotation error", v.rotation_error, b->rotation_error, accuracyTolerance, false);
+    }
+
+    // With the fixed seed the inliers are reproducible, any change is worth a look
+    int changed = 0;
+    for(size_t f = 0; f < v.inliers.size() && f < b->inliers.size(); ++f)
+    {
+      if(v.inliers[f] != b->inliers[f]) ++changed;
+    }
+    cout << "  " << changed << " of " << v.frames << " frames with different inliers" << endl;
+  }
+
+  cout << "stages (p50 ms, not gated):" << endl;
+  for(size_t i = 0; i < stages.size(); ++i)
+  {
+    for(size_t j = 0; j < baseline_stages.size(); ++j)
+    {
+      if(baseline_stages[j].name != stages[i].name) continue;
+      cout << "  " << left << setw(20) << stages[i].name << right << setw(12) << stages[i].p50_ms
+           << setw(12) << baseline_stages[j].p50_ms << endl;
+    }
+  }
+
+  return ok;
+}
+
+// A comma separated list of file names
+vector<string> splitList(const string &text)
+{
+  vector<string> items;
+  istringstream ss(text);
+  string item;
+  while(getline(ss, item, ','))
+  {
+    if(!item.empty()) items.push_back(item);
+  }
+  return items;
+}
+
+
+/**  Main program  **/
+int main(int argc, char *argv[])
+{
+
+  help();
+
+  const String keys =
+      "{help h        |                 | print this message                   }"
+      "{data          |../Data/         | directory of the model and the videos }"
+      "{model         |cookies_ORB.yml  | model file in the data directory     }"
+      "{videos        |box.mp4,box2.mp4 | comma separated videos in the data directory }"
+      "{frames        |0                | frames per video, 0 for all          }"
+      "{warmup        |20               | untimed frames before the first video }"
+      "{seed          |0                | seed of the randomized matcher index }"
+      "{keypoints k   |2000             | number of keypoints to detect        }"
+      "{method  pnp   |0                | PnP method: (0) ITERATIVE - (1) EPNP - (2) P3P - (3) DLS}"
+      "{fast f        |true             | use of robust fast match             }"
+      "{downscale     |1.0              | detect on the grayscale frame resized by this factor (0, 1] }"
+      "{output o      |benchmark.yml    | results file, *.yml or *.json        }"
+      "{baseline b    |                 | results file to compare with, fails on a regression }"
+      "{tolerance     |0.15             | accepted relative loss of throughput and latency }"
+      "{accuracy      |0.05             | accepted relative loss of inliers, tracking and jitter }"
+      ;
+  CommandLineParser parser(argc, argv, keys);
+
+  if (parser.has("help"))
+  {
+      parser.printMessage();
+      return 0;
+  }
+
+  data_path = parser.get<string>("data");
+  if(!data_path.empty() && data_path[data_path.size() - 1] != '/') data_path += "/";
+  model_file = parser.get<string>("model");
+  video_files = parser.get<string>("videos");
+  maxFrames = parser.get<int>("frames");
+  warmupFrames = max(0, parser.get<int>("warmup"));
+  seed = parser.get<int>("seed");
+  config.num_keypoints = parser.get<int>("keypoints");
+  config.pnp_method = parser.get<int>("method");
+  config.fast_match = parser.get<bool>("fast");
+  config.downscale = parser.get<double>("downscale");
+  results_write_path = parser.get<string>("output");
+  baseline_read_path = parser.get<string>("baseline");
+  timeTolerance = parser.get<double>("tolerance");
+  accuracyTolerance = parser.get<double>("accuracy");
+
+  vector<string> videos = splitList(video_files);
+  if(videos.empty())
+  {
+    cout << "No video to benchmark" << endl;
+    return -1;
+  }
+
+  Model model;
+  model.load(data_path + model_file);
+  if(model.get_points3d().empty())
+  {
+    cout << "Could not load the model " << data_path + model_file << endl;
+    return -1;
+  }
+
+  // Warm the caches and the allocator up, out of the stage timings
+  if(warmupFrames > 0)
+  {
+    setStageTimingEnabled(false);
+    VideoResult warmup;
+    runVideo(data_path + videos[0], model, warmupFrames, warmup);
+    setStageTimingEnabled(true);
+  }
+
+  vector<VideoResult> results;
+  for(size_t i = 0; i < videos.size(); ++i)
+  {
+    VideoResult result;
+    result.name = videos[i];
+    if(!runVideo(data_path + videos[i], model, maxFrames, result))
+    {
+      cout << "Could not open " << data_path + videos[i] << endl;
+      return -1;
+    }
+
+    cout << result.name << ": " << result.frames << " frames, " << result.fps << " fps, p50 "
+         << result.p50_ms << " ms, p99 " << result.p99_ms << " ms, " << result.mean_inliers
+         << " inliers, tracked " << 100.0 * result.tracked << " %" << endl;
+    if(result.truth_frames > 0)
+    {
+      cout << "  pose error over " << result.truth_frames << " frames: translation " << result.translation_error
+           << ", rotation " << result.rotation_error << " deg" << endl;
+    }
+    results.push_back(result);
+  }
+
+  printStageTimings(cout);
+
+  vector<StageResult> stages;
+  stageResults(stages);
+
+  if(!results_write_path.empty())
+  {
+    if(!writeResults(results_write_path, results, stages))
+    {
+      cout << "Could not write " << results_write_path << endl;
+      return -1;
+    }
+    cout << "Results written to " << results_write_path << endl;
+  }
+
+  if(!baseline_read_path.empty())
+  {
+    vector<VideoResult> baseline_videos;
+    vector<StageResult> baseline_stages;
+    if(!readResults(baseline_read_path, baseline_videos, baseline_stages) || baseline_videos.empty())
+    {
+      cout << "Could not read the baseline " << baseline_read_path << endl;
+      return -1;
+    }
+
+    cout << "Comparison with " << baseline_read_path << " (value, baseline, change):" << endl;
+    if(!compareResults(results, stages, baseline_videos, baseline_stages))
+    {
+      cout << "REGRESSION against the baseline" << endl;
+      return 1;
+    }
+    cout << "No regression against the baseline" << endl;
+  }
+
+  return 0;
+}
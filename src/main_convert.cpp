@@ -0,0 +1,60 @@
+// C++
+#include <iostream>
+// OpenCV
+#include <opencv2/core/core.hpp>
+// PnP Tutorial
+#include "Model.h"
+
+using namespace cv;
+using namespace std;
+
+void help()
+{
+  cout
+  << "--------------------------------------------------------------------------"   << endl
+  << "This program converts a 3D textured model between the YAML format and the "
+  << "binary format. The format is chosen by the file extension (*.bin is binary)." << endl
+  << "Usage:"                                                                       << endl
+  << "./pnp_model_convert <input> <output>"                                         << endl
+  << "--------------------------------------------------------------------------"   << endl
+  << endl;
+}
+
+/**  Main program  **/
+int main(int argc, char *argv[])
+{
+
+  help();
+
+  const String keys =
+      "{help h        |      | print this message                   }"
+      "{@input        |      | model to read (*.yml or *.bin)       }"
+      "{@output       |      | model to write (*.yml or *.bin)      }"
+      ;
+  CommandLineParser parser(argc, argv, keys);
+
+  string input_path = parser.get<string>("@input");
+  string output_path = parser.get<string>("@output");
+
+  if (parser.has("help") || input_path.empty() || output_path.empty())
+  {
+    parser.printMessage();
+    return 0;
+  }
+
+  Model model;               // instantiate Model object
+  model.load(input_path);    // load a 3D textured object model
+
+  if (model.get_numDescriptors() == 0)
+  {
+    cout << "Could not load a model from " << input_path << endl;
+    return -1;
+  }
+
+  model.save(output_path);   // write it in the output format
+
+  cout << "Converted " << model.get_numDescriptors() << " points from "
+       << input_path << " to " << output_path << endl;
+
+  return 0;
+}
@@ -1,6 +1,13 @@
 // C++
+#include <cstdlib>
 #include <iostream>
-#include <time.h>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 // OpenCV
 #include <opencv2/core/core.hpp>
 //#include <opencv2/core/utility.hpp>
@@ -12,10 +19,16 @@
 #include "Mesh.h"
 #include "Model.h"
 #include "PnPProblem.h"
-#include "RobustMatcher.h"
-#include "ModelRegistration.h"
+#include "PoseEstimator.h"
 #include "Utils.h"
-#include "kalman_filter_tracker.h"
+#include "SpscQueue.h"
+#include "PerfStats.h"
+#include "ModelIndex.h"
+#include "PoseWriter.h"
+#include "LatencyController.h"
+#include "AllocationCounter.h"
+#include "StageTimer.h"
+#include "Trace.h"
 
 /**  GLOBAL VARIABLES  **/
 
@@ -28,16 +41,6 @@ string video_read_path = tutorial_path + "Data/box.mp4";       // recorded video
 string yml_read_path = tutorial_path + "Data/cookies_ORB.yml"; // 3dpts + descriptors
 string ply_read_path = tutorial_path + "Data/box.ply";         // mesh
 
-// Intrinsic camera parameters: UVC WEBCAM
-double f = 55;                           // focal length in mm
-double sx = 22.3, sy = 14.9;             // sensor size
-double width = 640, height = 480;        // image size
-
-double params_WEBCAM[] = { width*f/sx,   // fx
-                           height*f/sy,  // fy
-                           width/2,      // cx
-                           height/2};    // cy
-
 // Some basic colors
 Scalar red(0, 0, 255);
 Scalar green(0,255,0);
@@ -45,21 +48,30 @@ Scalar blue(255,0,0);
 Scalar yellow(0,255,255);
 
 
-// Robust Matcher parameters
-int numKeyPoints = 2000;      // number of detected keypoints
-float ratioTest = 0.70f;      // ratio test
-bool fast_match = true;       // fastRobustMatch() or robustMatch()
+// Pose estimation parameters: intrinsics (UVC WEBCAM), matching, RANSAC and Kalman Filter
+PoseEstimatorConfig config;
+
+// Latency controller parameters
+double targetLatency = 0;       // target per-frame latency in ms, 0 disables the controller
 
-// RANSAC parameters
-int iterationsCount = 500;      // number of Ransac iterations.
-float reprojectionError = 2.0;  // maximum allowed distance to consider it an inlier.
-double confidence = 0.95;       // ransac successful confidence.
+// Pipeline parameters
+bool pipeline = false;        // run the stages on their own threads
+int queueSize = 2;            // frames buffered between two stages
+bool headless = false;        // no GUI, print a latency summary at the end
+bool live = false;            // always process the newest frame, drop the stale ones
+double statsInterval = 0;     // seconds between two stage timing logs, 0 disables them
+string trace_write_path = ""; // Chrome trace-event JSON of the spans, needs PNP_ENABLE_TRACING
+bool cameraSource = false;    // the video is a camera device, its frames are timed by the capture clock
 
-// Kalman Filter parameters
-int minInliersKalman = 30;    // Kalman threshold updating
+// Batch parameters
+string batch_read_path = "";  // list of videos, one per line
+string output_dir = ".";      // where the pose tracks are written
+string output_format = "csv"; // csv or bin
+int numWorkers = 0;           // 0: one per hardware thread
+bool frameParallel = false;   // measure many frames at once, then filter them in order
 
-// PnP parameters
-int pnpMethod = SOLVEPNP_ITERATIVE;
+// Multi-stream parameters
+string streams_read_path = "";  // list of cameras, one per line with optional intrinsics
 
 
 void help()
@@ -77,249 +89,1196 @@ void help()
 }
 
 
-/**  Main program  **/
-int main(int argc, char *argv[])
+/**  FRAME PROCESSING  **/
+
+// The data of a frame handed from one processing stage to the next
+struct FrameData
 {
+  FrameData() : index(-1), capture_time(0), timestamp(0), detect_ms(0), measure_ms(0) {}
 
-  help();
+  int index;                                  // frame number, -1 marks the end of the stream
+  double capture_time;                        // PerfStats::now() before the frame was read
+  double timestamp;                           // frame time in seconds for the Kalman Filter
+  Mat frame;                                  // captured frame
+  vector<KeyPoint> keypoints_scene;           // 2D points of the scene
+  Mat descriptors_scene;                      // descriptors of the 2D points of the scene
+  PoseResult result;                          // matches and poses
+  double detect_ms, measure_ms;               // stage times when they ran on a worker
+};
 
-  const String keys =
-      "{help h        |      | print this message                   }"
-      "{video v       |      | path to recorded video               }"
-      "{model         |      | path to yml model                    }"
-      "{mesh          |      | path to ply mesh                     }"
-      "{keypoints k   |2000  | number of keypoints to detect        }"
-      "{ratio r       |0.7   | threshold for ratio test             }"
-      "{iterations it |500   | RANSAC maximum iterations count      }"
-      "{error e       |2.0   | RANSAC reprojection errror           }"
-      "{confidence c  |0.95  | RANSAC confidence                    }"
-      "{inliers in    |30    | minimum inliers for Kalman update    }"
-      "{method  pnp   |0     | PnP method: (0) ITERATIVE - (1) EPNP - (2) P3P - (3) DLS}"
-      "{fast f        |true  | use of robust fast match             }"
-      ;
-  CommandLineParser parser(argc, argv, keys);
 
-  if (parser.has("help"))
+// A source given as a number is a camera device, anything else a video
+bool isCameraDevice(const string &source)
+{
+  return !source.empty() && source.find_first_not_of("0123456789") == string::npos;
+}
+
+// Open the capture of a source
+bool openCapture(VideoCapture &cap, const string &source)
+{
+  if(isCameraDevice(source))
   {
-      parser.printMessage();
-      return 0;
+    return cap.open(atoi(source.c_str()));   // open a camera device
   }
-  else
+  return cap.open(source);   // open a recorded video
+}
+
+// The time of a frame in seconds: the position in a recorded video, so that the
+// time steps follow its frame rate and dropped frames whatever the processing
+// speed, the capture clock for a camera device
+double frameTimestamp(VideoCapture &cap, bool camera, double capture_time)
+{
+  if(camera) return capture_time / 1000.0;
+  return cap.get(CAP_PROP_POS_MSEC) / 1000.0;
+}
+
+
+// -- Step X: Draw the pose and some debugging text
+void renderFrame(const FrameData &data, const Mesh &mesh, PnPProblem &pnp_render, double fps, Mat &frame_vis)
+{
+  StageTimer timer(STAGE_DRAW);
+  const PoseResult &result = data.result;
+
+  data.frame.copyTo(frame_vis);      // refresh visualisation frame, its buffer is reused
+
+  // Draw outliers
+  draw2DPoints(frame_vis, const_cast<vector<Point2f>&>(result.points2d_matched), red);
+
+  // Draw inliers points 2D
+  draw2DPoints(frame_vis, const_cast<vector<Point2f>&>(result.points2d_inliers), blue);
+
+  // Draw pose
+  if(result.good_measurement)
   {
-    video_read_path = parser.get<string>("video").size() > 0 ? parser.get<string>("video") : video_read_path;
-    yml_read_path = parser.get<string>("model").size() > 0 ? parser.get<string>("model") : yml_read_path;
-    ply_read_path = parser.get<string>("mesh").size() > 0 ? parser.get<string>("mesh") : ply_read_path;
-    numKeyPoints = !parser.has("keypoints") ? parser.get<int>("keypoints") : numKeyPoints;
-    ratioTest = !parser.has("ratio") ? parser.get<float>("ratio") : ratioTest;
-    fast_match = !parser.has("fast") ? parser.get<bool>("fast") : fast_match;
-    iterationsCount = !parser.has("iterations") ? parser.get<int>("iterations") : iterationsCount;
-    reprojectionError = !parser.has("error") ? parser.get<float>("error") : reprojectionError;
-    confidence = !parser.has("confidence") ? parser.get<float>("confidence") : confidence;
-    minInliersKalman = !parser.has("inliers") ? parser.get<int>("inliers") : minInliersKalman;
-    pnpMethod = !parser.has("method") ? parser.get<int>("method") : pnpMethod;
+    pnp_render.set_P_matrix(result.R_measured, result.t_measured);
+    drawObjectMesh(frame_vis, &mesh, &pnp_render, green);  // draw current pose
+  }
+  else if(result.has_estimate && !result.lost)
+  {
+    pnp_render.set_P_matrix(result.R_estimated, result.t_estimated);
+    drawObjectMesh(frame_vis, &mesh, &pnp_render, yellow); // draw estimated pose
   }
 
-  PnPProblem pnp_detection(params_WEBCAM);
-  PnPProblem pnp_detection_est(params_WEBCAM);
+  if(result.has_estimate && !result.lost)
+  {
+    pnp_render.set_P_matrix(result.R_estimated, result.t_estimated);
 
-  Model model;               // instantiate Model object
-  model.load(yml_read_path); // load a 3D textured object model
+    float l = 5;
+    vector<Point2f> pose_points2d;
+    pose_points2d.push_back(pnp_render.backproject3DPoint(Point3f(0,0,0)));  // axis center
+    pose_points2d.push_back(pnp_render.backproject3DPoint(Point3f(l,0,0)));  // axis x
+    pose_points2d.push_back(pnp_render.backproject3DPoint(Point3f(0,l,0)));  // axis y
+    pose_points2d.push_back(pnp_render.backproject3DPoint(Point3f(0,0,l)));  // axis z
+    draw3DCoordinateAxes(frame_vis, pose_points2d);           // draw axes
+  }
 
-  Mesh mesh;                 // instantiate Mesh object
-  mesh.load(ply_read_path);  // load an object mesh
+  drawFPS(frame_vis, fps, yellow); // frame ratio
+  double detection_ratio = ((double)result.n_inliers/(double)result.n_matches)*100;
+  drawConfidence(frame_vis, detection_ratio, yellow);
+
+  // Draw some debug text
+  int inliers_int = result.n_inliers;
+  int outliers_int = result.n_matches - inliers_int;
+  string inliers_str = IntToString(inliers_int);
+  string outliers_str = IntToString(outliers_int);
+  string n = IntToString(result.n_matches);
+  string text = "Found " + inliers_str + " of " + n + " matches";
+  string text2 = "Inliers: " + inliers_str + " - Outliers: " + outliers_str;
+
+  drawText(frame_vis, text, green);
+  drawText2(frame_vis, text2, red);
+}
 
-  RobustMatcher rmatcher;    // instantiate RobustMatcher
 
-  Ptr<FeatureDetector> orb = ORB::create();
+/**  BENCHMARK  **/
 
-  rmatcher.setFeatureDetector(orb);        // set feature detector
-  rmatcher.setDescriptorExtractor(orb);    // set descriptor extractor
+// Per-frame latency of each stage and of the whole frame
+struct FrameTimings
+{
+  FrameTimings() : capture("capture"), detect("detect"), estimate("match+pose"), frame("frame"),
+                   features("features", "kpts"), iterations("iterations", "iter"),
+                   allocations("allocations", "allocs"), dropped(0), elapsed(0) {}
+
+  PerfStats capture;   // read / decode
+  PerfStats detect;    // keypoints + descriptors
+  PerfStats estimate;  // matching, RANSAC and Kalman Filter
+  PerfStats frame;     // from capture to pose
+  PerfStats features;    // feature budget chosen by the latency controller
+  PerfStats iterations;  // RANSAC iterations cap chosen by the latency controller
+  PerfStats allocations; // heap allocations from detection to pose, with PNP_COUNT_ALLOCATIONS
+  int dropped;         // frames captured but never processed
+  double elapsed;      // wall time of the whole run in ms
+};
+
+void printTimings(const FrameTimings &timings)
+{
+  cout << endl << "Latency per frame:" << endl;
+  timings.capture.print(cout);
+  timings.detect.print(cout);
+  timings.estimate.print(cout);
+  timings.frame.print(cout);
 
-  Ptr<flann::IndexParams> indexParams = makePtr<flann::LshIndexParams>(6, 12, 1); // instantiate LSH index parameters
-  Ptr<flann::SearchParams> searchParams = makePtr<flann::SearchParams>(50);       // instantiate flann search parameters
+  if(timings.features.count() > 0)
+  {
+    cout << "Latency controller settings (target " << targetLatency << " ms):" << endl;
+    timings.features.print(cout);
+    timings.iterations.print(cout);
+  }
 
-  // instantiate FlannBased matcher
-  Ptr<DescriptorMatcher> matcher = makePtr<FlannBasedMatcher>(indexParams, searchParams);
-  rmatcher.setDescriptorMatcher(matcher);                                                         // set matcher
-  rmatcher.setRatio(ratioTest); // set ratio test parameter
+  cout << "Latency per stage:" << endl;
+  printStageTimings(cout);
 
-  //KalmanFilter KF;         // instantiate Kalman Filter
-  int nStates = 18;          // the number of states
-  int nMeasurements = 6;     // the number of measured states
-  int nInputs = 0;           // the number of control actions
-  double dt = 0.125;         // time between measurements (1/FPS)
+  if(timings.allocations.count() > 0)
+  {
+    cout << "Heap allocations per frame:" << endl;
+    timings.allocations.print(cout);
+  }
 
-  KalmanFilterTracker KF(nStates, nMeasurements, nInputs, dt, minInliersKalman);
+  double throughput = timings.elapsed > 0 ? timings.frame.count() * 1000.0 / timings.elapsed : 0;
+  cout << "Processed " << timings.frame.count() << " frames in " << timings.elapsed / 1000.0
+       << " s (" << throughput << " FPS)" << endl;
 
-  Mat measurements(nMeasurements, 1, CV_64F); measurements.setTo(Scalar(0));
-  bool good_measurement = false;
+  if(live)
+  {
+    cout << "Dropped " << timings.dropped << " stale frames" << endl;
+  }
+}
 
+// Print the stage timings every statsInterval seconds, from the loop of the main thread
+void logStageTimings(double &last_log)
+{
+  if(statsInterval <= 0) return;
 
-  // Get the MODEL INFO
-  vector<Point3f> list_points3d_model = model.get_points3d();  // list with model 3D coordinates
-  Mat descriptors_model = model.get_descriptors();             // list with descriptors of each 3D coordinate
+  double now = PerfStats::now();
+  if(last_log <= 0) last_log = now;
+  if(now - last_log < statsInterval * 1000) return;
 
+  last_log = now;
+  cout << "Latency per stage:" << endl;
+  printStageTimings(cout);
+}
 
-  // Create & Open Window
-  namedWindow("REAL TIME DEMO", WINDOW_KEEPRATIO);
+// Writes the recorded spans, once the processing threads are joined
+void writeTrace()
+{
+  if(trace_write_path.empty()) return;
 
+  if(traceWrite(trace_write_path)) cout << "Trace written to " << trace_write_path << endl;
+  else cout << "Could not write the trace to " << trace_write_path << endl;
+}
 
-  VideoCapture cap;            // instantiate VideoCapture
-  cap.open(video_read_path);   // open a recorded video
 
-  if(!cap.isOpened())   // check if we succeeded
+/**  LATENCY CONTROL  **/
+
+// The latency controller of an estimator, NULL if no target latency is set
+Ptr<LatencyController> createLatencyController(const PoseEstimator &estimator)
+{
+  if(targetLatency <= 0) return Ptr<LatencyController>();
+
+  const PoseEstimatorConfig &settings = estimator.config();
+  return makePtr<LatencyController>(estimator.detector(), targetLatency, settings.min_inliers_kalman,
+                                    settings.confidence,
+                                    max(100, settings.num_keypoints / 8), 2 * settings.num_keypoints,
+                                    min(50, settings.ransac_iterations), 2 * settings.ransac_iterations,
+                                    settings.ransac_iterations);
+}
+
+// Record the settings used for the frame and choose the ones of the next frame
+void updateLatencyController(LatencyController *controller, PoseEstimator &estimator, const PoseResult &result,
+                             int n_keypoints, double detect_ms, double estimate_ms, FrameTimings &timings)
+{
+  if(!controller) return;
+
+  timings.features.add(controller->features());
+  timings.iterations.add(estimator.ransacIterations());
+
+  controller->update(detect_ms, estimate_ms, result.ransac_ms, n_keypoints, result.n_matches, result.n_inliers);
+  estimator.setRansacIterations(controller->iterations());
+}
+
+
+/**  PIPELINED PROCESSING  **/
+
+// Runs capture, feature detection, matching + pose and rendering on their own threads,
+// connected by bounded queues. Rendering stays on the main thread for the GUI.
+// Each stage only records its own timings.
+void runPipeline(VideoCapture &cap, PoseEstimator &estimator, const Mesh &mesh, FrameTimings &timings)
+{
+  SpscQueue<FrameData> captured(queueSize), detected(queueSize), estimated(queueSize);
+  atomic<bool> stop(false);
+  double start = PerfStats::now();
+
+  // Capture / decode stage
+  thread capture_thread([&]()
   {
-    cout << "Could not open the camera device" << endl;
-    return -1;
+    int index = 0;
+    FrameData data;
+    data.capture_time = PerfStats::now();
+    while(!stop.load() && cap.read(data.frame))
+    {
+      timings.capture.add(PerfStats::now() - data.capture_time);
+      data.index = index++;
+      data.timestamp = frameTimestamp(cap, cameraSource, data.capture_time);
+      captured.push(data);
+      data = FrameData();
+      data.capture_time = PerfStats::now();
+    }
+
+    FrameData end_of_stream;
+    captured.push(end_of_stream);
+  });
+
+  // Feature detect + describe stage
+  thread detection_thread([&]()
+  {
+    FrameData data;
+    do
+    {
+      captured.pop(data);
+      if(data.index >= 0)
+      {
+        TRACE_SCOPE("frame");
+        TRACE_ARG("frame", data.index);
+        double t = PerfStats::now();
+        estimator.detect(data.frame, data.keypoints_scene, data.descriptors_scene);
+        timings.detect.add(PerfStats::now() - t);
+      }
+      detected.push(data);
+    } while(data.index >= 0);
+  });
+
+  // Match + pose stage
+  thread estimation_thread([&]()
+  {
+    FrameData data;
+    do
+    {
+      detected.pop(data);
+      if(data.index >= 0)
+      {
+        TRACE_SCOPE("frame");
+        TRACE_ARG("frame", data.index);
+        double t = PerfStats::now();
+        estimator.measure(data.keypoints_scene, data.descriptors_scene, data.result);
+        estimator.track(data.result, data.timestamp);
+        timings.estimate.add(PerfStats::now() - t);
+      }
+      estimated.push(data);
+    } while(data.index >= 0);
+  });
+
+  // Render / output stage
+  PnPProblem pnp_render(config.camera_params);
+  double last_log = 0;
+
+  FrameData data;
+  Mat frame_vis;
+  for(;;)
+  {
+    estimated.pop(data);
+    if(data.index < 0) break;   // the stages are drained in frame order
+
+    double now = PerfStats::now();
+    timings.frame.add(now - data.capture_time);
+    logStageTimings(last_log);
+
+    if(!headless)
+    {
+      double fps = timings.frame.count() * 1000.0 / (now - start);
+
+      renderFrame(data, mesh, pnp_render, fps, frame_vis);
+      imshow("REAL TIME DEMO", frame_vis);
+
+      if(waitKey(1) == 27) stop.store(true);   // ESC stops the capture, the queued frames are still shown
+    }
+  }
+
+  capture_thread.join();
+  detection_thread.join();
+  estimation_thread.join();
+
+  timings.elapsed = PerfStats::now() - start;
+}
+
+
+/**  SEQUENTIAL PROCESSING  **/
+
+// Runs all the stages one after the other on the calling thread. The GUI throttles
+// the loop to the 30 ms waitKey, the headless mode runs as fast as possible.
+// If a writer is given, the estimated pose of every frame is written to it, if a
+// controller is given it chooses the feature budget and RANSAC iterations of each frame.
+void runSequential(VideoCapture &cap, PoseEstimator &estimator, const Mesh &mesh, FrameTimings &timings,
+                   PoseWriter *writer = NULL, LatencyController *controller = NULL)
+{
+  PnPProblem pnp_render(config.camera_params);
+  double start = PerfStats::now();
+  double last_log = 0;
+
+  FrameData data;   // reused, the buffers keep their memory from one frame to the next
+  Mat frame_vis;
+
+  for(int counter = 0; ; ++counter)
+  {
+    TRACE_SCOPE("frame");
+    TRACE_ARG("frame", counter);
+    double t0 = PerfStats::now();
+    if(!cap.read(data.frame)) break;
+    double t1 = PerfStats::now();
+
+    data.index = counter;
+    data.capture_time = t0;
+    data.timestamp = frameTimestamp(cap, cameraSource, t0);
+    long long allocations = allocationCount();
+
+    estimator.detect(data.frame, data.keypoints_scene, data.descriptors_scene);
+    double t2 = PerfStats::now();
+
+    estimator.measure(data.keypoints_scene, data.descriptors_scene, data.result);
+    estimator.track(data.result, data.timestamp);
+    double t3 = PerfStats::now();
+
+    timings.capture.add(t1 - t0);
+    timings.detect.add(t2 - t1);
+    timings.estimate.add(t3 - t2);
+    timings.frame.add(t3 - t0);
+    logStageTimings(last_log);
+    if(allocationCountEnabled()) timings.allocations.add(allocationCount() - allocations);
+
+    updateLatencyController(controller, estimator, data.result, (int)data.keypoints_scene.size(),
+                            t2 - t1, t3 - t2, timings);
+
+    if(writer)
+    {
+      const PoseResult &result = data.result;
+      writer->write(data.index, result.R_estimated, result.t_estimated, result.n_inliers, result.good_measurement,
+                    t3 - t0);
+    }
+
+    if(!headless)
+    {
+      // FRAME RATE
+      double fps = (counter + 1) * 1000.0 / (t3 - start);
+
+      renderFrame(data, mesh, pnp_render, fps, frame_vis);
+      imshow("REAL TIME DEMO", frame_vis);
+
+      if(waitKey(30) == 27) break; // capture frame until ESC is pressed
+    }
+  }
+
+  timings.elapsed = PerfStats::now() - start;
+}
+
+
+/**  LIVE PROCESSING  **/
+
+// Holds only the newest captured frame, a frame replaced before it was taken is dropped
+struct LatestFrameSlot
+{
+  LatestFrameSlot() : fresh(false), closed(false), dropped(0) {}
+
+  // Capture side: replace the held frame, the previous one is given back in data
+  void put(FrameData &data)
+  {
+    lock_guard<mutex> lock(m);
+    if(fresh) ++dropped;
+    swap(data, latest);
+    fresh = true;
+    ready.notify_one();
   }
 
-  // start and end times
-  time_t start, end;
+  // Processing side: wait for a frame newer than the last one taken, false once closed
+  bool take(FrameData &data)
+  {
+    unique_lock<mutex> lock(m);
+    while(!fresh && !closed) ready.wait(lock);
+    if(!fresh) return false;
+    swap(data, latest);
+    fresh = false;
+    return true;
+  }
 
-  // fps calculated using number of frames / seconds
-  // floating point seconds elapsed since start
-  double fps, sec;
+  void close()
+  {
+    lock_guard<mutex> lock(m);
+    closed = true;
+    ready.notify_one();
+  }
 
-  // frame counter
-  int counter = 0;
+  mutex m;
+  condition_variable ready;
+  FrameData latest;
+  bool fresh;     // latest has not been taken yet
+  bool closed;    // the capture stopped
+  int dropped;    // frames replaced before they were taken
+};
+
+// A capture thread keeps reading so the camera buffer never fills up, the processing
+// always picks the newest frame. The Kalman Filter time step covers the skipped frames,
+// and the drawn pose is extrapolated to the moment it is shown.
+// The frame latency is measured from the moment the frame was read to its pose.
+void runLive(VideoCapture &cap, PoseEstimator &estimator, const Mesh &mesh, FrameTimings &timings,
+             LatencyController *controller = NULL)
+{
+  LatestFrameSlot slot;
+  atomic<bool> stop(false);
 
-  // start the clock
-  time(&start);
+  thread capture_thread([&]()
+  {
+    int index = 0;
+    FrameData data;
+    for(;;)
+    {
+      double t0 = PerfStats::now();
+      if(stop.load() || !cap.read(data.frame)) break;
+      data.capture_time = PerfStats::now();
+      timings.capture.add(data.capture_time - t0);
+      data.index = index++;
+      data.timestamp = frameTimestamp(cap, cameraSource, data.capture_time);
+      slot.put(data);   // gives back the last processed or dropped frame, its buffers are reused
+    }
+    slot.close();
+  });
 
-  Mat frame, frame_vis;
+  PnPProblem pnp_render(config.camera_params);
+  double start = PerfStats::now();
+  double last_log = 0;
 
-  while(cap.read(frame) && waitKey(30) != 27) // capture frame until ESC is pressed
+  FrameData data;
+  Mat frame_vis;
+  while(slot.take(data))
   {
+    TRACE_SCOPE("frame");
+    TRACE_ARG("frame", data.index);
+    long long allocations = allocationCount();
+    double t1 = PerfStats::now();
+    estimator.detect(data.frame, data.keypoints_scene, data.descriptors_scene);
+    double t2 = PerfStats::now();
+
+    estimator.measure(data.keypoints_scene, data.descriptors_scene, data.result);
+    estimator.track(data.result, data.timestamp);
+    double t3 = PerfStats::now();
+    if(allocationCountEnabled()) timings.allocations.add(allocationCount() - allocations);
+
+    timings.detect.add(t2 - t1);
+    timings.estimate.add(t3 - t2);
+    timings.frame.add(t3 - data.capture_time);   // glass to pose
+    logStageTimings(last_log);
+
+    updateLatencyController(controller, estimator, data.result, (int)data.keypoints_scene.size(),
+                            t2 - t1, t3 - t2, timings);
+
+    if(!headless)
+    {
+      double fps = timings.frame.count() * 1000.0 / (t3 - start);
 
-    frame_vis = frame.clone();    // refresh visualisation frame
+      // Latency compensation: the pose at the time the frame is drawn
+      if(cameraSource)
+      {
+        estimator.predictAt(PerfStats::now() / 1000.0, data.result.R_estimated, data.result.t_estimated);
+      }
 
+      renderFrame(data, mesh, pnp_render, fps, frame_vis);
+      imshow("REAL TIME DEMO", frame_vis);
 
-    // -- Step 1: Robust matching between model descriptors and scene descriptors
+      if(waitKey(1) == 27) stop.store(true);   // ESC
+    }
+  }
+
+  capture_thread.join();
+
+  timings.dropped = slot.dropped;
+  timings.elapsed = PerfStats::now() - start;
+}
 
-    vector<DMatch> good_matches;       // to obtain the 3D points of the model
-    vector<KeyPoint> keypoints_scene;  // to obtain the 2D points of the scene
 
+/**  FRAME PARALLEL PROCESSING  **/
 
-    if(fast_match)
+// One estimator per worker, sharing the model and its index
+void createFrameWorkers(const Model &model, const Ptr<ModelIndex> &model_index,
+                        vector<Ptr<PoseEstimator> > &workers)
+{
+  int n = numWorkers > 0 ? numWorkers : max(1, (int)thread::hardware_concurrency());
+  for(int w = 0; w < n; ++w)
+  {
+    workers.push_back(makePtr<PoseEstimator>(model, model_index, config));
+  }
+}
+
+// The threads of the frame parallel mode, started once. Each chunk is handed to all
+// of them, they take its frames one by one and the caller waits for the last one.
+struct ChunkPool
+{
+  ChunkPool(vector<Ptr<PoseEstimator> > &workers, vector<FrameData> &chunk)
+    : chunk(chunk), n_frames(0), next_frame(0), generation(0), busy(0), quit(false)
+  {
+    for(size_t w = 0; w < workers.size(); ++w)
+    {
+      PoseEstimator *worker = workers[w].get();
+      threads.push_back(thread([this, worker]() { work(worker); }));
+    }
+  }
+
+  ~ChunkPool()
+  {
+    {
+      lock_guard<mutex> lock(m);
+      quit = true;
+    }
+    chunk_ready.notify_all();
+    for(size_t w = 0; w < threads.size(); ++w) threads[w].join();
+  }
+
+  // Detect and measure the first n frames of the chunk on all the workers
+  void run(int n)
+  {
     {
-      rmatcher.fastRobustMatch(frame, good_matches, keypoints_scene, descriptors_model);
+      lock_guard<mutex> lock(m);
+      n_frames = n;
+      next_frame.store(0);
+      busy = (int)threads.size();
+      ++generation;
     }
-    else
+    chunk_ready.notify_all();
+
+    unique_lock<mutex> lock(m);
+    chunk_done.wait(lock, [this]() { return busy == 0; });
+  }
+
+  void work(PoseEstimator *worker)
+  {
+    int seen = 0;
+    for(;;)
     {
-      rmatcher.robustMatch(frame, good_matches, keypoints_scene, descriptors_model);
+      int n;
+      {
+        unique_lock<mutex> lock(m);
+        chunk_ready.wait(lock, [&]() { return quit || generation != seen; });
+        if(quit) return;
+        seen = generation;
+        n = n_frames;
+      }
+
+      for(int i = next_frame++; i < n; i = next_frame++)
+      {
+        FrameData &data = chunk[i];
+        TRACE_SCOPE("frame");
+        TRACE_ARG("frame", data.index);
+
+        double t0 = PerfStats::now();
+        worker->detect(data.frame, data.keypoints_scene, data.descriptors_scene);
+        double t1 = PerfStats::now();
+        worker->measure(data.keypoints_scene, data.descriptors_scene, data.result);
+        double t2 = PerfStats::now();
+
+        data.detect_ms = t1 - t0;
+        data.measure_ms = t2 - t1;
+      }
+
+      lock_guard<mutex> lock(m);
+      if(--busy == 0) chunk_done.notify_one();
     }
+  }
 
+  vector<FrameData> &chunk;
+  vector<thread> threads;
+  mutex m;
+  condition_variable chunk_ready, chunk_done;
+  int n_frames;               // frames of the current chunk
+  atomic<int> next_frame;     // next frame of the chunk to take
+  int generation;             // chunks handed out so far
+  int busy;                   // workers not done with the current chunk
+  bool quit;
+};
+
+// Offline processing of a recorded video: the frames are read in chunks, the
+// detection, matching and RANSAC of a chunk run on all the workers at once, and
+// the measurements are then passed through the Kalman Filter in frame order.
+// The workers never track, so the poses are the same as the sequential loop
+// without visibility and gating, which need the pose tracked up to the previous frame.
+void runFrameParallel(VideoCapture &cap, vector<Ptr<PoseEstimator> > &workers, PoseEstimator &tracker,
+                      FrameTimings &timings, PoseWriter *writer = NULL)
+{
+  const int chunk_size = 4 * (int)workers.size();   // frames in flight, bounds the memory
+  vector<FrameData> chunk(chunk_size);
+  ChunkPool pool(workers, chunk);
+
+  double start = PerfStats::now();
+  double last_log = 0;
+  int index = 0;
+  bool end_of_stream = false;
 
-    // -- Step 2: Find out the 2D/3D correspondences
+  while(!end_of_stream)
+  {
+    // Read a chunk of frames
+    int n = 0;
+    while(n < chunk_size)
+    {
+      FrameData &data = chunk[n];
+      data.capture_time = PerfStats::now();
+      if(!cap.read(data.frame))
+      {
+        end_of_stream = true;
+        break;
+      }
+      timings.capture.add(PerfStats::now() - data.capture_time);
+      data.index = index++;
+      data.timestamp = frameTimestamp(cap, cameraSource, data.capture_time);
+      ++n;
+    }
 
-    vector<Point3f> list_points3d_model_match; // container for the model 3D coordinates found in the scene
-    vector<Point2f> list_points2d_scene_match; // container for the model 2D coordinates found in the scene
+    // Detect and measure the frames of the chunk on all the workers
+    if(n > 0) pool.run(n);
 
-    for(unsigned int match_index = 0; match_index < good_matches.size(); ++match_index)
+    // Replay the measurements through the Kalman Filter in frame order
+    for(int i = 0; i < n; ++i)
     {
-      Point3f point3d_model = list_points3d_model[ good_matches[match_index].trainIdx ];  // 3D point from model
-      Point2f point2d_scene = keypoints_scene[ good_matches[match_index].queryIdx ].pt; // 2D point from the scene
-      list_points3d_model_match.push_back(point3d_model);         // add 3D point
-      list_points2d_scene_match.push_back(point2d_scene);         // add 2D point
+      FrameData &data = chunk[i];
+      TRACE_SCOPE("track");
+      TRACE_ARG("frame", data.index);
+
+      double t0 = PerfStats::now();
+      tracker.track(data.result, data.timestamp);
+      double track_ms = PerfStats::now() - t0;
+
+      timings.detect.add(data.detect_ms);
+      timings.estimate.add(data.measure_ms + track_ms);
+      timings.frame.add(data.detect_ms + data.measure_ms + track_ms);
+      logStageTimings(last_log);
+
+      if(writer)
+      {
+        const PoseResult &result = data.result;
+        writer->write(data.index, result.R_estimated, result.t_estimated, result.n_inliers,
+                      result.good_measurement, data.detect_ms + data.measure_ms + track_ms);
+      }
     }
+  }
+
+  timings.elapsed = PerfStats::now() - start;
+}
 
-    // Draw outliers
-    draw2DPoints(frame_vis, list_points2d_scene_match, red);
 
+/**  BATCH PROCESSING  **/
 
-    Mat inliers_idx;
-    vector<Point2f> list_points2d_inliers;
+// Read the video paths of a batch list, one per line, skipping blank lines and # comments
+bool readVideoList(const string &path, vector<string> &videos)
+{
+  ifstream file(path.c_str());
+  if(!file.is_open()) return false;
 
-    if(good_matches.size() > 0) // None matches, then RANSAC crashes
+  string line;
+  while(getline(file, line))
+  {
+    size_t first = line.find_first_not_of(" \t\r");
+    if(first == string::npos || line[first] == '#') continue;
+    size_t last = line.find_last_not_of(" \t\r");
+    videos.push_back(line.substr(first, last - first + 1));
+  }
+  return true;
+}
+
+// The output file of a video: the video file name with the format extension
+string poseTrackPath(const string &video_path, const string &dir, PoseWriter::Format format)
+{
+  size_t slash = video_path.find_last_of("/\\");
+  string name = slash == string::npos ? video_path : video_path.substr(slash + 1);
+  size_t dot = name.find_last_of('.');
+  if(dot != string::npos && dot > 0) name = name.substr(0, dot);
+
+  return dir + "/" + name + (format == PoseWriter::BINARY ? ".bin" : ".csv");
+}
+
+// Runs one independent headless pipeline per video on a pool of worker threads.
+// The model and its index are shared read-only, each video gets its own estimator.
+void runBatch(const vector<string> &videos, const Model &model, const Ptr<ModelIndex> &model_index,
+              const Mesh &mesh, PoseWriter::Format format)
+{
+  if(frameParallel)
+  {
+    // One video after the other, each one spread over all the workers
+    vector<Ptr<PoseEstimator> > workers;
+    createFrameWorkers(model, model_index, workers);
+    cout << "Processing " << videos.size() << " videos, " << workers.size() << " frames at once" << endl;
+
+    double start = PerfStats::now();
+    for(size_t v = 0; v < videos.size(); ++v)
     {
+      string output_path = poseTrackPath(videos[v], output_dir, format);
+
+      VideoCapture cap(videos[v]);
+      PoseWriter writer;
+      if(!cap.isOpened() || !writer.open(output_path, format))
+      {
+        cerr << "Skipping " << videos[v] << ": could not open "
+             << (cap.isOpened() ? output_path : videos[v]) << endl;
+        continue;
+      }
+
+      PoseEstimator tracker(model, model_index, config);
+      FrameTimings timings;
+      runFrameParallel(cap, workers, tracker, timings, &writer);
+
+      cout << videos[v] << " -> " << output_path << ": " << timings.frame.count() << " frames, "
+           << timings.frame.count() * 1000.0 / timings.elapsed << " FPS" << endl;
+    }
+
+    cout << "Batch done in " << (PerfStats::now() - start) / 1000.0 << " s" << endl;
+    return;
+  }
+
+  int workers = numWorkers > 0 ? numWorkers : (int)thread::hardware_concurrency();
+  workers = max(1, min(workers, (int)videos.size()));
+
+  cout << "Processing " << videos.size() << " videos with " << workers << " workers" << endl;
 
-      // -- Step 3: Estimate the pose using RANSAC approach
-      pnp_detection.estimatePoseRANSAC( list_points3d_model_match, list_points2d_scene_match,
-                                        pnpMethod, inliers_idx,
-                                        iterationsCount, reprojectionError, confidence );
+  atomic<int> next_video(0);
+  mutex log_mutex;
+  double start = PerfStats::now();
 
-      // -- Step 4: Catch the inliers keypoints to draw
-      for(int inliers_index = 0; inliers_index < inliers_idx.rows; ++inliers_index)
+  vector<thread> pool;
+  for(int w = 0; w < workers; ++w)
+  {
+    pool.push_back(thread([&]()
+    {
+      for(int v = next_video++; v < (int)videos.size(); v = next_video++)
       {
-        int n = inliers_idx.at<int>(inliers_index);       // i-inlier
-        Point2f point2d = list_points2d_scene_match[n];   // i-inlier point 2D
-        list_points2d_inliers.push_back(point2d);         // add i-inlier to list
+        const string &video_path = videos[v];
+        string output_path = poseTrackPath(video_path, output_dir, format);
+
+        VideoCapture cap(video_path);
+        PoseWriter writer;
+        if(!cap.isOpened() || !writer.open(output_path, format))
+        {
+          lock_guard<mutex> lock(log_mutex);
+          cerr << "Skipping " << video_path << ": could not open "
+               << (cap.isOpened() ? output_path : video_path) << endl;
+          continue;
+        }
+
+        PoseEstimator estimator(model, model_index, config);
+        Ptr<LatencyController> controller = createLatencyController(estimator);
+        FrameTimings timings;
+        runSequential(cap, estimator, mesh, timings, &writer, controller.get());
+
+        lock_guard<mutex> lock(log_mutex);
+        cout << video_path << " -> " << output_path << ": " << timings.frame.count() << " frames, "
+             << timings.frame.mean() << " ms/frame" << endl;
       }
+    }));
+  }
+
+  for(size_t w = 0; w < pool.size(); ++w) pool[w].join();
+
+  cout << "Batch done in " << (PerfStats::now() - start) / 1000.0 << " s" << endl;
+}
+
+
+/**  MULTI-STREAM PROCESSING  **/
 
-      // Draw inliers points 2D
-      draw2DPoints(frame_vis, list_points2d_inliers, blue);
+// One camera of a multi-stream run: its source, intrinsics and tracking state
+struct CameraStream
+{
+  CameraStream() : camera(false), index(0) {}
+
+  string source;                    // video path or camera device number
+  bool camera;                      // the source is a camera device
+  PoseEstimatorConfig config;       // the global config with the intrinsics of this camera
+  VideoCapture cap;
+  Ptr<PoseEstimator> estimator;     // own PnP problems and Kalman Filter
+  PoseWriter writer;
+  FrameTimings timings;
+  FrameData data;                   // reused from one frame to the next
+  int index;                        // next frame number
+};
+
+// The streams waiting for a worker. A stream is in the queue or with one worker,
+// never both, so its frames are processed in order.
+struct StreamQueue
+{
+  explicit StreamQueue(int active) : remaining(active) {}
 
+  // Wait for a stream, false once all the streams ended
+  bool pop(int &stream)
+  {
+    unique_lock<mutex> lock(m);
+    ready.wait(lock, [this]() { return !queue.empty() || remaining == 0; });
+    if(queue.empty()) return false;
+    stream = queue.front();
+    queue.pop_front();
+    return true;
+  }
 
-      // -- Step 5: Kalman Filter
+  // Give a stream back after one of its frames
+  void push(int stream)
+  {
+    lock_guard<mutex> lock(m);
+    queue.push_back(stream);
+    ready.notify_one();
+  }
 
-      // Get the measured translation
-      Mat translation(3, 1, CV_64F);
-      translation = pnp_detection.get_t_matrix();
+  // A stream ended, it is not given back
+  void finish()
+  {
+    lock_guard<mutex> lock(m);
+    if(--remaining == 0) ready.notify_all();
+  }
 
-      // Get the measured rotation
-      Mat rotation(3, 3, CV_64F);
-      rotation = pnp_detection.get_R_matrix();
+  mutex m;
+  condition_variable ready;
+  deque<int> queue;
+  int remaining;   // streams not ended
+};
 
-      good_measurement = 
-        KF.predictPose(inliers_idx.rows, translation, rotation);
+// Read a stream list: one source per line, optionally followed by its fx fy cx cy.
+// Streams without intrinsics use the ones of the global config.
+bool readStreamList(const string &path, vector<Ptr<CameraStream> > &streams)
+{
+  vector<string> lines;
+  if(!readVideoList(path, lines)) return false;
 
+  for(size_t i = 0; i < lines.size(); ++i)
+  {
+    Ptr<CameraStream> stream = makePtr<CameraStream>();
+    stream->config = config;
 
-      // -- Step 6: Set estimated projection matrix
-        
-      pnp_detection_est.set_P_matrix(rotation, translation);
+    istringstream line(lines[i]);
+    line >> stream->source;
+    stream->camera = isCameraDevice(stream->source);
 
+    double params[4];
+    if(line >> params[0] >> params[1] >> params[2] >> params[3])
+    {
+      for(int p = 0; p < 4; ++p) stream->config.camera_params[p] = params[p];
     }
 
-    // -- Step X: Draw pose
+    streams.push_back(stream);
+  }
+  return true;
+}
+
+// Process one frame of a stream, false at the end of the stream
+bool processStreamFrame(CameraStream &stream)
+{
+  FrameData &data = stream.data;
+  TRACE_SCOPE("frame");
+  TRACE_ARG("frame", stream.index);
+
+  double t0 = PerfStats::now();
+  if(!stream.cap.read(data.frame)) return false;
+  double t1 = PerfStats::now();
+
+  data.index = stream.index++;
+  data.timestamp = frameTimestamp(stream.cap, stream.camera, t0);
+
+  stream.estimator->detect(data.frame, data.keypoints_scene, data.descriptors_scene);
+  double t2 = PerfStats::now();
+
+  stream.estimator->measure(data.keypoints_scene, data.descriptors_scene, data.result);
+  stream.estimator->track(data.result, data.timestamp);
+  double t3 = PerfStats::now();
+
+  stream.timings.capture.add(t1 - t0);
+  stream.timings.detect.add(t2 - t1);
+  stream.timings.estimate.add(t3 - t2);
+  stream.timings.frame.add(t3 - t0);
+
+  const PoseResult &result = data.result;
+  stream.writer.write(data.index, result.R_estimated, result.t_estimated, result.n_inliers,
+                      result.good_measurement, t3 - t0);
+  return true;
+}
+
+// Runs several cameras in one process, headless. The model, its index and the mesh
+// are shared, every stream has its own estimator and pose track. A fixed pool of
+// workers takes the streams from a ready queue, one frame at a time: a stream is
+// processed by one worker at a time, so its frames stay in order, and no stream
+// waits for more than one frame of each other stream. The idle workers sleep on
+// the queue; a worker reading a camera blocks until its next frame.
+void runStreams(vector<Ptr<CameraStream> > &streams, const Model &model, const Ptr<ModelIndex> &model_index,
+                PoseWriter::Format format)
+{
+  int n_streams = (int)streams.size();
+  vector<int> active;
+
+  for(int s = 0; s < n_streams; ++s)
+  {
+    CameraStream &stream = *streams[s];
+    string output_path = output_dir + "/stream" + IntToString(s) + (format == PoseWriter::BINARY ? ".bin" : ".csv");
+
+    if(!openCapture(stream.cap, stream.source) || !stream.writer.open(output_path, format))
+    {
+      cerr << "Skipping " << stream.source << ": could not open "
+           << (stream.cap.isOpened() ? output_path : stream.source) << endl;
+      continue;
+    }
+
+    stream.estimator = makePtr<PoseEstimator>(model, model_index, stream.config);
+    cout << "Stream " << s << ": " << stream.source << " -> " << output_path << endl;
+    active.push_back(s);
+  }
+
+  int workers = numWorkers > 0 ? numWorkers : (int)thread::hardware_concurrency();
+  workers = max(1, min(workers, (int)active.size()));
+
+  cout << "Processing " << active.size() << " streams with " << workers << " workers" << endl;
+
+  StreamQueue ready((int)active.size());
+  for(size_t i = 0; i < active.size(); ++i) ready.push(active[i]);
+  double start = PerfStats::now();
+
+  vector<thread> pool;
+  for(int w = 0; w < workers; ++w)
+  {
+    pool.push_back(thread([&]()
+    {
+      int s;
+      while(ready.pop(s))
+      {
+        CameraStream &stream = *streams[s];
+        if(processStreamFrame(stream))
+        {
+          ready.push(s);
+        }
+        else
+        {
+          stream.writer.close();
+          ready.finish();
+        }
+      }
+    }));
+  }
+
+  for(size_t w = 0; w < pool.size(); ++w) pool[w].join();
+
+  double elapsed = PerfStats::now() - start;
+  for(int s = 0; s < n_streams; ++s)
+  {
+    const FrameTimings &timings = streams[s]->timings;
+    if(timings.frame.count() == 0) continue;
+    cout << "Stream " << s << ": " << timings.frame.count() << " frames, "
+         << timings.frame.mean() << " ms/frame, "
+         << timings.frame.count() * 1000.0 / elapsed << " FPS" << endl;
+  }
+
+  cout << "Streams done in " << elapsed / 1000.0 << " s" << endl;
+  cout << "Latency per stage:" << endl;
+  printStageTimings(cout);
+}
+
+
+/**  Main program  **/
+int main(int argc, char *argv[])
+{
+
+  help();
+
+  const String keys =
+      "{help h        |      | print this message                   }"
+      "{video v       |      | path to recorded video               }"
+      "{model         |      | path to yml model                    }"
+      "{mesh          |      | path to ply mesh                     }"
+      "{keypoints k   |2000  | number of keypoints to detect        }"
+      "{ratio r       |0.7   | threshold for ratio test             }"
+      "{iterations it |500   | RANSAC maximum iterations count      }"
+      "{error e       |2.0   | RANSAC reprojection errror           }"
+      "{confidence c  |0.95  | RANSAC confidence                    }"
+      "{inliers in    |30    | minimum inliers for Kalman update    }"
+      "{stats         |0     | print the latency of each stage every N seconds, 0 only at the end }"
+      "{lost          |10    | Kalman variance growth without measurement at which the track is lost }"
+      "{method  pnp   |0     | PnP method: (0) ITERATIVE - (1) EPNP - (2) P3P - (3) DLS}"
+      "{fast f        |true  | use of robust fast match             }"
+      "{visibility    |false | match only model points facing the predicted camera}"
+      "{gating        |false | match only model points at a compatible pyramid octave (fast match)}"
+      "{octaves       |1.0   | max octave difference for scale gating }"
+      "{live          |false | real time: always process the newest frame and drop the stale ones }"
+      "{pipeline      |false | run capture, detection, matching and rendering on parallel threads}"
+      "{queue         |2     | frames buffered between two pipeline stages }"
+      "{headless      |false | run without GUI and print the per-frame latency at the end }"
+      "{batch         |      | file listing one video per line, processed headless on a worker pool }"
+      "{workers       |0     | batch worker threads, 0 for one per hardware thread }"
+      "{output o      |.     | batch output directory for the pose tracks }"
+      "{format        |csv   | batch pose track format: csv or bin }"
+      "{downscale     |1.0   | detect on the grayscale frame resized by this factor (0, 1] }"
+      "{latency       |0     | target per-frame latency in ms: tune keypoints and RANSAC iterations per frame }"
+      "{parallel      |false | offline: detect and match many frames at once, then filter them in order }"
+      "{streams       |      | file listing one camera per line: video or device and optional fx fy cx cy; a worker waits in the read of a camera, use one worker per camera }"
+      "{trace         |      | write the spans of the stages as Chrome trace-event JSON (PNP_ENABLE_TRACING builds) }"
+      ;
+  CommandLineParser parser(argc, argv, keys);
+
+  if (parser.has("help"))
+  {
+      parser.printMessage();
+      return 0;
+  }
+  else
+  {
+    video_read_path = parser.get<string>("video").size() > 0 ? parser.get<string>("video") : video_read_path;
+    yml_read_path = parser.get<string>("model").size() > 0 ? parser.get<string>("model") : yml_read_path;
+    ply_read_path = parser.get<string>("mesh").size() > 0 ? parser.get<string>("mesh") : ply_read_path;
+    config.num_keypoints = !parser.has("keypoints") ? parser.get<int>("keypoints") : config.num_keypoints;
+    config.ratio_test = !parser.has("ratio") ? parser.get<float>("ratio") : config.ratio_test;
+    config.fast_match = !parser.has("fast") ? parser.get<bool>("fast") : config.fast_match;
+    config.ransac_iterations = !parser.has("iterations") ? parser.get<int>("iterations") : config.ransac_iterations;
+    config.reprojection_error = !parser.has("error") ? parser.get<float>("error") : config.reprojection_error;
+    config.confidence = !parser.has("confidence") ? parser.get<float>("confidence") : config.confidence;
+    config.min_inliers_kalman = !parser.has("inliers") ? parser.get<int>("inliers") : config.min_inliers_kalman;
+    config.lost_covariance_growth = parser.get<double>("lost");
+    config.pnp_method = !parser.has("method") ? parser.get<int>("method") : config.pnp_method;
+    config.visibility = parser.get<bool>("visibility");
+    config.gating = parser.get<bool>("gating");
+    config.octave_tolerance = parser.get<float>("octaves");
+    config.downscale = parser.get<double>("downscale");
+    pipeline = parser.get<bool>("pipeline");
+    live = parser.get<bool>("live");
+    queueSize = max(1, parser.get<int>("queue"));
+    headless = parser.get<bool>("headless");
+    batch_read_path = parser.get<string>("batch");
+    numWorkers = parser.get<int>("workers");
+    output_dir = parser.get<string>("output");
+    output_format = parser.get<string>("format");
+    frameParallel = parser.get<bool>("parallel");
+    targetLatency = parser.get<double>("latency");
+    streams_read_path = parser.get<string>("streams");
+    statsInterval = parser.get<double>("stats");
+    trace_write_path = parser.get<string>("trace");
+  }
+
+  if(!trace_write_path.empty() && !traceCompiled())
+  {
+    cout << "The tracing is not compiled in, rebuild with -DPNP_ENABLE_TRACING=ON for --trace" << endl;
+    trace_write_path = "";
+  }
+
+  Model model;               // instantiate Model object
+  model.load(yml_read_path); // load a 3D textured object model
+
+  Mesh mesh;                 // instantiate Mesh object
+  mesh.load(ply_read_path);  // load an object mesh
 
-    if(good_measurement)
+  if(config.visibility && model.get_normals().empty())
+  {
+    cout << "The model has no surface normals, visibility pruning disabled" << endl;
+    config.visibility = false;
+  }
+
+  if(config.gating && model.get_feature_sizes().size() != model.get_points3d().size())
+  {
+    cout << "The model has no keypoint sizes and no single registration view, scale gating disabled" << endl;
+    config.gating = false;
+  }
+
+  if(!streams_read_path.empty() && (live || pipeline || frameParallel || !batch_read_path.empty() || targetLatency > 0))
+  {
+    cout << "The multi-stream mode runs one sequential loop per camera, --live, --pipeline, --parallel, --batch and --latency ignored" << endl;
+    live = pipeline = frameParallel = false;
+    batch_read_path = "";
+    targetLatency = 0;
+  }
+
+  if(live && (frameParallel || pipeline || !batch_read_path.empty()))
+  {
+    cout << "The live mode processes one stream in real time, --pipeline, --parallel and --batch ignored" << endl;
+    frameParallel = pipeline = false;
+    batch_read_path = "";
+  }
+
+  if(frameParallel && (config.visibility || config.gating))
+  {
+    cout << "Visibility pruning and scale gating need the previous pose, disabled in parallel mode" << endl;
+    config.visibility = config.gating = false;
+  }
+
+  if(targetLatency > 0 && (frameParallel || pipeline))
+  {
+    cout << "The latency controller needs the sequential loop, disabled" << endl;
+    targetLatency = 0;
+  }
+
+  // The index of the model descriptors is built once, not per frame
+  Ptr<ModelIndex> model_index = PoseEstimator::createIndex(model);
+
+  if(!streams_read_path.empty())
+  {
+    vector<Ptr<CameraStream> > streams;
+    if(!readStreamList(streams_read_path, streams) || streams.empty())
     {
-      drawObjectMesh(frame_vis, &mesh, &pnp_detection, green);  // draw current pose
+      cout << "Could not read any stream from " << streams_read_path << endl;
+      return -1;
     }
-    else
+
+    PoseWriter::Format format = output_format == "bin" ? PoseWriter::BINARY : PoseWriter::CSV;
+    runStreams(streams, model, model_index, format);
+    writeTrace();
+    return 0;
+  }
+
+  if(!batch_read_path.empty())
+  {
+    vector<string> videos;
+    if(!readVideoList(batch_read_path, videos) || videos.empty())
     {
-      drawObjectMesh(frame_vis, &mesh, &pnp_detection_est, yellow); // draw estimated pose
+      cout << "Could not read any video from " << batch_read_path << endl;
+      return -1;
     }
 
-    float l = 5;
-    vector<Point2f> pose_points2d;
-    pose_points2d.push_back(pnp_detection_est.backproject3DPoint(Point3f(0,0,0)));  // axis center
-    pose_points2d.push_back(pnp_detection_est.backproject3DPoint(Point3f(l,0,0)));  // axis x
-    pose_points2d.push_back(pnp_detection_est.backproject3DPoint(Point3f(0,l,0)));  // axis y
-    pose_points2d.push_back(pnp_detection_est.backproject3DPoint(Point3f(0,0,l)));  // axis z
-    draw3DCoordinateAxes(frame_vis, pose_points2d);           // draw axes
+    PoseWriter::Format format = output_format == "bin" ? PoseWriter::BINARY : PoseWriter::CSV;
+    headless = true;
+    runBatch(videos, model, model_index, mesh, format);
+    writeTrace();
+    return 0;
+  }
 
-    // FRAME RATE
+  // Pose estimation: matcher, PnP problems and Kalman Filter
+  PoseEstimator estimator(model, model_index, config);
 
-    // see how much time has elapsed
-    time(&end);
 
-    // calculate current FPS
-    ++counter;
-    sec = difftime (end, start);
+  // Create & Open Window
+  if(!headless && !frameParallel) namedWindow("REAL TIME DEMO", WINDOW_KEEPRATIO);
 
-    fps = counter / sec;
 
-    drawFPS(frame_vis, fps, yellow); // frame ratio
-    double detection_ratio = ((double)inliers_idx.rows/(double)good_matches.size())*100;
-    drawConfidence(frame_vis, detection_ratio, yellow);
+  VideoCapture cap;            // instantiate VideoCapture
+  openCapture(cap, video_read_path);   // a camera device or a recorded video
+  cameraSource = isCameraDevice(video_read_path);
 
+  if(!cap.isOpened())   // check if we succeeded
+  {
+    cout << "Could not open the camera device" << endl;
+    return -1;
+  }
 
-    // -- Step X: Draw some debugging text
+  FrameTimings timings;
 
-    // Draw some debug text
-    int inliers_int = inliers_idx.rows;
-    int outliers_int = (int)good_matches.size() - inliers_int;
-    string inliers_str = IntToString(inliers_int);
-    string outliers_str = IntToString(outliers_int);
-    string n = IntToString((int)good_matches.size());
-    string text = "Found " + inliers_str + " of " + n + " matches";
-    string text2 = "Inliers: " + inliers_str + " - Outliers: " + outliers_str;
+  if(frameParallel)
+  {
+    vector<Ptr<PoseEstimator> > workers;
+    createFrameWorkers(model, model_index, workers);
+    headless = true;
+    runFrameParallel(cap, workers, estimator, timings);
+  }
+  else if(live)
+  {
+    Ptr<LatencyController> controller = createLatencyController(estimator);
+    runLive(cap, estimator, mesh, timings, controller.get());
+  }
+  else if(pipeline)
+  {
+    // The detection and the matching stages use different members of the estimator
+    runPipeline(cap, estimator, mesh, timings);
+  }
+  else
+  {
+    Ptr<LatencyController> controller = createLatencyController(estimator);
+    runSequential(cap, estimator, mesh, timings, NULL, controller.get());
+  }
 
-    drawText(frame_vis, text, green);
-    drawText2(frame_vis, text2, red);
+  writeTrace();
 
-    imshow("REAL TIME DEMO", frame_vis);
+  if(headless)
+  {
+    printTimings(timings);
+    return 0;
   }
 
   // Close and Destroy Window
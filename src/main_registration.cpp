@@ -1,5 +1,6 @@
 // C++
 #include <iostream>
+#include <sstream>
 // OpenCV
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -23,6 +24,7 @@ string tutorial_path = "../../samples/cpp/tutorial_code/calib3d/real_time_pose_e
 string img_path = tutorial_path + "Data/resized_IMG_3875.JPG";  // image to register
 string ply_read_path = tutorial_path + "Data/box.ply";          // object mesh
 string write_path = tutorial_path + "Data/cookies_ORB.yml";     // output file
+string pose_write_path = "";                                    // output pose of the registered image
 
 // Boolean the know if the registration it's done
 bool end_registration = false;
@@ -36,6 +38,11 @@ double params_CANON[] = { width*f/sx,   // fx
                           width/2,      // cx
                           height/2};    // cy
 
+// Multi-view registration parameters
+vector<string> views_read_paths;   // one pose file per view
+float merge_radius = 0.5f;         // max distance between merged 3D points
+double merge_distance = 50;        // max descriptor distance between merged points
+
 // Setup the points to register in the image
 // In the order of the *.ply file and starting at 1
 int n = 8;
@@ -60,6 +67,9 @@ PnPProblem pnp_registration(params_CANON);
 
 /**  Functions headers  **/
 void help();
+int addViewToModel(const Mat &img, PnPProblem &pnp, RobustMatcher &rmatcher);
+bool savePose(const string &path, const string &image_path, const double params[], PnPProblem &pnp);
+int registerViews(RobustMatcher &rmatcher);
 
 // Mouse events for model registration
 static void onMouseModelRegistration( int event, int x, int y, int, void* )
@@ -82,11 +92,45 @@ static void onMouseModelRegistration( int event, int x, int y, int, void* )
 }
 
 /**  Main program  **/
-int main()
+int main(int argc, char *argv[])
 {
 
   help();
 
+  const String keys =
+      "{help h        |      | print this message                   }"
+      "{image i       |      | path to the image to register        }"
+      "{mesh          |      | path to ply mesh                     }"
+      "{output o      |      | path to the output model             }"
+      "{pose          |      | write the registered image pose to this file }"
+      "{views         |      | comma separated pose files of several views to merge }"
+      "{radius        |0.5   | max distance between merged 3D points }"
+      "{distance      |50    | max descriptor distance between merged points }"
+      ;
+  CommandLineParser parser(argc, argv, keys);
+
+  if (parser.has("help"))
+  {
+      parser.printMessage();
+      return 0;
+  }
+  else
+  {
+    img_path = parser.get<string>("image").size() > 0 ? parser.get<string>("image") : img_path;
+    ply_read_path = parser.get<string>("mesh").size() > 0 ? parser.get<string>("mesh") : ply_read_path;
+    write_path = parser.get<string>("output").size() > 0 ? parser.get<string>("output") : write_path;
+    pose_write_path = parser.get<string>("pose");
+    merge_radius = parser.get<float>("radius");
+    merge_distance = parser.get<double>("distance");
+
+    stringstream views(parser.get<string>("views"));
+    string view;
+    while (getline(views, view, ','))
+    {
+      if (!view.empty()) views_read_paths.push_back(view);
+    }
+  }
+
   // load a mesh given the *.ply file path
   mesh.load(ply_read_path);
 
@@ -98,6 +142,12 @@ int main()
   Ptr<FeatureDetector> detector = ORB::create(numKeyPoints);
   rmatcher.setFeatureDetector(detector);
 
+  // Several views with known poses: no interaction needed
+  if (!views_read_paths.empty())
+  {
+    return registerViews(rmatcher);
+  }
+
   /**  GROUND TRUTH OF THE FIRST IMAGE  **/
 
   // Create & Open Window
@@ -177,6 +227,12 @@ int main()
     vector<Point2f> list_points2d_mesh = pnp_registration.verify_points(&mesh);
     draw2DPoints(img_vis, list_points2d_mesh, green);
 
+    // Keep the pose to merge this view with others later
+    if (!pose_write_path.empty() && savePose(pose_write_path, img_path, params_CANON, pnp_registration))
+    {
+      cout << "Pose saved to " << pose_write_path << endl;
+    }
+
   } else {
     cout << "Correspondence not found" << endl << endl;
   }
@@ -190,30 +246,7 @@ int main()
 
    /** COMPUTE 3D of the image Keypoints **/
 
-  // Containers for keypoints and descriptors of the model
-  vector<KeyPoint> keypoints_model;
-  Mat descriptors;
-
-  // Compute keypoints and descriptors
-  rmatcher.computeKeyPoints(img_in, keypoints_model);
-  rmatcher.computeDescriptors(img_in, keypoints_model, descriptors);
-
-  // Check if keypoints are on the surface of the registration image and add to the model
-  for (unsigned int i = 0; i < keypoints_model.size(); ++i) {
-    Point2f point2d(keypoints_model[i].pt);
-    Point3f point3d;
-    bool on_surface = pnp_registration.backproject2DPoint(&mesh, point2d, point3d);
-    if (on_surface)
-    {
-        model.add_correspondence(point2d, point3d);
-        model.add_descriptor(descriptors.row(i));
-        model.add_keypoint(keypoints_model[i]);
-    }
-    else
-    {
-        model.add_outlier(point2d);
-    }
-  }
+  addViewToModel(img_in, pnp_registration, rmatcher);
 
   // save the model into a *.yaml file
   model.save(write_path);
@@ -255,6 +288,119 @@ int main()
 
 }
 
+/**********************************************************************************************************/
+// Backproject the keypoints of a registered image and add those on the object surface to the model
+int addViewToModel(const Mat &img, PnPProblem &pnp, RobustMatcher &rmatcher)
+{
+  // Containers for keypoints and descriptors of the model
+  vector<KeyPoint> keypoints_model;
+  Mat descriptors;
+
+  // Compute keypoints and descriptors
+  rmatcher.computeKeyPoints(img, keypoints_model);
+  rmatcher.computeDescriptors(img, keypoints_model, descriptors);
+
+  // Keypoint sizes are converted to model units at their depth
+  Mat P = pnp.get_P_matrix();
+  double fx = pnp.get_A_matrix().at<double>(0, 0);
+
+  // Check if keypoints are on the surface of the registration image and add to the model
+  int num_added = 0;
+  for (unsigned int i = 0; i < keypoints_model.size(); ++i) {
+    Point2f point2d(keypoints_model[i].pt);
+    Point3f point3d, normal3d;
+    bool on_surface = pnp.backproject2DPoint(&mesh, point2d, point3d, normal3d);
+    if (on_surface)
+    {
+        model.add_correspondence(point2d, point3d);
+        model.add_descriptor(descriptors.row(i));
+        model.add_keypoint(keypoints_model[i]);
+        model.add_normal(normal3d);
+
+        double depth = P.at<double>(2,0)*point3d.x + P.at<double>(2,1)*point3d.y +
+                       P.at<double>(2,2)*point3d.z + P.at<double>(2,3);
+        model.add_feature_size((float)(keypoints_model[i].size * depth / fx));
+        num_added++;
+    }
+    else
+    {
+        model.add_outlier(point2d);
+    }
+  }
+
+  return num_added;
+}
+
+/**********************************************************************************************************/
+// Write the pose and intrinsics of a registered image
+bool savePose(const string &path, const string &image_path, const double params[], PnPProblem &pnp)
+{
+  FileStorage storage(path, FileStorage::WRITE);
+  if (!storage.isOpened()) return false;
+
+  storage << "image" << image_path;
+  storage << "intrinsics" << Mat(1, 4, CV_64F, (void*)params);
+  storage << "R" << pnp.get_R_matrix();
+  storage << "t" << pnp.get_t_matrix();
+
+  storage.release();
+  return true;
+}
+
+/**********************************************************************************************************/
+// Build a single model from several images with known poses, merging the duplicated descriptors
+int registerViews(RobustMatcher &rmatcher)
+{
+  for (size_t i = 0; i < views_read_paths.size(); ++i)
+  {
+    FileStorage storage(views_read_paths[i], FileStorage::READ);
+    if (!storage.isOpened())
+    {
+      cout << "Could not open the pose file " << views_read_paths[i] << endl;
+      return -1;
+    }
+
+    string view_img_path;
+    Mat intrinsics, R, t;
+    storage["image"] >> view_img_path;
+    storage["intrinsics"] >> intrinsics;
+    storage["R"] >> R;
+    storage["t"] >> t;
+    storage.release();
+
+    if (intrinsics.total() != 4 || R.empty() || t.empty())
+    {
+      cout << "Missing intrinsics or pose in " << views_read_paths[i] << endl;
+      return -1;
+    }
+
+    Mat img = imread(view_img_path, IMREAD_COLOR);
+    if (!img.data)
+    {
+      cout << "Could not open or find the image " << view_img_path << endl;
+      return -1;
+    }
+
+    intrinsics.convertTo(intrinsics, CV_64F);
+    PnPProblem pnp_view(intrinsics.ptr<double>());
+    pnp_view.set_pose(R, t);
+
+    int num_added = addViewToModel(img, pnp_view, rmatcher);
+    cout << view_img_path << ": " << num_added << " points on the object surface" << endl;
+  }
+
+  int num_points = model.get_numDescriptors();
+  int num_removed = model.compact(merge_radius, merge_distance);
+  cout << "Merged " << num_points << " points into " << num_points - num_removed << endl;
+
+  // save the model into a *.yaml file
+  model.save(write_path);
+
+  cout << "Model saved to " << write_path << endl;
+
+  return 0;
+}
+
 /**********************************************************************************************************/
 void help()
 {
@@ -263,6 +409,7 @@ void help()
   << "This program shows how to create your 3D textured model. "                    << endl
   << "Usage:"                                                                       << endl
   << "./cpp-tutorial-pnp_registration"                                              << endl
+  << "./cpp-tutorial-pnp_registration --views=pose1.yml,pose2.yml --output=model.yml" << endl
   << "--------------------------------------------------------------------------"   << endl
   << endl;
 }
@@ -0,0 +1,367 @@
+// C++
+#include <cmath>
+#include <iostream>
+#include <sstream>
+// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+// PnP Tutorial
+#include "GroundTruth.h"
+#include "Mesh.h"
+#include "MeshRenderer.h"
+#include "PoseEstimator.h"
+
+/**  GLOBAL VARIABLES  **/
+
+using namespace cv;
+using namespace std;
+
+string tutorial_path = "../";
+
+string ply_read_path = tutorial_path + "Data/box.ply";   // mesh
+vector<string> views_read_paths;                         // pose files of the registered images, the textures
+string video_write_path = "synth.avi";                   // frames, or an image sequence like frames/%04d.png
+string background_read_path = "";                        // background image, a random texture if empty
+
+// Camera: the intrinsics of pnp_detection
+PoseEstimatorConfig config;
+Size frameSize(640, 480);
+double fps = 30;
+
+// Trajectory parameters
+string trajectory = "orbit";  // orbit, approach or shake
+int numFrames = 300;
+double amplitude = 30;        // orbit and shake: max angle from the registered view, degrees
+double cameraDistance = 0;    // camera to object center, 0 for the object over half the frame width
+double shake = 0.01;          // shake: camera position noise, fraction of the distance
+
+// Image degradations
+double noise = 0;             // gaussian pixel noise standard deviation
+double blur = 0;              // gaussian blur sigma in pixels
+double occlusion = 0;         // fraction of the object bounding box hidden by a moving occluder
+int seed = 0;
+
+
+void help()
+{
+cout
+<< "--------------------------------------------------------------------------"   << endl
+<< "This program renders the mesh textured from registered images along a "
+<< "camera trajectory, and writes the frames with the true pose of each one."     << endl
+<< "Usage:"                                                                       << endl
+<< "./pnp_synth --views=pose1.yml --trajectory=orbit --noise=2 --output=synth.avi" << endl
+<< "--------------------------------------------------------------------------"   << endl
+<< endl;
+}
+
+
+/**  TRAJECTORIES  **/
+
+Vec3d normalized(const Vec3d &v)
+{
+  double n = norm(v);
+  return n > 0 ? v * (1.0 / n) : v;
+}
+
+// The pose of a camera at C looking at the target, its image y axis close to down
+void lookAt(const Vec3d &C, const Vec3d &target, const Vec3d &down, Mat &R, Mat &t)
+{
+  Vec3d z = normalized(target - C);
+  Vec3d x = normalized(down.cross(z));
+  Vec3d y = z.cross(x);
+
+  R.create(3, 3, CV_64F);
+  for (int j = 0; j < 3; ++j)
+  {
+    R.at<double>(0, j) = x[j];
+    R.at<double>(1, j) = y[j];
+    R.at<double>(2, j) = z[j];
+  }
+
+  t.create(3, 1, CV_64F);
+  for (int i = 0; i < 3; ++i)
+  {
+    t.at<double>(i) = -(R.at<double>(i, 0) * C[0] + R.at<double>(i, 1) * C[1] + R.at<double>(i, 2) * C[2]);
+  }
+}
+
+// The frame of the first registered view, where the texture is: the direction from
+// the object center to the camera and the image right and down directions
+struct ViewFrame
+{
+  Vec3d center, back, right, down;
+};
+
+ViewFrame viewFrame(const Point3d &center, const Mat &R, const Mat &t)
+{
+  Mat R64, t64;
+  R.convertTo(R64, CV_64F);
+  t.convertTo(t64, CV_64F);
+  Mat C = -R64.t() * t64;
+
+  ViewFrame frame;
+  frame.center = Vec3d(center.x, center.y, center.z);
+  frame.back = normalized(Vec3d(C.at<double>(0), C.at<double>(1), C.at<double>(2)) - frame.center);
+
+  Vec3d right(R64.at<double>(0, 0), R64.at<double>(0, 1), R64.at<double>(0, 2));
+  frame.right = normalized(right - frame.back * right.dot(frame.back));
+  frame.down = (-frame.back).cross(frame.right);
+  return frame;
+}
+
+// The camera pose of a frame k of the trajectory
+void trajectoryPose(int k, const ViewFrame &view, double dist, RNG &rng, Mat &R, Mat &t)
+{
+  const double s = numFrames > 1 ? (double)k / (numFrames - 1) : 0;   // 0 to 1 over the sequence
+  const double amp = amplitude * CV_PI / 180.0;
+
+  double azimuth = 0, elevation = 0, d = dist;
+  Vec3d target = view.center;
+
+  if (trajectory == "approach")
+  {
+    d = dist * (2.0 - 1.3 * s);   // from twice to 0.7 times the distance
+  }
+  else
+  {
+    azimuth = amp * sin(2 * CV_PI * s);
+    elevation = 0.5 * amp * sin(4 * CV_PI * s);
+  }
+
+  Vec3d direction = view.back * (cos(elevation) * cos(azimuth)) + view.right * (cos(elevation) * sin(azimuth)) +
+                    view.down * sin(elevation);
+  Vec3d C = view.center + direction * d;
+
+  // Hand held: the position and the aim point tremble
+  if (trajectory == "shake")
+  {
+    C += Vec3d(rng.gaussian(shake), rng.gaussian(shake), rng.gaussian(shake)) * dist;
+    target += Vec3d(rng.gaussian(shake), rng.gaussian(shake), rng.gaussian(shake)) * dist;
+  }
+
+  lookAt(C, target, view.down, R, t);
+}
+
+
+/**  IMAGE  **/
+
+// A gray blotchy texture, so that the background has some features as a real scene
+void randomBackground(Mat &background, RNG &rng)
+{
+  Mat small(frameSize.height / 16 + 1, frameSize.width / 16 + 1, CV_8UC3);
+  rng.fill(small, RNG::UNIFORM, Scalar::all(60), Scalar::all(200));
+  resize(small, background, frameSize, 0, 0, INTER_CUBIC);
+}
+
+// A rectangle sweeping over the object once over the sequence
+void drawOccluder(Mat &frame, const Rect &box, double s)
+{
+  if (occlusion <= 0 || box.area() == 0) return;
+
+  int w = cvRound(box.width * sqrt(occlusion));
+  int h = cvRound(box.height * sqrt(occlusion));
+  int x = box.x + cvRound((box.width - w) * s);
+  int y = box.y + (box.height - h) / 2;
+  rectangle(frame, Rect(x, y, w, h), Scalar(40, 90, 140), FILLED);
+}
+
+void degrade(Mat &frame, RNG &rng)
+{
+  if (blur > 0)
+  {
+    GaussianBlur(frame, frame, Size(0, 0), blur);
+  }
+  if (noise > 0)
+  {
+    Mat noisy, pixel_noise(frame.size(), CV_16SC3);
+    rng.fill(pixel_noise, RNG::NORMAL, Scalar::all(0), Scalar::all(noise));
+    frame.convertTo(noisy, CV_16S);
+    noisy += pixel_noise;
+    noisy.convertTo(frame, CV_8U);     // saturated
+  }
+}
+
+// Texture the renderer from the registered images, the pose files of pnp_registration --pose
+bool addViews(MeshRenderer &renderer, vector<Mat> &R_views, vector<Mat> &t_views)
+{
+  for (size_t i = 0; i < views_read_paths.size(); ++i)
+  {
+    FileStorage storage(views_read_paths[i], FileStorage::READ);
+    if (!storage.isOpened())
+    {
+      cout << "Could not open the pose file " << views_read_paths[i] << endl;
+      return false;
+    }
+
+    string view_img_path;
+    Mat intrinsics, R, t;
+    storage["image"] >> view_img_path;
+    storage["intrinsics"] >> intrinsics;
+    storage["R"] >> R;
+    storage["t"] >> t;
+    storage.release();
+
+    if (intrinsics.total() != 4 || R.empty() || t.empty())
+    {
+      cout << "Missing intrinsics or pose in " << views_read_paths[i] << endl;
+      return false;
+    }
+
+    Mat img = imread(view_img_path, IMREAD_COLOR);
+    if (!img.data)
+    {
+      cout << "Could not open or find the image " << view_img_path << endl;
+      return false;
+    }
+
+    intrinsics.convertTo(intrinsics, CV_64F);
+    int textured = renderer.addView(img, intrinsics.ptr<double>(), R, t);
+    cout << view_img_path << ": " << textured << " triangles textured" << endl;
+
+    R_views.push_back(R);
+    t_views.push_back(t);
+  }
+  return true;
+}
+
+
+/**  Main program  **/
+int main(int argc, char *argv[])
+{
+
+  help();
+
+  const String keys =
+      "{help h        |      | print this message                   }"
+      "{mesh          |      | path to ply mesh                     }"
+      "{views         |      | comma separated pose files of registered images (pnp_registration --pose), the textures }"
+      "{output o      |synth.avi | output video, or an image sequence like frames/%04d.png }"
+      "{background    |      | background image, a random texture by default }"
+      "{trajectory    |orbit | camera trajectory: orbit, approach or shake }"
+      "{frames        |300   | number of frames                     }"
+      "{fps           |30    | frame rate                           }"
+      "{amplitude     |30    | orbit and shake: max angle from the registered view in degrees }"
+      "{distance      |0     | camera to object distance in mesh units, 0 for half the frame width }"
+      "{shake         |0.01  | shake: position noise as a fraction of the distance }"
+      "{noise         |0     | gaussian pixel noise standard deviation }"
+      "{blur          |0     | gaussian blur sigma in pixels        }"
+      "{occlusion     |0     | fraction of the object hidden by a moving occluder }"
+      "{seed          |0     | random seed                          }"
+      ;
+  CommandLineParser parser(argc, argv, keys);
+
+  if (parser.has("help"))
+  {
+      parser.printMessage();
+      return 0;
+  }
+  else
+  {
+    ply_read_path = parser.get<string>("mesh").size() > 0 ? parser.get<string>("mesh") : ply_read_path;
+    video_write_path = parser.get<string>("output");
+    background_read_path = parser.get<string>("background");
+    trajectory = parser.get<string>("trajectory");
+    numFrames = max(1, parser.get<int>("frames"));
+    fps = parser.get<double>("fps");
+    amplitude = parser.get<double>("amplitude");
+    cameraDistance = parser.get<double>("distance");
+    shake = parser.get<double>("shake");
+    noise = parser.get<double>("noise");
+    blur = parser.get<double>("blur");
+    occlusion = min(1.0, max(0.0, parser.get<double>("occlusion")));
+    seed = parser.get<int>("seed");
+
+    stringstream views(parser.get<string>("views"));
+    string view;
+    while (getline(views, view, ','))
+    {
+      if (!view.empty()) views_read_paths.push_back(view);
+    }
+  }
+
+  if (trajectory != "orbit" && trajectory != "approach" && trajectory != "shake")
+  {
+    cout << "Unknown trajectory " << trajectory << endl;
+    return -1;
+  }
+  if (views_read_paths.empty())
+  {
+    cout << "The textures need at least one registered image, see --views" << endl;
+    return -1;
+  }
+
+  Mesh mesh;
+  mesh.load(ply_read_path);
+  if (mesh.getNumVertices() == 0)
+  {
+    cout << "Could not load the mesh " << ply_read_path << endl;
+    return -1;
+  }
+
+  MeshRenderer renderer(mesh);
+  vector<Mat> R_views, t_views;
+  if (!addViews(renderer, R_views, t_views)) return -1;
+
+  RNG rng((uint64)seed);
+
+  Mat background;
+  if (!background_read_path.empty())
+  {
+    Mat img = imread(background_read_path, IMREAD_COLOR);
+    if (!img.data)
+    {
+      cout << "Could not open or find the image " << background_read_path << endl;
+      return -1;
+    }
+    resize(img, background, frameSize, 0, 0, INTER_AREA);
+  }
+  else
+  {
+    randomBackground(background, rng);
+  }
+
+  // By default the mesh diagonal covers half the frame width
+  const double *params = config.camera_params;
+  double dist = cameraDistance > 0 ? cameraDistance : params[0] * renderer.size() / (0.5 * frameSize.width);
+  ViewFrame view = viewFrame(renderer.center(), R_views[0], t_views[0]);
+
+  // An image sequence is written without compression
+  bool sequence = video_write_path.find('%') != string::npos;
+  VideoWriter writer(video_write_path, sequence ? 0 : VideoWriter::fourcc('M', 'J', 'P', 'G'), fps, frameSize);
+  if (!writer.isOpened())
+  {
+    cout << "Could not write " << video_write_path << endl;
+    return -1;
+  }
+
+  GroundTruth truth;
+  for (int i = 0; i < 4; ++i) truth.camera_params[i] = params[i];
+  truth.frame_size = frameSize;
+  truth.fps = fps;
+
+  Mat frame, R, t;
+  for (int k = 0; k < numFrames; ++k)
+  {
+    trajectoryPose(k, view, dist, rng, R, t);
+
+    background.copyTo(frame);
+    renderer.render(params, R, t, frame);
+    drawOccluder(frame, renderer.boundingRect(params, R, t), numFrames > 1 ? (double)k / (numFrames - 1) : 0);
+    degrade(frame, rng);
+
+    writer.write(frame);
+    truth.add(R, t);
+  }
+  writer.release();
+
+  string truth_write_path = GroundTruth::pathOf(video_write_path);
+  if (!truth.save(truth_write_path))
+  {
+    cout << "Could not write " << truth_write_path << endl;
+    return -1;
+  }
+
+  cout << numFrames << " frames written to " << video_write_path << ", poses to " << truth_write_path << endl;
+  return 0;
+}
@@ -1,20 +1,44 @@
-#include <opencv2/core/core.hpp>
-#include <opencv2/calib3d/calib3d.hpp>
-
+// C++
+#include <cmath>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <thread>
+// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+// PnP Tutorial
+#include "PerfStats.h"
+#include "TrackManager.h"
 
 using namespace std;
 using namespace cv;
 
-void generate3DPointCloud(vector<Point3f>& points, Point3f pmin = Point3f(-1,
+const char* const methodNames[] = { "ITERATIVE", "EPNP", "P3P", "DLS" };
+
+void help()
+{
+  cout
+  << "--------------------------------------------------------------------------"   << endl
+  << "This program benchmarks the PnP methods on synthetic scenes: latency "
+  << "percentiles, throughput and pose errors over grids of point counts, image "
+  << "noise and threads. With --tracks, it benchmarks instead the multi-object "
+  << "track manager over synthetic moving objects."                                 << endl
+  << "Usage:"                                                                       << endl
+  << "./pnp_test --points=10,100,1000 --noise=0,1 --threads=1,4 --output=pnp.json" << endl
+  << "./pnp_test --tracks=1,10,100,1000 --output=tracks.csv"                        << endl
+  << "--------------------------------------------------------------------------"   << endl
+  << endl;
+}
+
+void generate3DPointCloud(vector<Point3f>& points, RNG& rng, Point3f pmin = Point3f(-1,
         -1, 5), Point3f pmax = Point3f(1, 1, 10))
     {
         const Point3f delta = pmax - pmin;
         for (size_t i = 0; i < points.size(); i++)
         {
-            Point3f p(float(rand()) / RAND_MAX, float(rand()) / RAND_MAX,
-                float(rand()) / RAND_MAX);
+            Point3f p(rng.uniform(0.f, 1.f), rng.uniform(0.f, 1.f),
+                rng.uniform(0.f, 1.f));
             p.x *= delta.x;
             p.y *= delta.y;
             p.z *= delta.z;
@@ -23,16 +47,19 @@ void generate3DPointCloud(vector<Point3f>& points, Point3f pmin = Point3f(-1,
         }
     }
 
+// A pinhole camera in pixels, so that the image noise is in pixels too
 void generateCameraMatrix(Mat& cameraMatrix, RNG& rng)
 {
-    const double fcMinVal = 1e-3;
-    const double fcMaxVal = 100;
+    const double fcMinVal = 400;
+    const double fcMaxVal = 1200;
+    const double ccMinVal = 200;
+    const double ccMaxVal = 400;
     cameraMatrix.create(3, 3, CV_64FC1);
     cameraMatrix.setTo(Scalar(0));
     cameraMatrix.at<double>(0,0) = rng.uniform(fcMinVal, fcMaxVal);
     cameraMatrix.at<double>(1,1) = rng.uniform(fcMinVal, fcMaxVal);
-    cameraMatrix.at<double>(0,2) = rng.uniform(fcMinVal, fcMaxVal);
-    cameraMatrix.at<double>(1,2) = rng.uniform(fcMinVal, fcMaxVal);
+    cameraMatrix.at<double>(0,2) = rng.uniform(ccMinVal, ccMaxVal);
+    cameraMatrix.at<double>(1,2) = rng.uniform(ccMinVal, ccMaxVal);
     cameraMatrix.at<double>(2,2) = 1;
 }
 
@@ -56,87 +83,424 @@ void generatePose(Mat& rvec, Mat& tvec, RNG& rng)
     }
 }
 
-void data2file(const string& path, const vector<vector<double> >& data)
+
+/**  BENCHMARK  **/
+
+// One synthetic problem: the 3D points, their noisy projections, the camera and the true pose
+struct Scene
 {
-  std::fstream fs;
-  fs.open(path.c_str(), std::fstream::in | std::fstream::out | std::fstream::app);
+  vector<Point3f> points;
+  vector<Point2f> projected;
+  Mat intrinsics, distCoeffs;
+  Mat trueRvec, trueTvec;
+};
 
-  for (int method = 0; method < data.size(); ++method)
+void generateScene(Scene& scene, int npoints, double noise, RNG& rng)
+{
+  scene.points.resize(npoints);
+  generate3DPointCloud(scene.points, rng);
+  generateCameraMatrix(scene.intrinsics, rng);
+  generateDistCoeffs(scene.distCoeffs, rng);
+  generatePose(scene.trueRvec, scene.trueTvec, rng);
+
+  projectPoints(Mat(scene.points), scene.trueRvec, scene.trueTvec, scene.intrinsics, scene.distCoeffs,
+                scene.projected);
+
+  for (size_t i = 0; i < scene.projected.size(); ++i)
   {
-    for (int i = 0; i < data[method].size(); ++i)
+    scene.projected[i].x += (float)rng.gaussian(noise);
+    scene.projected[i].y += (float)rng.gaussian(noise);
+  }
+}
+
+// The result of one cell of the grid
+struct BenchmarkResult
+{
+  BenchmarkResult() : method(0), points(0), noise(0), threads(1), throughput(0), rotation_error(0),
+                      translation_error(0) {}
+
+  int method, points;
+  double noise;
+  int threads;
+  PerfStats latency;          // per solvePnP call, all threads
+  double throughput;          // calls per second, all threads
+  double rotation_error;      // mean norm of the rotation vector error
+  double translation_error;   // mean norm of the translation error
+};
+
+// Solves every scene on each thread after the warm-up calls. The scenes are shared
+// read-only, each thread keeps its own samples.
+void runCell(const vector<Scene>& scenes, int method, int threads, int warmup, BenchmarkResult& result)
+{
+  vector<vector<double> > latencies(threads);
+  vector<double> rotation_errors(threads, 0), translation_errors(threads, 0);
+
+  double start = PerfStats::now();
+
+  vector<thread> pool;
+  for (int t = 0; t < threads; ++t)
+  {
+    pool.push_back(thread([&, t]()
     {
-      fs << data[method][i] << " ";
-    }
-    fs << endl;
+      Mat rvec, tvec;
+      for (int i = 0; i < warmup; ++i)
+      {
+        const Scene& scene = scenes[i % scenes.size()];
+        solvePnP(scene.points, scene.projected, scene.intrinsics, scene.distCoeffs, rvec, tvec, false, method);
+      }
+
+      latencies[t].reserve(scenes.size());
+      for (size_t i = 0; i < scenes.size(); ++i)
+      {
+        const Scene& scene = scenes[i];
+
+        double t0 = PerfStats::now();
+        solvePnP(scene.points, scene.projected, scene.intrinsics, scene.distCoeffs, rvec, tvec, false, method);
+        latencies[t].push_back(PerfStats::now() - t0);
+
+        rotation_errors[t] += norm(rvec - scene.trueRvec);
+        translation_errors[t] += norm(tvec - scene.trueTvec);
+      }
+    }));
+  }
+  for (size_t t = 0; t < pool.size(); ++t) pool[t].join();
+
+  double elapsed = PerfStats::now() - start;
+
+  result.latency = PerfStats(methodNames[method]);
+  for (int t = 0; t < threads; ++t)
+  {
+    for (size_t i = 0; i < latencies[t].size(); ++i) result.latency.add(latencies[t][i]);
+    result.rotation_error += rotation_errors[t];
+    result.translation_error += translation_errors[t];
   }
 
-  fs.close();
+  double calls = (double)result.latency.count();
+  result.throughput = elapsed > 0 ? calls * 1000.0 / elapsed : 0;
+  result.rotation_error /= calls;
+  result.translation_error /= calls;
 }
 
+// A comma separated list of values
+template <typename T>
+vector<T> parseList(const string& text)
+{
+  vector<T> values;
+  istringstream ss(text);
+  string item;
+  while (getline(ss, item, ','))
+  {
+    istringstream value(item);
+    T v;
+    if (value >> v) values.push_back(v);
+  }
+  return values;
+}
 
-int main(int argc, char *argv[])
+void writeCsv(ostream& os, const vector<BenchmarkResult>& results)
 {
+  os << "method,points,noise,threads,calls,mean_ms,p50_ms,p99_ms,max_ms,throughput,rotation_error,translation_error"
+     << endl;
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const BenchmarkResult& r = results[i];
+    os << methodNames[r.method] << "," << r.points << "," << r.noise << "," << r.threads << ","
+       << r.latency.count() << "," << r.latency.mean() << "," << r.latency.percentile(50) << ","
+       << r.latency.percentile(99) << "," << r.latency.percentile(100) << "," << r.throughput << ","
+       << r.rotation_error << "," << r.translation_error << endl;
+  }
+}
 
-  RNG rng;
- // TickMeter tm;
-  vector<vector<double> > error_trans(4), error_rot(4), comp_time(4);
+void writeJson(ostream& os, const vector<BenchmarkResult>& results)
+{
+  os << "{" << endl
+     << "  \"opencv\": \"" << CV_VERSION << "\"," << endl
+     << "  \"hardware_threads\": " << thread::hardware_concurrency() << "," << endl
+     << "  \"results\": [" << endl;
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const BenchmarkResult& r = results[i];
+    os << "    {\"method\": \"" << methodNames[r.method] << "\", \"points\": " << r.points
+       << ", \"noise\": " << r.noise << ", \"threads\": " << r.threads
+       << ", \"calls\": " << r.latency.count() << ", \"mean_ms\": " << r.latency.mean()
+       << ", \"p50_ms\": " << r.latency.percentile(50) << ", \"p99_ms\": " << r.latency.percentile(99)
+       << ", \"max_ms\": " << r.latency.percentile(100) << ", \"throughput\": " << r.throughput
+       << ", \"rotation_error\": " << r.rotation_error << ", \"translation_error\": " << r.translation_error
+       << "}" << (i + 1 < results.size() ? "," : "") << endl;
+  }
+  os << "  ]" << endl << "}" << endl;
+}
+
+
+/**  TRACK MANAGER  **/
+
+// The result of one object count
+struct TrackResult
+{
+  TrackResult() : objects(0), frames(0), mean_tracks(0), tracked(0), id_switches(0), translation_error(0) {}
+
+  int objects, frames;
+  PerfStats latency;          // predict and update of one frame
+  double mean_tracks;         // tracks after each update, the objects plus the coasting ones
+  double tracked;             // fraction of the objects with a track of their model within a quarter unit
+  int id_switches;            // times the track of a tracked object changed
+  double translation_error;   // mean distance of a tracked object to its track
+};
+
+// Objects of 4 models on a grid one unit apart, drifting and spinning slowly,
+// measured at 30 fps with a translation noise of 0.02 and missed with probability
+// miss. Only predict() and update() are timed, the scoring is not.
+void runTracks(int objects, int frames, double miss, RNG& rng, TrackResult& result)
+{
+  const double dt = 1.0 / 30, noise = 0.02, radius = 0.25;
+  const int n_models = 4;
+  const int side = (int)std::ceil(std::pow((double)objects, 1.0 / 3) - 1e-9);
 
-  int maxpoints = 2000;
-  for (int npoints = 10; npoints < maxpoints+10; ++npoints)
+  vector<Vec3d> start(objects), velocity(objects), spin(objects);
+  for (int k = 0; k < objects; ++k)
   {
-    // generate 3D point cloud
-    vector<Point3f> points;
-    points.resize(npoints);
-    generate3DPointCloud(points);
+    start[k] = Vec3d(k % side, (k / side) % side, 5 + k / (side * side));
+    velocity[k] = Vec3d(rng.uniform(-0.03, 0.03), rng.uniform(-0.03, 0.03), rng.uniform(-0.03, 0.03));
+    spin[k] = Vec3d(rng.uniform(-1.0, 1.0), rng.uniform(-1.0, 1.0), rng.uniform(-1.0, 1.0));
+  }
 
-    // generate cameramatrix
-    Mat rvec, tvec;
-    Mat trueRvec, trueTvec;
-    Mat intrinsics, distCoeffs;
-    generateCameraMatrix(intrinsics, rng);
+  TrackManager tracks(dt);
+  vector<TrackMeasurement> measurements;
+  measurements.reserve(objects);
+  vector<Vec3d> track_positions;
+  vector<int> nearest(objects, -1);
+  Mat R, t;
 
-    // generate distorsion coefficients
-    generateDistCoeffs(distCoeffs, rng);
+  result.objects = objects;
+  result.frames = frames;
+  result.latency = PerfStats("tracks");
+  double tracks_sum = 0, error_sum = 0;
+  long long tracked_count = 0;
 
-    // generate groud truth pose
-    generatePose(trueRvec, trueTvec, rng);
+  for (int f = 0; f < frames; ++f)
+  {
+    const double time = f * dt;
 
-    for (int method = 0; method < 4; ++method)
+    measurements.clear();
+    for (int k = 0; k < objects; ++k)
     {
-      std::vector<Point3f> opoints;
-      if (method == 2)
+      if (rng.uniform(0.0, 1.0) < miss) continue;
+
+      TrackMeasurement measurement;
+      measurement.object_id = k % n_models;
+      measurement.t = start[k] + velocity[k] * time +
+                      Vec3d(rng.gaussian(noise), rng.gaussian(noise), rng.gaussian(noise));
+      Rodrigues(spin[k] * time, measurement.R);
+      measurements.push_back(measurement);
+    }
+
+    double t0 = PerfStats::now();
+    tracks.predict(time);
+    tracks.update(measurements);
+    result.latency.add(PerfStats::now() - t0);
+
+    // Score: the nearest track of the same model of each object
+    track_positions.resize(tracks.size());
+    for (int i = 0; i < tracks.size(); ++i)
+    {
+      tracks.pose(i, R, t);
+      track_positions[i] = Vec3d(t.at<double>(0), t.at<double>(1), t.at<double>(2));
+    }
+    tracks_sum += tracks.size();
+
+    for (int k = 0; k < objects; ++k)
+    {
+      const Vec3d position = start[k] + velocity[k] * time;
+      int best = -1;
+      double best_distance = 0;
+      for (int i = 0; i < tracks.size(); ++i)
       {
-        opoints = std::vector<Point3f>(points.begin(), points.begin()+4);
+        if (tracks.objectId(i) != k % n_models) continue;
+        const double distance = norm(track_positions[i] - position);
+        if (best < 0 || distance < best_distance)
+        {
+          best = i;
+          best_distance = distance;
+        }
       }
-      else
-        opoints = points;
+      if (best < 0 || best_distance > radius) continue;
 
-      vector<Point2f> projectedPoints;
-      projectedPoints.resize(opoints.size());
-      projectPoints(Mat(opoints), trueRvec, trueTvec, intrinsics, distCoeffs, projectedPoints);
+      const int track_id = tracks.trackId(best);
+      if (nearest[k] >= 0 && nearest[k] != track_id) result.id_switches++;
+      nearest[k] = track_id;
+      error_sum += best_distance;
+      tracked_count++;
+    }
+  }
 
-      //tm.reset(); tm.start();
+  result.mean_tracks = tracks_sum / frames;
+  result.tracked = (double)tracked_count / ((double)frames * objects);
+  result.translation_error = tracked_count > 0 ? error_sum / tracked_count : 0;
+}
 
-      solvePnP(opoints, projectedPoints, intrinsics, distCoeffs, rvec, tvec, false, method);
+void writeTrackCsv(ostream& os, const vector<TrackResult>& results)
+{
+  os << "objects,frames,mean_ms,p50_ms,p99_ms,max_ms,us_per_track,mean_tracks,tracked,id_switches,"
+     << "translation_error" << endl;
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const TrackResult& r = results[i];
+    os << r.objects << "," << r.frames << "," << r.latency.mean() << "," << r.latency.percentile(50) << ","
+       << r.latency.percentile(99) << "," << r.latency.percentile(100) << ","
+       << 1000.0 * r.latency.mean() / max(1, r.objects) << "," << r.mean_tracks << "," << r.tracked << ","
+       << r.id_switches << "," << r.translation_error << endl;
+  }
+}
+
+void writeTrackJson(ostream& os, const vector<TrackResult>& results)
+{
+  os << "{" << endl
+     << "  \"opencv\": \"" << CV_VERSION << "\"," << endl
+     << "  \"tracks\": [" << endl;
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const TrackResult& r = results[i];
+    os << "    {\"objects\": " << r.objects << ", \"frames\": " << r.frames
+       << ", \"mean_ms\": " << r.latency.mean() << ", \"p50_ms\": " << r.latency.percentile(50)
+       << ", \"p99_ms\": " << r.latency.percentile(99) << ", \"max_ms\": " << r.latency.percentile(100)
+       << ", \"us_per_track\": " << 1000.0 * r.latency.mean() / max(1, r.objects)
+       << ", \"mean_tracks\": " << r.mean_tracks << ", \"tracked\": " << r.tracked
+       << ", \"id_switches\": " << r.id_switches
+       << ", \"translation_error\": " << r.translation_error
+       << "}" << (i + 1 < results.size() ? "," : "") << endl;
+  }
+  os << "  ]" << endl << "}" << endl;
+}
+
+// Write the results by extension, *.json or *.csv
+template <typename Result>
+bool writeResults(const string& path, const vector<Result>& results,
+                  void (*csv)(ostream&, const vector<Result>&), void (*json)(ostream&, const vector<Result>&))
+{
+  ofstream file(path.c_str());
+  if (!file.is_open())
+  {
+    cout << "Could not write " << path << endl;
+    return false;
+  }
 
-     // tm.stop();
+  bool is_json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+  if (is_json) json(file, results);
+  else csv(file, results);
 
-    //  double compTime = tm.getTimeMilli();
-      double rvecDiff = norm(rvec-trueRvec), tvecDiff = norm(tvec-trueTvec);
+  cout << "Results written to " << path << endl;
+  return true;
+}
 
-      error_rot[method].push_back(rvecDiff);
-      error_trans[method].push_back(tvecDiff);
-      //comp_time[method].push_back(compTime);
 
+/**  Main program  **/
+int main(int argc, char *argv[])
+{
+
+  help();
+
+  const String keys =
+      "{help h        |                  | print this message                   }"
+      "{methods       |0,1,2,3           | PnP methods: (0) ITERATIVE - (1) EPNP - (2) P3P - (3) DLS }"
+      "{points        |10,50,100,500,1000| point counts (at least 6), P3P always uses 4 points }"
+      "{noise         |0,1               | image noise standard deviations in pixels }"
+      "{threads       |1                 | thread counts to sweep, each thread solves all the scenes }"
+      "{trials        |200               | timed scenes per cell                }"
+      "{warmup        |20                | untimed calls per thread before each cell }"
+      "{seed          |0                 | random seed of the scenes            }"
+      "{tracks        |                  | object counts of the track manager benchmark, run instead of the PnP methods }"
+      "{frames        |300               | frames per object count of the track manager benchmark }"
+      "{miss          |0.1               | probability that an object is not measured in a frame }"
+      "{output o      |                  | results file, *.json or *.csv        }"
+      ;
+  CommandLineParser parser(argc, argv, keys);
+
+  if (parser.has("help"))
+  {
+    parser.printMessage();
+    return 0;
+  }
+
+  vector<int> methods = parseList<int>(parser.get<string>("methods"));
+  vector<int> point_counts = parseList<int>(parser.get<string>("points"));
+  vector<double> noises = parseList<double>(parser.get<string>("noise"));
+  vector<int> thread_counts = parseList<int>(parser.get<string>("threads"));
+  int trials = max(1, parser.get<int>("trials"));
+  int warmup = max(0, parser.get<int>("warmup"));
+  uint64 seed = (uint64)parser.get<int>("seed");
+  string output_path = parser.get<string>("output");
+  vector<int> object_counts = parseList<int>(parser.get<string>("tracks"));
+
+  if (!object_counts.empty())
+  {
+    int frames = max(1, parser.get<int>("frames"));
+    double miss = parser.get<double>("miss");
+
+    vector<TrackResult> track_results;
+    for (size_t o = 0; o < object_counts.size(); ++o)
+    {
+      RNG rng(seed + object_counts[o]);
+      TrackResult result;
+      runTracks(max(1, object_counts[o]), frames, miss, rng, result);
+      track_results.push_back(result);
+
+      cout << "objects " << result.objects << ": " << 1000.0 * result.latency.mean() / result.objects
+           << " us per track, " << result.mean_tracks << " tracks, tracked " << 100.0 * result.tracked
+           << " %, " << result.id_switches
+           << " id switches, error " << result.translation_error << ", ";
+      result.latency.print(cout);
     }
 
-    //system("clear");
-    cout << "Completed " << npoints+1 << "/" << maxpoints << endl;
+    if (!output_path.empty() && !writeResults(output_path, track_results, writeTrackCsv, writeTrackJson))
+    {
+      return -1;
+    }
+    return 0;
+  }
+
+  vector<BenchmarkResult> results;
+  vector<Scene> scenes(trials);
 
+  for (size_t n = 0; n < noises.size(); ++n)
+  {
+    for (size_t p = 0; p < point_counts.size(); ++p)
+    {
+      for (size_t m = 0; m < methods.size(); ++m)
+      {
+        int method = methods[m];
+        if (method < 0 || method > 3) continue;
+
+        // P3P takes exactly 4 points: a single cell per noise level
+        int npoints = method == SOLVEPNP_P3P ? 4 : max(6, point_counts[p]);
+        if (method == SOLVEPNP_P3P && p > 0) continue;
+
+        // The same scenes for every method and thread count of a cell
+        RNG rng(seed + 1000003 * n + npoints);
+        for (int i = 0; i < trials; ++i) generateScene(scenes[i], npoints, noises[n], rng);
+
+        for (size_t t = 0; t < thread_counts.size(); ++t)
+        {
+          BenchmarkResult result;
+          result.method = method;
+          result.points = npoints;
+          result.noise = noises[n];
+          result.threads = max(1, thread_counts[t]);
+
+          runCell(scenes, method, result.threads, warmup, result);
+          results.push_back(result);
+
+          cout << methodNames[method] << " points " << npoints << " noise " << noises[n]
+               << " threads " << result.threads << ": ";
+          result.latency.print(cout);
+        }
+      }
+    }
   }
 
-  data2file("translation_error.txt", error_trans);
-  data2file("rotation_error.txt", error_rot);
-  data2file("computation_time.txt", comp_time);
+  if (!output_path.empty() && !writeResults(output_path, results, writeCsv, writeJson))
+  {
+    return -1;
+  }
 
+  return 0;
 }